@@ -0,0 +1,180 @@
+#!/usr/bin/perl
+
+#
+# deduplication benchmark for tagsistant
+#
+# copies a base file and some edited variants of it into a mounted
+# tagsistant and into a plain directory of the same filesystem, waits
+# for the deduplication queues to drain and reports the write and read
+# throughput against the plain copies, the space used by the archive
+# and the chunk store and the dedup ratio. Set [Deduplication]
+# chunk_store = true in repository.ini to measure the chunk store.
+# The files read back are compared with the originals.
+#
+# usage: dedup_benchmark.pl <mountpoint> <repository> [size in MiB]
+#
+
+use strict;
+use warnings;
+
+use Time::HiRes qw(time sleep);
+
+my ($MP, $REPOSITORY, $SIZE) = @ARGV;
+die "usage: $0 <mountpoint> <repository> [size in MiB]\n" unless $MP and $REPOSITORY;
+$SIZE ||= 64;
+
+my $MiB = 1024 * 1024;
+my $TMP = "/tmp/tagsistant_dedup_benchmark.$$";
+my $PLAIN = "$REPOSITORY/dedup_benchmark_plain.$$";
+my $TAG = "dedup_benchmark_$$";
+
+mkdir $TMP or die "can't create $TMP: $!\n";
+mkdir $PLAIN or die "can't create $PLAIN: $!\n";
+
+#
+# the base file and its variants
+#
+system("dd if=/dev/urandom of=$TMP/base bs=1M count=$SIZE status=none") == 0 or die "can't create the base file\n";
+
+my %variants = (
+	'copy'            => sub { system("cp $TMP/base $TMP/copy") },
+	'appended'        => sub { system("cp $TMP/base $TMP/appended && head -c $MiB /dev/urandom >> $TMP/appended") },
+	'rewritten'       => sub { system("cp $TMP/base $TMP/rewritten && dd if=/dev/urandom of=$TMP/rewritten bs=4096 seek=" . int($SIZE * 128) . " count=16 conv=notrunc status=none") },
+	'block_inserted'  => sub { insert("block_inserted", 65536) },
+	'byte_inserted'   => sub { insert("byte_inserted", 100) },
+);
+
+foreach my $name (sort keys %variants) {
+	$variants{$name}->() == 0 or die "can't create the $name variant\n";
+}
+
+my @names = ('base', sort keys %variants);
+my $bytes = 0;
+$bytes += -s "$TMP/$_" foreach @names;
+
+#
+# copy the files into the plain directory and into tagsistant
+#
+drop_caches();
+my $start = time();
+foreach my $name (@names) {
+	system("cp $TMP/$name $PLAIN/") == 0 or die "can't copy $name\n";
+}
+system("sync");
+my $plain_write = time() - $start;
+
+system("touch $TMP/start");
+system("mkdir $MP/store/$TAG") == 0 or die "can't create tag $TAG\n";
+
+my $copy_start = time();
+foreach my $name (@names) {
+	system("cp $TMP/$name $MP/store/$TAG/@/") == 0 or die "can't copy $name\n";
+}
+my $copied = time();
+
+wait_for_queues();
+my $drained = time();
+
+#
+# read the files back, from the plain directory and from tagsistant
+#
+drop_caches();
+$start = time();
+system("cat $PLAIN/$_ > /dev/null") foreach @names;
+my $plain_read = time() - $start;
+
+drop_caches();
+$start = time();
+system("cat $MP/store/$TAG/@/$_ > /dev/null") foreach @names;
+my $tagsistant_read = time() - $start;
+
+my $mismatches = 0;
+foreach my $name (@names) {
+	next if system("cmp -s $TMP/$name $MP/store/$TAG/@/$name") == 0;
+	print "$name differs from the original!\n";
+	$mismatches++;
+}
+
+#
+# measure the space allocated to the objects and to the chunks created
+# by the benchmark
+#
+my ($logical, $archive, $chunks) = (0, 0, 0);
+my @objects = split /\n/, `find $REPOSITORY/archive -type f -newer $TMP/start`;
+my @chunks = split /\n/, `find $REPOSITORY/chunks -type f -newer $TMP/start 2>/dev/null`;
+
+foreach my $object (@objects) {
+	my ($size, $allocated) = allocation($object);
+	$logical += $size;
+	$archive += $allocated;
+	printf("%-60s %10d bytes, %10d allocated\n", $object, $size, $allocated);
+}
+
+foreach my $chunk (@chunks) {
+	$chunks += (allocation($chunk))[1];
+}
+
+my $physical = $archive + $chunks;
+
+printf("\n");
+printf("objects:               %d (%d chunks)\n", scalar @objects, scalar @chunks);
+printf("plain write:           %.1f MiB/s\n", $bytes / $MiB / $plain_write);
+printf("tagsistant write:      %.1f MiB/s\n", $bytes / $MiB / ($copied - $copy_start));
+printf("dedup throughput:      %.1f MiB/s (until the queues drained)\n", $bytes / $MiB / ($drained - $copy_start));
+printf("plain read:            %.1f MiB/s\n", $bytes / $MiB / $plain_read);
+printf("tagsistant read:       %.1f MiB/s\n", $bytes / $MiB / $tagsistant_read);
+printf("logical size:          %.1f MiB\n", $logical / $MiB);
+printf("archive allocation:    %.1f MiB\n", $archive / $MiB);
+printf("chunk store:           %.1f MiB\n", $chunks / $MiB);
+printf("dedup ratio:           %.2f\n", $physical ? $logical / $physical : 0);
+printf("mismatches:            %d\n", $mismatches);
+
+system("rm -rf $TMP $PLAIN");
+
+exit($mismatches ? 1 : 0);
+
+#
+# create a variant with random bytes inserted in the middle of the base file
+#
+sub insert {
+	my ($name, $length) = @_;
+	my $half = int($SIZE * $MiB / 2);
+	return system("(head -c $half $TMP/base; head -c $length /dev/urandom; tail -c +" . ($half + 1) . " $TMP/base) > $TMP/$name");
+}
+
+#
+# wait until stats/queues reports no queued objects twice in a row,
+# since new jobs wait for the settle delay before being queued
+#
+sub wait_for_queues {
+	my $idle = 0;
+	while ($idle < 2) {
+		sleep(1);
+		my $stats = `cat $MP/stats/queues`;
+		my $queued = 0;
+		$queued += $1 while $stats =~ /# of queued objects: (\d+)/g;
+		$idle = $queued ? 0 : $idle + 1;
+	}
+}
+
+#
+# flush the page cache, so the reads hit the disk (root only)
+#
+sub drop_caches {
+	system("sync");
+	if (open(my $fh, '>', '/proc/sys/vm/drop_caches')) {
+		print $fh "3\n";
+		close($fh);
+	}
+}
+
+#
+# return the size of a file and the bytes allocated to it
+#
+sub allocation {
+	my ($file) = @_;
+	my @st = stat($file);
+	return ($st[7], $st[12] * 512);
+}
+
+# vim:ts=4:autoindent:nocindent:syntax=perl
@@ -23,8 +23,15 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#endif
+
 #define TAGSISTANT_AUTOTAGGING_SEPARATOR "<><><>"
 
 /****************************************************************************/
@@ -33,167 +40,2850 @@
 /***                                                                      ***/
 /****************************************************************************/
 
-/** deduplication queue */
 #if ! TAGSISTANT_INLINE_DEDUPLICATION
-GAsyncQueue *tagsistant_deduplication_queue;
+/** an object waiting for a deduplication worker or being processed by one */
+typedef struct {
+	/** the path of the object */
+	gchar *path;
+
+	/** the inode of the object */
+	tagsistant_inode inode;
+
+	/** the monotonic time before which the object is left alone */
+	gint64 due;
+
+	/** set when a newer version of the object has been scheduled */
+	gint cancelled;
+
+	/** the link of the job inside the deduplication queue */
+	GList *link;
+} tagsistant_deduplication_job;
+
+/**
+ * deduplication queue: the jobs waiting for a deduplication worker,
+ * in order of due time. The pending table maps the inode of each queued
+ * job to the job itself, so an object is never queued twice, while the
+ * running table maps the inode of the objects being processed to their
+ * jobs, to cancel them when the object changes again.
+ */
+static GQueue *tagsistant_deduplication_queue = NULL;
+static GHashTable *tagsistant_deduplication_pending = NULL;
+static GHashTable *tagsistant_deduplication_running = NULL;
+static GMutex tagsistant_deduplication_mutex;
+static GCond tagsistant_deduplication_not_empty;
+static GCond tagsistant_deduplication_not_full;
+
+/** the maximum number of queued paths, tagsistant_deduplicate() blocks beyond it */
+static guint tagsistant_deduplication_queue_size = TAGSISTANT_DEDUPLICATION_QUEUE_SIZE;
+
+/** how long an object must stay unchanged before being deduplicated, in microseconds */
+static gint64 tagsistant_deduplication_settle_delay = TAGSISTANT_DEDUPLICATION_SETTLE_DELAY * 1000;
+
+/** the job of the calling deduplication worker */
+static GPrivate tagsistant_deduplication_current_job = G_PRIVATE_INIT(NULL);
 #endif
 
-/** autotagging queue */
+/**
+ * autotagging queue: the inodes waiting for an autotagging worker. The
+ * pending table maps each queued inode to the paths to be autotagged,
+ * so a newer version of an object replaces the older one.
+ */
 GAsyncQueue *tagsistant_autotagging_queue;
+static GHashTable *tagsistant_autotagging_pending = NULL;
+static GMutex tagsistant_autotagging_mutex;
+
+/** jobs merged into a newer job of the same object */
+static gint tagsistant_deduplication_coalesced = 0;
+static gint tagsistant_autotagging_coalesced = 0;
+
+/** jobs abandoned because a newer version of the object was scheduled */
+static gint tagsistant_deduplication_dropped = 0;
+static gint tagsistant_autotagging_dropped = 0;
 
 #define TAGSISTANT_DO_AUTOTAGGING 1
 #define TAGSISTANT_DONT_DO_AUTOTAGGING 0
 
+/** the tasks saved in the work_queue table */
+#define TAGSISTANT_WORK_DEDUPLICATION 1
+#define TAGSISTANT_WORK_AUTOTAGGING 2
+
+/** deduplication modes */
+#define TAGSISTANT_DEDUPLICATION_FULL 0
+#define TAGSISTANT_DEDUPLICATION_STAGED 1
+
+/** how duplicates are detected, set by [Deduplication] mode */
+static int tagsistant_deduplication_mode = TAGSISTANT_DEDUPLICATION_STAGED;
+
+/** how duplicates are merged */
+#define TAGSISTANT_DEDUPLICATION_RETAG 0
+#define TAGSISTANT_DEDUPLICATION_REFLINK 1
+
+/** how duplicates are merged, set by [Deduplication] merge */
+static int tagsistant_deduplication_merge = TAGSISTANT_DEDUPLICATION_RETAG;
+
+/** the strong hash used to compare files, set by [Deduplication] hash */
+static GChecksumType tagsistant_deduplication_hash = G_CHECKSUM_SHA1;
+
+/** the length of the objects.checksum column; longer digests are truncated */
+#define TAGSISTANT_CHECKSUM_LENGTH 40
+
+/** the size of the blocks hashed at the head and at the tail of a file by the staged mode */
+#define TAGSISTANT_FINGERPRINT_BLOCK 65536
+
+/**
+ * get the hex string of a checksum, truncated to fit the objects table
+ *
+ * @param checksum the GChecksum object
+ * @return the hex string (to be freed)
+ */
+static gchar *tagsistant_checksum_hex(GChecksum *checksum)
+{
+	return (g_strndup(g_checksum_get_string(checksum), TAGSISTANT_CHECKSUM_LENGTH));
+}
+
+/**
+ * check if the object processed by the calling deduplication worker has
+ * been scheduled again; the worker can give up, since a newer job will
+ * process the latest version of the object
+ *
+ * @return TRUE if the job of the calling worker has been superseded
+ */
+static gboolean tagsistant_deduplication_superseded()
+{
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+	tagsistant_deduplication_job *job = g_private_get(&tagsistant_deduplication_current_job);
+	return (job && g_atomic_int_get(&job->cancelled));
+#else
+	return (FALSE);
+#endif
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Fast hashing (XXH64)                                               ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#define TAGSISTANT_XXH_PRIME64_1 11400714785074694791ULL
+#define TAGSISTANT_XXH_PRIME64_2 14029467366897019727ULL
+#define TAGSISTANT_XXH_PRIME64_3  1609587929392839161ULL
+#define TAGSISTANT_XXH_PRIME64_4  9650029242287828579ULL
+#define TAGSISTANT_XXH_PRIME64_5  2870177450012600261ULL
+
+#define tagsistant_xxh_rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline guint64 tagsistant_xxh_read64(const guchar *p)
+{
+	guint64 v;
+	memcpy(&v, p, sizeof(v));
+	return (GUINT64_FROM_LE(v));
+}
+
+static inline guint32 tagsistant_xxh_read32(const guchar *p)
+{
+	guint32 v;
+	memcpy(&v, p, sizeof(v));
+	return (GUINT32_FROM_LE(v));
+}
+
+static inline guint64 tagsistant_xxh64_round(guint64 acc, guint64 input)
+{
+	acc += input * TAGSISTANT_XXH_PRIME64_2;
+	acc = tagsistant_xxh_rotl64(acc, 31);
+	return (acc * TAGSISTANT_XXH_PRIME64_1);
+}
+
+static inline guint64 tagsistant_xxh64_merge(guint64 acc, guint64 val)
+{
+	acc ^= tagsistant_xxh64_round(0, val);
+	return (acc * TAGSISTANT_XXH_PRIME64_1 + TAGSISTANT_XXH_PRIME64_4);
+}
+
+/**
+ * XXH64 non cryptographic hash
+ *
+ * @param data the buffer to hash
+ * @param length the length of the buffer
+ * @param seed the hash seed
+ * @return the 64 bit hash
+ */
+static guint64 tagsistant_xxh64(const guchar *data, gsize length, guint64 seed)
+{
+	const guchar *p = data;
+	const guchar *end = data + length;
+	guint64 h;
+
+	if (length >= 32) {
+		guint64 v1 = seed + TAGSISTANT_XXH_PRIME64_1 + TAGSISTANT_XXH_PRIME64_2;
+		guint64 v2 = seed + TAGSISTANT_XXH_PRIME64_2;
+		guint64 v3 = seed;
+		guint64 v4 = seed - TAGSISTANT_XXH_PRIME64_1;
+
+		do {
+			v1 = tagsistant_xxh64_round(v1, tagsistant_xxh_read64(p));
+			v2 = tagsistant_xxh64_round(v2, tagsistant_xxh_read64(p + 8));
+			v3 = tagsistant_xxh64_round(v3, tagsistant_xxh_read64(p + 16));
+			v4 = tagsistant_xxh64_round(v4, tagsistant_xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = tagsistant_xxh_rotl64(v1, 1) + tagsistant_xxh_rotl64(v2, 7) +
+			tagsistant_xxh_rotl64(v3, 12) + tagsistant_xxh_rotl64(v4, 18);
+		h = tagsistant_xxh64_merge(h, v1);
+		h = tagsistant_xxh64_merge(h, v2);
+		h = tagsistant_xxh64_merge(h, v3);
+		h = tagsistant_xxh64_merge(h, v4);
+	} else {
+		h = seed + TAGSISTANT_XXH_PRIME64_5;
+	}
+
+	h += (guint64) length;
+
+	while (p + 8 <= end) {
+		h ^= tagsistant_xxh64_round(0, tagsistant_xxh_read64(p));
+		h = tagsistant_xxh_rotl64(h, 27) * TAGSISTANT_XXH_PRIME64_1 + TAGSISTANT_XXH_PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (guint64) tagsistant_xxh_read32(p) * TAGSISTANT_XXH_PRIME64_1;
+		h = tagsistant_xxh_rotl64(h, 23) * TAGSISTANT_XXH_PRIME64_2 + TAGSISTANT_XXH_PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * TAGSISTANT_XXH_PRIME64_5;
+		h = tagsistant_xxh_rotl64(h, 11) * TAGSISTANT_XXH_PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= TAGSISTANT_XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= TAGSISTANT_XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return (h);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Streaming checksums                                                ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+/**
+ * the checksum of a file computed while it's written. It stays valid
+ * as long as the file is written sequentially from the beginning.
+ */
+typedef struct {
+	tagsistant_inode inode;
+	GChecksum *checksum;
+	off_t offset;
+} tagsistant_checksum_stream;
+
+/** open streams: file descriptor -> tagsistant_checksum_stream */
+static GHashTable *tagsistant_checksum_streams = NULL;
+
+/** checksums computed by the streams and waiting for deduplication: inode -> hex string */
+static GHashTable *tagsistant_streamed_checksums = NULL;
+
+static GMutex tagsistant_checksum_streams_mutex;
+
+/**
+ * destroy a checksum stream
+ *
+ * @param data the tagsistant_checksum_stream
+ */
+static void tagsistant_checksum_stream_destroy(gpointer data)
+{
+	tagsistant_checksum_stream *stream = (tagsistant_checksum_stream *) data;
+	g_checksum_free(stream->checksum);
+	g_free(stream);
+}
+
+/**
+ * remove all the streams of an inode. Must be called with the mutex held.
+ *
+ * @param inode the inode
+ * @return the number of streams removed
+ */
+static guint tagsistant_checksum_stream_remove_inode(tagsistant_inode inode)
+{
+	GHashTableIter iter;
+	tagsistant_checksum_stream *stream;
+	guint removed = 0;
+
+	g_hash_table_iter_init(&iter, tagsistant_checksum_streams);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &stream)) {
+		if (stream->inode == inode) {
+			g_hash_table_iter_remove(&iter);
+			removed++;
+		}
+	}
+
+	return (removed);
+}
+
+/**
+ * start hashing a file opened for writing. Any stream and any checksum
+ * saved for the inode are dropped, since the file is going to change
+ * through this descriptor too. A new stream is started only if the file
+ * is empty and no other descriptor was writing it.
+ *
+ * @param fd the file descriptor
+ * @param inode the inode of the object
+ */
+void tagsistant_checksum_stream_open(int fd, tagsistant_inode inode)
+{
+	if (fd <= 0 || !inode) return;
+
+	g_mutex_lock(&tagsistant_checksum_streams_mutex);
+
+	g_hash_table_remove(tagsistant_streamed_checksums, GUINT_TO_POINTER(inode));
+
+	/* a stream left over by a descriptor with the same number is stale */
+	g_hash_table_remove(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+
+	struct stat st;
+	if (tagsistant_checksum_stream_remove_inode(inode)) {
+		/* two descriptors writing the same file, give up */
+		dbg('2', LOG_INFO, "Concurrent writers on inode %d, checksum will be computed at flush", inode);
+	} else if ((-1 == fstat(fd, &st)) || st.st_size) {
+		/* not a new file, the checksum will be computed at flush */
+	} else {
+		tagsistant_checksum_stream *stream = g_new0(tagsistant_checksum_stream, 1);
+		stream->inode = inode;
+		stream->checksum = g_checksum_new(tagsistant_deduplication_hash);
+		g_hash_table_replace(tagsistant_checksum_streams, GINT_TO_POINTER(fd), stream);
+	}
+
+	g_mutex_unlock(&tagsistant_checksum_streams_mutex);
+}
+
+/**
+ * feed a checksum stream with written data. A write which doesn't
+ * start where the previous one ended drops the stream. A write on a
+ * descriptor without a stream of this inode means someone else is
+ * changing the file: all the streams of the inode and its saved
+ * checksum are dropped.
+ *
+ * @param fd the file descriptor
+ * @param inode the inode of the object
+ * @param buf the written buffer
+ * @param size how many bytes have been written
+ * @param offset where the bytes have been written
+ */
+void tagsistant_checksum_stream_update(int fd, tagsistant_inode inode, const char *buf, size_t size, off_t offset)
+{
+	g_mutex_lock(&tagsistant_checksum_streams_mutex);
+
+	tagsistant_checksum_stream *stream = g_hash_table_lookup(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+	if (stream && inode && stream->inode != inode) {
+		/* left over by a descriptor which has been closed without a flush */
+		dbg('2', LOG_INFO, "Dropping stale stream of inode %d on descriptor %d", stream->inode, fd);
+		g_hash_table_remove(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+		stream = NULL;
+	}
+
+	if (stream) {
+		if (stream->offset == offset) {
+			g_checksum_update(stream->checksum, (const guchar *) buf, size);
+			stream->offset += size;
+		} else {
+			dbg('2', LOG_INFO, "Non sequential write on inode %d, checksum will be computed at flush", stream->inode);
+			g_hash_table_remove(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+		}
+	} else if (inode) {
+		tagsistant_checksum_stream_remove_inode(inode);
+		g_hash_table_remove(tagsistant_streamed_checksums, GUINT_TO_POINTER(inode));
+	}
+
+	g_mutex_unlock(&tagsistant_checksum_streams_mutex);
+}
+
+/**
+ * drop the streams of an inode, because the file has been truncated
+ *
+ * @param inode the inode
+ */
+void tagsistant_checksum_stream_invalidate(tagsistant_inode inode)
+{
+	g_mutex_lock(&tagsistant_checksum_streams_mutex);
+	tagsistant_checksum_stream_remove_inode(inode);
+	g_hash_table_remove(tagsistant_streamed_checksums, GUINT_TO_POINTER(inode));
+	g_mutex_unlock(&tagsistant_checksum_streams_mutex);
+}
+
+/**
+ * close a checksum stream. If the stream covers the whole file, its
+ * checksum is saved for the deduplication of the inode.
+ *
+ * @param fd the file descriptor
+ * @param keep save the checksum for a following tagsistant_deduplicate()
+ */
+void tagsistant_checksum_stream_close(int fd, int keep)
+{
+	g_mutex_lock(&tagsistant_checksum_streams_mutex);
+
+	tagsistant_checksum_stream *stream = g_hash_table_lookup(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+	if (stream && keep) {
+		struct stat st;
+		if ((-1 != fstat(fd, &st)) && (st.st_size == stream->offset)) {
+			g_hash_table_replace(tagsistant_streamed_checksums,
+				GUINT_TO_POINTER(stream->inode),
+				tagsistant_checksum_hex(stream->checksum));
+		}
+	}
+
+	g_hash_table_remove(tagsistant_checksum_streams, GINT_TO_POINTER(fd));
+
+	g_mutex_unlock(&tagsistant_checksum_streams_mutex);
+}
+
+/**
+ * take the checksum computed by a stream for an inode, if any
+ *
+ * @param inode the inode
+ * @return the hex checksum string (to be freed) or NULL
+ */
+static gchar *tagsistant_checksum_stream_take(tagsistant_inode inode)
+{
+	gchar *hex = NULL;
+
+	g_mutex_lock(&tagsistant_checksum_streams_mutex);
+	if (g_hash_table_lookup_extended(tagsistant_streamed_checksums, GUINT_TO_POINTER(inode), NULL, (gpointer *) &hex))
+		g_hash_table_steal(tagsistant_streamed_checksums, GUINT_TO_POINTER(inode));
+	g_mutex_unlock(&tagsistant_checksum_streams_mutex);
+
+	return (hex);
+}
+#endif /* TAGSISTANT_ENABLE_STREAMING_CHECKSUM */
+
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+/****************************************************************************/
+/***                                                                      ***/
+/***   Checksum index                                                     ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * The checksum index maps the content of the checksum column (the
+ * fingerprint in staged mode, the strong hash in full mode) to the
+ * oldest inode holding it, so unique objects are recognized without
+ * querying the database.
+ *
+ * Checksums are stored as their XXH64 hash in an open addressing table
+ * with linear probing: a slot takes 12 bytes (a key and an inode) and
+ * a key of 0 marks an empty slot. Keys can collide and deleted objects
+ * are not removed from the index, so a hit is just a hint and must
+ * always be verified against the database.
+ */
+static guint64 *tagsistant_checksum_index_keys = NULL;
+static tagsistant_inode *tagsistant_checksum_index_inodes = NULL;
+static guint tagsistant_checksum_index_size = 0;
+static guint tagsistant_checksum_index_used = 0;
+static GRWLock tagsistant_checksum_index_lock;
+
+/** the minimum number of slots of the checksum index */
+#define TAGSISTANT_CHECKSUM_INDEX_MIN_SIZE 1024
+
+/**
+ * compute the index key of a checksum
+ *
+ * @param checksum the checksum string
+ * @return the key (never 0)
+ */
+static guint64 tagsistant_checksum_index_key(const gchar *checksum)
+{
+	guint64 key = tagsistant_xxh64((const guchar *) checksum, strlen(checksum), 0);
+	return (key ? key : 1);
+}
+
+/**
+ * find the slot holding a key or the empty slot where it belongs.
+ * Must be called with the index lock held.
+ *
+ * @param key the key
+ * @return the slot number
+ */
+static guint tagsistant_checksum_index_slot(guint64 key)
+{
+	guint mask = tagsistant_checksum_index_size - 1;
+	guint slot = (guint) key & mask;
+
+	while (tagsistant_checksum_index_keys[slot] && tagsistant_checksum_index_keys[slot] != key)
+		slot = (slot + 1) & mask;
+
+	return (slot);
+}
+
+/**
+ * resize the index, moving the existing entries into the new table.
+ * Must be called with the index write lock held.
+ *
+ * @param size the new number of slots (a power of two)
+ */
+static void tagsistant_checksum_index_resize(guint size)
+{
+	guint64 *old_keys = tagsistant_checksum_index_keys;
+	tagsistant_inode *old_inodes = tagsistant_checksum_index_inodes;
+	guint old_size = tagsistant_checksum_index_size;
+
+	tagsistant_checksum_index_keys = g_new0(guint64, size);
+	tagsistant_checksum_index_inodes = g_new0(tagsistant_inode, size);
+	tagsistant_checksum_index_size = size;
+
+	guint i;
+	for (i = 0; i < old_size; i++) {
+		if (!old_keys[i]) continue;
+		guint slot = tagsistant_checksum_index_slot(old_keys[i]);
+		tagsistant_checksum_index_keys[slot] = old_keys[i];
+		tagsistant_checksum_index_inodes[slot] = old_inodes[i];
+	}
+
+	g_free(old_keys);
+	g_free(old_inodes);
+}
+
+/**
+ * store a checksum into the index. Must be called with the index
+ * write lock held.
+ *
+ * @param key the key of the checksum
+ * @param inode the inode holding the checksum
+ * @param replace if false, an entry pointing to an older inode is kept
+ */
+static void tagsistant_checksum_index_store(guint64 key, tagsistant_inode inode, gboolean replace)
+{
+	/* keep the load factor under 3/4 */
+	if ((tagsistant_checksum_index_used + 1) * 4 > tagsistant_checksum_index_size * 3)
+		tagsistant_checksum_index_resize(tagsistant_checksum_index_size * 2);
+
+	guint slot = tagsistant_checksum_index_slot(key);
+
+	if (!tagsistant_checksum_index_keys[slot]) {
+		tagsistant_checksum_index_keys[slot] = key;
+		tagsistant_checksum_index_inodes[slot] = inode;
+		tagsistant_checksum_index_used++;
+	} else if (replace || inode < tagsistant_checksum_index_inodes[slot]) {
+		tagsistant_checksum_index_inodes[slot] = inode;
+	}
+}
+
+/**
+ * look for a checksum in the index
+ *
+ * @param checksum the checksum string
+ * @return the oldest known inode holding the checksum or 0
+ */
+static tagsistant_inode tagsistant_checksum_index_lookup(const gchar *checksum)
+{
+	guint64 key = tagsistant_checksum_index_key(checksum);
+
+	g_rw_lock_reader_lock(&tagsistant_checksum_index_lock);
+	guint slot = tagsistant_checksum_index_slot(key);
+	tagsistant_inode inode = tagsistant_checksum_index_inodes[slot];
+	g_rw_lock_reader_unlock(&tagsistant_checksum_index_lock);
+
+	return (inode);
+}
+
+/**
+ * record a checksum in the index
+ *
+ * @param checksum the checksum string
+ * @param inode the inode holding the checksum
+ * @param replace if false, an entry pointing to an older inode is kept
+ */
+static void tagsistant_checksum_index_set(const gchar *checksum, tagsistant_inode inode, gboolean replace)
+{
+	guint64 key = tagsistant_checksum_index_key(checksum);
+
+	g_rw_lock_writer_lock(&tagsistant_checksum_index_lock);
+	tagsistant_checksum_index_store(key, inode, replace);
+	g_rw_lock_writer_unlock(&tagsistant_checksum_index_lock);
+}
+
+/**
+ * SQL callback: add an object to the checksum index
+ *
+ * @param unused not used
+ * @param result dbi_result pointer
+ * @return 0 (always, due to SQLite policy)
+ */
+static int tagsistant_checksum_index_build_callback(void *unused, dbi_result result)
+{
+	(void) unused;
+
+	const gchar *inode = dbi_result_get_string_idx(result, 1);
+	const gchar *checksum = dbi_result_get_string_idx(result, 2);
+
+	if (inode && checksum)
+		tagsistant_checksum_index_store(tagsistant_checksum_index_key(checksum), strtoul(inode, NULL, 10), FALSE);
+
+	return (0);
+}
+
+/**
+ * load the checksums of all the objects into the index
+ */
+static void tagsistant_checksum_index_build()
+{
+	guint32 count = 0;
+	guint size = TAGSISTANT_CHECKSUM_INDEX_MIN_SIZE;
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+
+	tagsistant_query(
+		"select count(*) from objects where checksum <> ''",
+		dbi, tagsistant_return_integer, &count);
+
+	/* leave room for the objects to come */
+	while (size < count * 2) size *= 2;
+
+	g_rw_lock_writer_lock(&tagsistant_checksum_index_lock);
+
+	tagsistant_checksum_index_resize(size);
+
+	tagsistant_query(
+		"select cast(inode as varchar(12)), checksum from objects where checksum <> ''",
+		dbi, tagsistant_checksum_index_build_callback, NULL);
+
+	dbg('2', LOG_INFO, "Checksum index: %u checksums in %u slots (%lu bytes)",
+		tagsistant_checksum_index_used, tagsistant_checksum_index_size,
+		(unsigned long) tagsistant_checksum_index_size * (sizeof(guint64) + sizeof(tagsistant_inode)));
+
+	g_rw_lock_writer_unlock(&tagsistant_checksum_index_lock);
+
+	tagsistant_db_connection_release(dbi, 0);
+}
+#endif /* TAGSISTANT_ENABLE_CHECKSUM_INDEX */
+
+/**
+ * merge an object into another one holding the same contents: the tags
+ * are moved to the main object and the duplicate is removed
+ *
+ * @param qtree the querytree of the duplicated object
+ * @param main_inode the inode of the object to be kept
+ * @return TAGSISTANT_DONT_DO_AUTOTAGGING, since the object has gone
+ */
+static int tagsistant_querytree_merge_duplicate(tagsistant_querytree *qtree, tagsistant_inode main_inode)
+{
+	dbg('2', LOG_INFO, "Deduplicating %s: %d -> %d", qtree->full_archive_path, qtree->inode, main_inode);
+
+	/* first move all the tags of qtree->inode to main_inode */
+	tagsistant_query(
+		"update tagging set inode = %d where inode = %d",
+		qtree->dbi,	NULL, NULL,	main_inode,	qtree->inode);
+
+	/* then delete records left because of duplicates in key(inode, tag_id) in the tagging table */
+	tagsistant_query(
+		"delete from tagging where inode = %d",
+		qtree->dbi,	NULL, NULL,	qtree->inode);
+
+	/* unlink the removable inode */
+	tagsistant_query(
+		"delete from objects where inode = %d",
+		qtree->dbi, NULL, NULL,	qtree->inode);
+
+	/* and finally delete it from the archive directory */
+	qtree->schedule_for_unlink = 1;
+
+#if TAGSISTANT_ENABLE_AND_SET_CACHE
+	/*
+	 * invalidate the and_set cache
+	 */
+	tagsistant_invalidate_and_set_cache_entries(qtree);
+#endif
+
+	// don't do autotagging, the file has gone
+	return (TAGSISTANT_DONT_DO_AUTOTAGGING);
+}
+
+/**
+ * deduplication function called by tagsistant_deduplication_kernel
+ * when the checksum column holds a strong hash of the whole file
+ *
+ * @param qtree the querytree of the object
+ * @param hex the checksum string
+ * @return true if autotagging is requested, false otherwise
+ */
+int tagsistant_querytree_find_duplicates(tagsistant_querytree *qtree, gchar *hex)
+{
+	tagsistant_inode main_inode = 0;
+
+	/*
+	 * get the first inode matching the checksum
+	 */
+	tagsistant_query(
+		"select inode from objects where checksum = '%s' order by inode limit 1",
+		qtree->dbi,	tagsistant_return_integer, &main_inode,	hex);
+
+	/*
+	 * if main_inode is zero, something gone wrong, we must
+	 * return here, but auto-tagging can be performed
+	 */
+	if (!main_inode) {
+		dbg('2', LOG_ERR, "Inode 0 returned for checksum %s", hex);
+		return (TAGSISTANT_DO_AUTOTAGGING);
+	}
+
+	/*
+	 * if this is the only copy of the file, we can
+	 * return and auto-tagging can be performed
+	 */
+	if (qtree->inode == main_inode) return (TAGSISTANT_DO_AUTOTAGGING);
+
+	return (tagsistant_querytree_merge_duplicate(qtree, main_inode));
+}
+
+/**
+ * resolve the path of an object to its file under archive/
+ *
+ * @param path the path of the object
+ * @param inode filled with the inode of the object, if not NULL
+ * @return the full archive path (to be freed) or NULL
+ */
+static gchar *tagsistant_object_archive_path(const gchar *path, tagsistant_inode *inode)
+{
+	tagsistant_querytree *qtree = tagsistant_querytree_new(path, 0, 0, 1, 1);
+	if (!qtree) return (NULL);
+
+	gchar *full_archive_path = g_strdup(qtree->full_archive_path);
+	if (inode) *inode = qtree->inode;
+
+	tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
+
+	return (full_archive_path);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Background budgets                                                 ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/** the number of foreground latencies kept to compute the percentile */
+#define TAGSISTANT_LATENCY_SAMPLES 256
+
+/** samples older than this are ignored (µs) */
+#define TAGSISTANT_LATENCY_WINDOW (5 * G_USEC_PER_SEC)
+
+/** how often the percentile is computed again (µs) */
+#define TAGSISTANT_LATENCY_CHECK_INTERVAL G_USEC_PER_SEC
+
+/** the pause taken per block by the workers while the foreground is slow (µs) */
+#define TAGSISTANT_BACKGROUND_BACKOFF (20 * 1000)
+
+/** the I/O scheduling classes, as in linux/ioprio.h */
+#define TAGSISTANT_IOPRIO_CLASS_NONE 0
+#define TAGSISTANT_IOPRIO_CLASS_BE 2
+#define TAGSISTANT_IOPRIO_CLASS_IDLE 3
+#define TAGSISTANT_IOPRIO_CLASS_SHIFT 13
+#define TAGSISTANT_IOPRIO_WHO_PROCESS 1
+
+/** the budgets read from the [Background] section of repository.ini */
+static int tagsistant_background_io_class = TAGSISTANT_IOPRIO_CLASS_IDLE;
+static int tagsistant_background_io_priority = 7;
+static int tagsistant_background_nice = 10;
+static guint64 tagsistant_background_bytes_per_second = 0;
+static int tagsistant_background_max_active = 0;
+static gint64 tagsistant_background_latency_threshold = 0;
+
+/** the latencies of the foreground operations, guarded by tagsistant_latency_mutex */
+static struct {
+	gint64 at;
+	gint64 latency;
+} tagsistant_latency_samples[TAGSISTANT_LATENCY_SAMPLES];
+
+static guint tagsistant_latency_next = 0;
+static gint64 tagsistant_latency_checked = 0;
+static gint64 tagsistant_latency_p95 = 0;
+static gboolean tagsistant_background_congested = FALSE;
+static GMutex tagsistant_latency_mutex;
+
+/** the workers running a job, guarded by tagsistant_background_mutex */
+static int tagsistant_background_active = 0;
+static gint64 tagsistant_background_window = 0;
+static guint64 tagsistant_background_window_bytes = 0;
+static GMutex tagsistant_background_mutex;
+static GCond tagsistant_background_slot_free;
+
+/** set in the background threads, whose reads are throttled */
+static GPrivate tagsistant_background_thread = G_PRIVATE_INIT(NULL);
+
+/**
+ * record the latency of a foreground operation
+ *
+ * @param latency the duration of the operation (µs)
+ */
+void tagsistant_background_sample(gint64 latency)
+{
+	if (!tagsistant_background_latency_threshold) return;
+
+	g_mutex_lock(&tagsistant_latency_mutex);
+	guint slot = tagsistant_latency_next++ % TAGSISTANT_LATENCY_SAMPLES;
+	tagsistant_latency_samples[slot].at = g_get_monotonic_time();
+	tagsistant_latency_samples[slot].latency = latency;
+	g_mutex_unlock(&tagsistant_latency_mutex);
+}
+
+/**
+ * compare two latencies for qsort()
+ */
+static int tagsistant_latency_compare(const void *a, const void *b)
+{
+	gint64 la = *(const gint64 *) a;
+	gint64 lb = *(const gint64 *) b;
+	return ((la > lb) - (la < lb));
+}
+
+/**
+ * tell if the foreground operations are slower than the latency_threshold.
+ * The 95th percentile of the recent samples is computed once a second.
+ *
+ * @return TRUE if the background workers should back off
+ */
+static gboolean tagsistant_background_is_congested()
+{
+	if (!tagsistant_background_latency_threshold) return (FALSE);
+
+	g_mutex_lock(&tagsistant_latency_mutex);
+
+	gint64 now = g_get_monotonic_time();
+	if (now - tagsistant_latency_checked >= TAGSISTANT_LATENCY_CHECK_INTERVAL) {
+		gint64 latencies[TAGSISTANT_LATENCY_SAMPLES];
+		guint count = 0, i;
+
+		for (i = 0; i < TAGSISTANT_LATENCY_SAMPLES; i++) {
+			if (tagsistant_latency_samples[i].at && (now - tagsistant_latency_samples[i].at <= TAGSISTANT_LATENCY_WINDOW))
+				latencies[count++] = tagsistant_latency_samples[i].latency;
+		}
+
+		if (count) {
+			qsort(latencies, count, sizeof(gint64), tagsistant_latency_compare);
+			tagsistant_latency_p95 = latencies[(count * 95 - 1) / 100];
+		} else {
+			tagsistant_latency_p95 = 0;
+		}
+
+		gboolean congested = (tagsistant_latency_p95 > tagsistant_background_latency_threshold);
+		if (congested != tagsistant_background_congested) {
+			dbg('2', LOG_INFO, "Foreground p95 latency %" G_GINT64_FORMAT "us, background workers %s",
+				tagsistant_latency_p95, congested ? "backing off" : "resuming");
+		}
+
+		tagsistant_background_congested = congested;
+		tagsistant_latency_checked = now;
+	}
+
+	gboolean congested = tagsistant_background_congested;
+	g_mutex_unlock(&tagsistant_latency_mutex);
+
+	/* let the waiting workers check again the number of active slots */
+	if (!congested) g_cond_broadcast(&tagsistant_background_slot_free);
+
+	return (congested);
+}
+
+/**
+ * lower the CPU and I/O priority of the calling thread. On Linux both
+ * apply to the single thread, and are inherited by the processes it forks,
+ * like the extractor helpers.
+ */
+static void tagsistant_background_thread_init()
+{
+	g_private_set(&tagsistant_background_thread, GINT_TO_POINTER(1));
+
+#ifdef __linux__
+	pid_t tid = syscall(SYS_gettid);
+
+	if (tagsistant_background_nice && (-1 == setpriority(PRIO_PROCESS, tid, tagsistant_background_nice)))
+		dbg('2', LOG_ERR, "Unable to set nice level %d: %s", tagsistant_background_nice, strerror(errno));
+
+	if (tagsistant_background_io_class) {
+		int ioprio = (tagsistant_background_io_class << TAGSISTANT_IOPRIO_CLASS_SHIFT) | tagsistant_background_io_priority;
+		if (-1 == syscall(SYS_ioprio_set, TAGSISTANT_IOPRIO_WHO_PROCESS, tid, ioprio))
+			dbg('2', LOG_ERR, "Unable to set I/O priority: %s", strerror(errno));
+	}
+#endif
+}
+
+/**
+ * wait for a free slot before running a job. No more than max_active
+ * workers run at once, and only one while the foreground is slow.
+ */
+static void tagsistant_background_acquire()
+{
+	g_mutex_lock(&tagsistant_background_mutex);
+	while (1) {
+		int limit = tagsistant_background_is_congested() ? 1 : tagsistant_background_max_active;
+		if (!limit || tagsistant_background_active < limit) break;
+
+		gint64 until = g_get_monotonic_time() + TAGSISTANT_LATENCY_CHECK_INTERVAL;
+		g_cond_wait_until(&tagsistant_background_slot_free, &tagsistant_background_mutex, until);
+	}
+	tagsistant_background_active++;
+	g_mutex_unlock(&tagsistant_background_mutex);
+}
+
+/**
+ * release the slot taken by tagsistant_background_acquire()
+ */
+static void tagsistant_background_release()
+{
+	g_mutex_lock(&tagsistant_background_mutex);
+	tagsistant_background_active--;
+	g_cond_signal(&tagsistant_background_slot_free);
+	g_mutex_unlock(&tagsistant_background_mutex);
+}
+
+/**
+ * account the bytes read by a background worker, sleeping as long as
+ * the workers together exceed bytes_per_second. While the foreground
+ * is slow the budget is quartered, or a short pause is taken if unlimited.
+ * Does nothing outside the background threads.
+ *
+ * @param bytes the bytes just read
+ */
+void tagsistant_background_throttle(guint64 bytes)
+{
+	if (!g_private_get(&tagsistant_background_thread)) return;
+
+	gboolean congested = tagsistant_background_is_congested();
+	guint64 rate = tagsistant_background_bytes_per_second;
+	if (congested && rate) rate = MAX(rate / 4, 1);
+
+	if (!rate) {
+		if (congested) g_usleep(TAGSISTANT_BACKGROUND_BACKOFF);
+		return;
+	}
+
+	g_mutex_lock(&tagsistant_background_mutex);
+
+	gint64 now = g_get_monotonic_time();
+	if (now - tagsistant_background_window >= G_USEC_PER_SEC) {
+		tagsistant_background_window = now;
+		tagsistant_background_window_bytes = 0;
+	}
+
+	tagsistant_background_window_bytes += bytes;
+	gint64 due = tagsistant_background_window + (gint64) ((gdouble) tagsistant_background_window_bytes * G_USEC_PER_SEC / rate);
+
+	g_mutex_unlock(&tagsistant_background_mutex);
+
+	if (due > now) g_usleep(due - now);
+}
+
+/**
+ * return the state of the background budgets
+ *
+ * @param active the number of workers running a job
+ * @param p95 the 95th percentile of the foreground latency (µs)
+ * @param congested set to 1 while the workers are backing off
+ */
+void tagsistant_background_stats(int *active, gint64 *p95, int *congested)
+{
+	*congested = tagsistant_background_is_congested();
+
+	g_mutex_lock(&tagsistant_latency_mutex);
+	*p95 = tagsistant_latency_p95;
+	g_mutex_unlock(&tagsistant_latency_mutex);
+
+	g_mutex_lock(&tagsistant_background_mutex);
+	*active = tagsistant_background_active;
+	g_mutex_unlock(&tagsistant_background_mutex);
+}
+
+/**
+ * read the [Background] section of repository.ini
+ */
+static void tagsistant_background_init()
+{
+	gchar *io_class = tagsistant_get_ini_entry("Background", "io_class");
+	if (io_class) {
+		if (g_ascii_strcasecmp(io_class, "idle") == 0) tagsistant_background_io_class = TAGSISTANT_IOPRIO_CLASS_IDLE;
+		else if (g_ascii_strcasecmp(io_class, "best-effort") == 0) tagsistant_background_io_class = TAGSISTANT_IOPRIO_CLASS_BE;
+		else if (g_ascii_strcasecmp(io_class, "none") == 0) tagsistant_background_io_class = TAGSISTANT_IOPRIO_CLASS_NONE;
+		else dbg('2', LOG_ERR, "Unknown background I/O class %s", io_class);
+		g_free(io_class);
+	}
+
+	gchar *io_priority = tagsistant_get_ini_entry("Background", "io_priority");
+	if (io_priority) {
+		tagsistant_background_io_priority = CLAMP(atoi(io_priority), 0, 7);
+		g_free(io_priority);
+	}
+
+	gchar *nice_level = tagsistant_get_ini_entry("Background", "nice");
+	if (nice_level) {
+		tagsistant_background_nice = CLAMP(atoi(nice_level), 0, 19);
+		g_free(nice_level);
+	}
+
+	gchar *bytes_per_second = tagsistant_get_ini_entry("Background", "bytes_per_second");
+	if (bytes_per_second) {
+		tagsistant_background_bytes_per_second = g_ascii_strtoull(bytes_per_second, NULL, 10);
+		g_free(bytes_per_second);
+	}
+
+	gchar *max_active = tagsistant_get_ini_entry("Background", "max_active");
+	if (max_active) {
+		if (atoi(max_active) >= 0) tagsistant_background_max_active = atoi(max_active);
+		g_free(max_active);
+	}
+
+	gchar *latency_threshold = tagsistant_get_ini_entry("Background", "latency_threshold");
+	if (latency_threshold) {
+		if (atoi(latency_threshold) >= 0) tagsistant_background_latency_threshold = (gint64) atoi(latency_threshold) * 1000;
+		g_free(latency_threshold);
+	}
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Shared object reader                                               ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/** size of the buffer used to read the objects */
+#define TAGSISTANT_READ_BUFFER_SIZE (1024 * 1024)
+
+/** alignment of the read buffer */
+#define TAGSISTANT_READ_BUFFER_ALIGNMENT 4096
+
+/** objects up to this size are kept in memory after hashing, to be autotagged without reading them again */
+#define TAGSISTANT_SHARED_READ_MAX_SIZE (16 * 1024 * 1024)
+
+/** maximum memory held by the objects waiting for autotagging */
+#define TAGSISTANT_SHARED_READ_BUDGET (64 * 1024 * 1024)
+
+/** the contents read by the deduplication workers, by full archive path */
+static GHashTable *tagsistant_shared_contents = NULL;
+static gsize tagsistant_shared_contents_size = 0;
+static GMutex tagsistant_shared_contents_mutex;
+
+/**
+ * hand the contents of an object over to the autotagging thread. The
+ * contents are dropped if the memory budget is exhausted, and the
+ * autotagger will read the file by itself.
+ *
+ * @param full_archive_path the file of the object
+ * @param contents the contents of the file (ownership is taken)
+ */
+static void tagsistant_shared_contents_put(const gchar *full_archive_path, GByteArray *contents)
+{
+	if (!contents) return;
+
+	g_mutex_lock(&tagsistant_shared_contents_mutex);
+
+	GByteArray *old = g_hash_table_lookup(tagsistant_shared_contents, full_archive_path);
+	if (old) {
+		tagsistant_shared_contents_size -= old->len;
+		g_hash_table_remove(tagsistant_shared_contents, full_archive_path);
+		g_byte_array_free(old, TRUE);
+	}
+
+	if (tagsistant_shared_contents_size + contents->len <= TAGSISTANT_SHARED_READ_BUDGET) {
+		g_hash_table_insert(tagsistant_shared_contents, g_strdup(full_archive_path), contents);
+		tagsistant_shared_contents_size += contents->len;
+		contents = NULL;
+	}
+
+	g_mutex_unlock(&tagsistant_shared_contents_mutex);
+
+	if (contents) g_byte_array_free(contents, TRUE);
+}
+
+/**
+ * take the contents of an object read by a deduplication worker, if any
+ *
+ * @param full_archive_path the file of the object
+ * @return the contents (to be freed with g_byte_array_free()) or NULL
+ */
+static GByteArray *tagsistant_shared_contents_take(const gchar *full_archive_path)
+{
+	g_mutex_lock(&tagsistant_shared_contents_mutex);
+
+	GByteArray *contents = g_hash_table_lookup(tagsistant_shared_contents, full_archive_path);
+	if (contents) {
+		tagsistant_shared_contents_size -= contents->len;
+		g_hash_table_remove(tagsistant_shared_contents, full_archive_path);
+	}
+
+	g_mutex_unlock(&tagsistant_shared_contents_mutex);
+
+	return (contents);
+}
+
+/**
+ * read a file under archive/ sequentially, feeding a checksum object.
+ *
+ * The kernel is told that the file is read once and in order, and the
+ * next block is prefetched while the current one is hashed. Files not
+ * larger than TAGSISTANT_SHARED_READ_MAX_SIZE can be kept in memory,
+ * so the autotagger doesn't need to read them again.
+ *
+ * @param full_archive_path the file
+ * @param checksum the checksum object to be fed, or NULL
+ * @param contents if not NULL, filled with the contents of small files
+ * @return TRUE on success, FALSE on error
+ */
+static gboolean tagsistant_read_file(const gchar *full_archive_path, GChecksum *checksum, GByteArray **contents)
+{
+	int fd = open(full_archive_path, O_RDONLY|O_NOATIME);
+	if (-1 == fd) {
+		dbg('2', LOG_ERR, "Unable to open %s for deduplication", full_archive_path);
+		return (FALSE);
+	}
+
+	struct stat st;
+	guchar *buffer = NULL;
+	if ((-1 == fstat(fd, &st)) || posix_memalign((void **) &buffer, TAGSISTANT_READ_BUFFER_ALIGNMENT, TAGSISTANT_READ_BUFFER_SIZE)) {
+		close(fd);
+		return (FALSE);
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+
+	if (contents) *contents = (st.st_size <= TAGSISTANT_SHARED_READ_MAX_SIZE) ? g_byte_array_sized_new(st.st_size) : NULL;
+
+	off_t offset = 0;
+	ssize_t length = 0;
+	gboolean superseded = FALSE;
+	do {
+		/* stop reading a file that has been written again */
+		if (tagsistant_deduplication_superseded()) {
+			superseded = TRUE;
+			break;
+		}
+
+		/* let the kernel fetch the next block while this one is hashed */
+		posix_fadvise(fd, offset + TAGSISTANT_READ_BUFFER_SIZE, TAGSISTANT_READ_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+
+		length = read(fd, buffer, TAGSISTANT_READ_BUFFER_SIZE);
+		if (length > 0) {
+			if (checksum) g_checksum_update(checksum, buffer, length);
+			if (contents && *contents) g_byte_array_append(*contents, buffer, length);
+			offset += length;
+		}
+
+		/* keep within the I/O budget of the background workers */
+		if (length > 0) tagsistant_background_throttle(length);
+	} while (length > 0);
+
+	free(buffer);
+	close(fd);
+
+	if (length < 0 || superseded) {
+		if (superseded) {
+			dbg('2', LOG_INFO, "Stopped reading %s, a newer version has been scheduled", full_archive_path);
+		} else {
+			dbg('2', LOG_ERR, "Error reading %s for deduplication", full_archive_path);
+		}
+		if (contents && *contents) {
+			g_byte_array_free(*contents, TRUE);
+			*contents = NULL;
+		}
+		return (FALSE);
+	}
+
+	return (TRUE);
+}
+
+/**
+ * compute the strong checksum of a file under archive/.
+ * No DB connection is held while reading the file, so several
+ * workers can hash different files at the same time.
+ *
+ * @param full_archive_path the file
+ * @param contents if not NULL, filled with the contents of small files
+ * @return the hex checksum string (to be freed) or NULL on error
+ */
+static gchar *tagsistant_checksum_file(const gchar *full_archive_path, GByteArray **contents)
+{
+	GChecksum *checksum = g_checksum_new(tagsistant_deduplication_hash);
+	if (!checksum) return (NULL);
+
+	/* get the hexadecimal checksum string */
+	gchar *hex = tagsistant_read_file(full_archive_path, checksum, contents) ? tagsistant_checksum_hex(checksum) : NULL;
+
+	/* destroy the checksum object */
+	g_checksum_free(checksum);
+
+	return (hex);
+}
+
+/**
+ * read an object for the plugins, with the budgets of the background
+ * workers. Only files not larger than TAGSISTANT_SHARED_READ_MAX_SIZE
+ * are read.
+ *
+ * @param full_archive_path the file of the object
+ * @return the contents (to be freed with g_byte_array_free()) or NULL
+ */
+GByteArray *tagsistant_read_object(const gchar *full_archive_path)
+{
+	struct stat st;
+	if ((-1 == lstat(full_archive_path, &st)) || (st.st_size > TAGSISTANT_SHARED_READ_MAX_SIZE)) return (NULL);
+
+	GByteArray *contents = NULL;
+	if (!tagsistant_read_file(full_archive_path, NULL, &contents)) return (NULL);
+	return (contents);
+}
+
+/**
+ * compute the fingerprint of a file under archive/: its size and a fast
+ * hash of its first and last blocks. Files with different fingerprints
+ * can't be duplicates, files with the same fingerprint are compared
+ * with the strong hash.
+ *
+ * The fingerprint starts with an uppercase F, so it never matches the
+ * lowercase hex strings stored by the full mode.
+ *
+ * @param full_archive_path the file
+ * @return the fingerprint string (to be freed) or NULL on error
+ */
+static gchar *tagsistant_fingerprint_file(const gchar *full_archive_path)
+{
+	int fd = open(full_archive_path, O_RDONLY|O_NOATIME);
+	if (-1 == fd) {
+		dbg('2', LOG_ERR, "Unable to open %s for deduplication", full_archive_path);
+		return (NULL);
+	}
+
+	struct stat st;
+	if (-1 == fstat(fd, &st)) {
+		close(fd);
+		return (NULL);
+	}
+
+	guchar *buffer = g_malloc(TAGSISTANT_FINGERPRINT_BLOCK);
+	guint64 hash = (guint64) st.st_size;
+
+	/* the head block */
+	ssize_t length = pread(fd, buffer, TAGSISTANT_FINGERPRINT_BLOCK, 0);
+	if (length > 0) hash = tagsistant_xxh64(buffer, length, hash);
+
+	/* the tail block, if not already covered by the head one */
+	if (st.st_size > TAGSISTANT_FINGERPRINT_BLOCK) {
+		off_t tail = MAX(st.st_size - TAGSISTANT_FINGERPRINT_BLOCK, TAGSISTANT_FINGERPRINT_BLOCK);
+		length = pread(fd, buffer, TAGSISTANT_FINGERPRINT_BLOCK, tail);
+		if (length > 0) hash = tagsistant_xxh64(buffer, length, hash);
+	}
+
+	g_free(buffer);
+	close(fd);
+
+	return (g_strdup_printf("F%016llx%016llx", (unsigned long long) st.st_size, (unsigned long long) hash));
+}
+
+/**
+ * resolve the file under archive/ of an object given its inode
+ *
+ * @param inode the inode of the object
+ * @return the full archive path (to be freed) or NULL
+ */
+static gchar *tagsistant_inode_archive_path(tagsistant_inode inode)
+{
+	gchar *objectname = NULL;
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select objectname from objects where inode = %d",
+		dbi, tagsistant_return_string, &objectname, inode);
+	tagsistant_db_connection_release(dbi, 0);
+
+	if (!objectname) return (NULL);
+
+	gchar *path = g_strdup_printf("/store/ALL/@@/%d%s%s", inode, TAGSISTANT_INODE_DELIMITER, objectname);
+	gchar *full_archive_path = tagsistant_object_archive_path(path, NULL);
+
+	g_free(path);
+	g_free(objectname);
+
+	return (full_archive_path);
+}
+
+/**
+ * get the strong hash of an object. It's read from the strong_checksum
+ * column, or computed and saved there the first time, so the oldest copy
+ * of a file is read in full only once, however many times its
+ * fingerprint is matched.
+ *
+ * @param inode the inode of the object
+ * @param fingerprint the fingerprint the object must still have
+ * @return the hex checksum string (to be freed) or NULL
+ */
+static gchar *tagsistant_strong_checksum(tagsistant_inode inode, const gchar *fingerprint)
+{
+	gchar *hex = NULL;
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select strong_checksum from objects where inode = %d",
+		dbi, tagsistant_return_string, &hex, inode);
+	tagsistant_db_connection_release(dbi, 0);
+
+	if (hex && *hex) return (hex);
+	g_free_null(hex);
+
+	gchar *full_archive_path = tagsistant_inode_archive_path(inode);
+	if (full_archive_path) hex = tagsistant_checksum_file(full_archive_path, NULL);
+	g_free_null(full_archive_path);
+
+	/* the hash is saved only if the object hasn't changed meanwhile */
+	if (hex) {
+		dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+		tagsistant_query(
+			"update objects set strong_checksum = '%s' where inode = %d and checksum = '%s'",
+			dbi, NULL, NULL, hex, inode, fingerprint);
+		tagsistant_commit_transaction(dbi);
+		tagsistant_db_connection_release(dbi, 1);
+	}
+
+	return (hex);
+}
+
+/**
+ * compare the strong hash of an object with the one of a candidate
+ *
+ * @param candidate the inode of the candidate object
+ * @param fingerprint the fingerprint shared by the two objects
+ * @param full_archive_path the file of the object
+ * @param hex the strong checksum of the object, computed if NULL
+ * @param contents filled with the contents of the object, if read
+ * @return true if the two objects have the same contents
+ */
+static gboolean tagsistant_staged_candidate_matches(tagsistant_inode candidate, const gchar *fingerprint, const gchar *full_archive_path, gchar **hex, GByteArray **contents)
+{
+	if (!*hex) *hex = tagsistant_checksum_file(full_archive_path, contents);
+	if (!*hex) return (FALSE);
+
+	gchar *candidate_hex = tagsistant_strong_checksum(candidate, fingerprint);
+	gboolean matches = candidate_hex && (g_strcmp0(*hex, candidate_hex) == 0);
+	g_free_null(candidate_hex);
+
+	return (matches);
+}
+
+/**
+ * Callback for tagsistant_find_staged_duplicate()
+ *
+ * @param _inodes a GArray to collect the inodes of the candidates
+ * @param result dbi_result pointer
+ */
+static int tagsistant_find_staged_duplicate_callback(void *_inodes, dbi_result result)
+{
+	tagsistant_inode inode = 0;
+	tagsistant_return_integer(&inode, result);
+	if (inode) g_array_append_val((GArray *) _inodes, inode);
+
+	return (0);
+}
+
+/**
+ * look for a duplicate of an object among the objects with the same
+ * fingerprint. Only older objects (lower inodes) are considered, so
+ * the oldest copy is always the one kept. The strong hashes are
+ * computed only when a candidate exists.
+ *
+ * When the checksum index is enabled, an object whose fingerprint is
+ * not indexed for an older inode is unique and the database is not
+ * queried at all. The indexed inode is tried first, and all the
+ * candidates are queried only if it turns out to be a false match.
+ *
+ * @param inode the inode of the object
+ * @param fingerprint the fingerprint of the object
+ * @param full_archive_path the file of the object
+ * @param hex the strong checksum of the object, computed if NULL
+ * @param contents filled with the contents of the object, if read
+ * @return the inode of the duplicate or 0 if the object is unique
+ */
+static tagsistant_inode tagsistant_find_staged_duplicate(tagsistant_inode inode, const gchar *fingerprint, const gchar *full_archive_path, gchar **hex, GByteArray **contents)
+{
+	tagsistant_inode main_inode = 0;
+	dbi_conn dbi = NULL;
+
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+	tagsistant_inode indexed = tagsistant_checksum_index_lookup(fingerprint);
+	if (!indexed || indexed >= inode) {
+		dbg('2', LOG_INFO, "%s: not indexed, object %d is unique", fingerprint, inode);
+		return (0);
+	}
+
+	int exists = 0;
+	dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select 1 from objects where inode = %d and checksum = '%s'",
+		dbi, tagsistant_return_integer, &exists, indexed, fingerprint);
+	tagsistant_db_connection_release(dbi, 0);
+
+	if (exists) {
+		if (tagsistant_staged_candidate_matches(indexed, fingerprint, full_archive_path, hex, contents)) main_inode = indexed;
+
+		if (main_inode) {
+			dbg('2', LOG_INFO, "%s: indexed duplicate of %d", fingerprint, main_inode);
+			return (main_inode);
+		}
+	} else {
+		/* the indexed object has gone or changed */
+		tagsistant_checksum_index_set(fingerprint, inode, TRUE);
+	}
+#endif
+
+	GArray *candidates = g_array_new(FALSE, FALSE, sizeof(tagsistant_inode));
+
+	dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select inode from objects where checksum = '%s' and inode < %d order by inode",
+		dbi, tagsistant_find_staged_duplicate_callback, candidates, fingerprint, inode);
+	tagsistant_db_connection_release(dbi, 0);
+
+	guint i;
+	for (i = 0; i < candidates->len && !main_inode; i++) {
+		tagsistant_inode candidate = g_array_index(candidates, tagsistant_inode, i);
+		if (tagsistant_staged_candidate_matches(candidate, fingerprint, full_archive_path, hex, contents))
+			main_inode = candidate;
+		if (!*hex) break;
+	}
+
+	dbg('2', LOG_INFO, "%s: %u candidates, duplicate of %d", fingerprint, candidates->len, main_inode);
+
+	g_array_free(candidates, TRUE);
+
+	return (main_inode);
+}
+
+/** the largest range shared by a single FIDEDUPERANGE call */
+#define TAGSISTANT_REFLINK_CHUNK (16 * 1024 * 1024)
+
+/** set once FIDEDUPERANGE turns out to be unsupported by the archive filesystem */
+static gint tagsistant_reflink_unsupported = 0;
+
+/**
+ * share a range of the data blocks of a file with the ones of another
+ * file, using the FIDEDUPERANGE ioctl. The kernel compares the two
+ * ranges before sharing them, so a file changed in the meantime is
+ * never corrupted, and the file keeps its inode, so open file handles
+ * are not affected. Offsets must be aligned to the filesystem block.
+ *
+ * @param src the descriptor of the file holding the original data
+ * @param src_offset where the range starts in src
+ * @param dst the descriptor of the file to be shared (open for writing)
+ * @param dst_offset where the range starts in dst
+ * @param length the length of the range
+ * @return the number of bytes shared from the start of the range
+ */
+static guint64 tagsistant_reflink_range(int src, guint64 src_offset, int dst, guint64 dst_offset, guint64 length)
+{
+	guint64 shared = 0;
+
+#ifdef FIDEDUPERANGE
+	struct file_dedupe_range *range = g_malloc0(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+
+	while (shared < length) {
+		range->src_offset = src_offset + shared;
+		range->src_length = MIN(length - shared, TAGSISTANT_REFLINK_CHUNK);
+		range->dest_count = 1;
+		range->info[0].dest_fd = dst;
+		range->info[0].dest_offset = dst_offset + shared;
+		range->info[0].bytes_deduped = 0;
+		range->info[0].status = 0;
+
+		if (-1 == ioctl(src, FIDEDUPERANGE, range)) {
+			/* the filesystem can't share blocks at all: don't try again */
+			if ((EOPNOTSUPP == errno) || (EINVAL == errno) || (ENOTTY == errno) || (EXDEV == errno)) {
+				if (!g_atomic_int_get(&tagsistant_reflink_unsupported))
+					dbg('2', LOG_ERR, "FIDEDUPERANGE not supported on the archive: %s", strerror(errno));
+				g_atomic_int_set(&tagsistant_reflink_unsupported, 1);
+			}
+			break;
+		}
+
+		if ((FILE_DEDUPE_RANGE_SAME != range->info[0].status) || (0 == range->info[0].bytes_deduped)) {
+			dbg('2', LOG_INFO, "Unable to reflink range at offset %llu (status %d)",
+				(unsigned long long) (dst_offset + shared), range->info[0].status);
+			break;
+		}
+
+		shared += range->info[0].bytes_deduped;
+	}
+
+	g_free(range);
+#else
+	(void) src; (void) src_offset; (void) dst; (void) dst_offset; (void) length;
+#endif
+
+	return (shared);
+}
+
+/**
+ * share all the data blocks of a duplicate with the ones of the
+ * original object
+ *
+ * @param original the file of the original object
+ * @param duplicate the file of the duplicated object
+ * @return TRUE if the whole file is now shared, FALSE otherwise
+ */
+static gboolean tagsistant_reflink_file(const gchar *original, const gchar *duplicate)
+{
+	gboolean shared = FALSE;
+
+	int src = open(original, O_RDONLY|O_NOATIME);
+	if (-1 == src) return (FALSE);
+
+	int dst = open(duplicate, O_RDWR|O_NOATIME);
+	if (-1 == dst) {
+		close(src);
+		return (FALSE);
+	}
+
+	struct stat src_st, dst_st;
+	if ((0 == fstat(src, &src_st)) && (0 == fstat(dst, &dst_st)) && (src_st.st_size == dst_st.st_size))
+		shared = (tagsistant_reflink_range(src, 0, dst, 0, src_st.st_size) == (guint64) src_st.st_size);
+
+	close(dst);
+	close(src);
+
+	return (shared);
+}
+
+/**
+ * share the data blocks of a duplicate with the ones of the original object
+ *
+ * @param main_inode the inode of the original object
+ * @param full_archive_path the file of the duplicated object
+ * @return TRUE on success, FALSE if the objects must be merged instead
+ */
+static gboolean tagsistant_reflink_duplicate(tagsistant_inode main_inode, const gchar *full_archive_path)
+{
+	if (g_atomic_int_get(&tagsistant_reflink_unsupported)) return (FALSE);
+
+	gchar *original = tagsistant_inode_archive_path(main_inode);
+	if (!original) return (FALSE);
+
+	gboolean shared = tagsistant_reflink_file(original, full_archive_path);
+	if (shared) dbg('2', LOG_INFO, "Reflinked %s to %s", full_archive_path, original);
+
+	g_free(original);
+
+	return (shared);
+}
+
+/**
+ * find the oldest object holding a strong checksum, for the full mode
+ *
+ * @param inode the inode of the object
+ * @param hex the strong checksum
+ * @return the inode of the oldest copy or 0 if the object is unique
+ */
+static tagsistant_inode tagsistant_find_older_copy(tagsistant_inode inode, const gchar *hex)
+{
+	tagsistant_inode main_inode = 0;
+
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+	tagsistant_inode indexed = tagsistant_checksum_index_lookup(hex);
+	if (!indexed || indexed >= inode) return (0);
+#endif
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select inode from objects where checksum = '%s' and inode < %d order by inode limit 1",
+		dbi, tagsistant_return_integer, &main_inode, hex, inode);
+	tagsistant_db_connection_release(dbi, 0);
+
+	return (main_inode);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Work queues                                                        ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * The jobs of the deduplication and autotagging queues are saved into
+ * the work_queue table too, so they survive an unmount or a crash.
+ *
+ * A job is saved unclaimed when scheduled, claimed when a worker picks
+ * it up and deleted when the worker completes it, but only if it's
+ * still claimed: an object scheduled again while being processed gets
+ * its job unclaimed, and the row is kept for the newer job.
+ *
+ * On mount, the jobs left behind are unclaimed and queued again.
+ */
+
+/**
+ * save a job into the work_queue table, unclaimed
+ *
+ * @param dbi dbi_conn reference
+ * @param inode the inode of the object
+ * @param task TAGSISTANT_WORK_DEDUPLICATION or TAGSISTANT_WORK_AUTOTAGGING
+ */
+static void tagsistant_work_queue_add(dbi_conn dbi, tagsistant_inode inode, int task)
+{
+	tagsistant_query(
+		"%s into work_queue (inode, task) values (%d, %d)",
+		dbi, NULL, NULL,
+		(TAGSISTANT_DBI_MYSQL_BACKEND == tagsistant.sql_database_driver) ? "insert ignore" : "insert or ignore",
+		inode, task);
+
+	tagsistant_query(
+		"update work_queue set claimed = 0 where inode = %d and task = %d",
+		dbi, NULL, NULL, inode, task);
+}
+
+/**
+ * delete a job from the work_queue table, if still claimed
+ *
+ * @param dbi dbi_conn reference
+ * @param inode the inode of the object
+ * @param task TAGSISTANT_WORK_DEDUPLICATION or TAGSISTANT_WORK_AUTOTAGGING
+ */
+static void tagsistant_work_queue_complete(dbi_conn dbi, tagsistant_inode inode, int task)
+{
+	tagsistant_query(
+		"delete from work_queue where inode = %d and task = %d and claimed = 1",
+		dbi, NULL, NULL, inode, task);
+}
+
+/**
+ * update a job of the work_queue table in a transaction of its own
+ *
+ * @param inode the inode of the object
+ * @param task TAGSISTANT_WORK_DEDUPLICATION or TAGSISTANT_WORK_AUTOTAGGING
+ * @param claimed 1 to claim the job, 0 to save it unclaimed, -1 to complete it
+ */
+static void tagsistant_work_queue_set(tagsistant_inode inode, int task, int claimed)
+{
+	if (!inode) return;
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+
+	if (claimed > 0)
+		tagsistant_query(
+			"update work_queue set claimed = 1 where inode = %d and task = %d",
+			dbi, NULL, NULL, inode, task);
+	else if (claimed == 0)
+		tagsistant_work_queue_add(dbi, inode, task);
+	else
+		tagsistant_work_queue_complete(dbi, inode, task);
+
+	tagsistant_commit_transaction(dbi);
+	tagsistant_db_connection_release(dbi, 1);
+}
+
+/**
+ * schedule an object for autotagging. If the object is already waiting
+ * for a worker, its paths are replaced and the two jobs are merged.
+ *
+ * @param inode the inode of the object
+ * @param paths the path and the full archive path of the object,
+ *   joined by TAGSISTANT_AUTOTAGGING_SEPARATOR (ownership is taken)
+ */
+static void tagsistant_autotagging_schedule(tagsistant_inode inode, gchar *paths)
+{
+	if (!inode) {
+		dbg('p', LOG_ERR, "Object %s has no inode, not autotagged", paths);
+		g_free(paths);
+		return;
+	}
+
+	g_mutex_lock(&tagsistant_autotagging_mutex);
+	gboolean queued = g_hash_table_contains(tagsistant_autotagging_pending, GUINT_TO_POINTER(inode));
+	g_hash_table_replace(tagsistant_autotagging_pending, GUINT_TO_POINTER(inode), paths);
+	g_mutex_unlock(&tagsistant_autotagging_mutex);
+
+	if (queued) {
+		g_atomic_int_inc(&tagsistant_autotagging_coalesced);
+	} else {
+		g_async_queue_push(tagsistant_autotagging_queue, GUINT_TO_POINTER(inode));
+	}
+}
+
+/**
+ * take the paths of an object scheduled for autotagging
+ *
+ * @param inode the inode of the object
+ * @return the paths (to be freed) or NULL
+ */
+static gchar *tagsistant_autotagging_take(tagsistant_inode inode)
+{
+	g_mutex_lock(&tagsistant_autotagging_mutex);
+	gchar *paths = g_hash_table_lookup(tagsistant_autotagging_pending, GUINT_TO_POINTER(inode));
+	if (paths) g_hash_table_steal(tagsistant_autotagging_pending, GUINT_TO_POINTER(inode));
+	g_mutex_unlock(&tagsistant_autotagging_mutex);
+
+	return (paths);
+}
+
+/**
+ * check if an object is waiting for a deduplication worker
+ *
+ * @param inode the inode of the object
+ * @return TRUE if the object is queued for deduplication
+ */
+static gboolean tagsistant_deduplication_is_pending(tagsistant_inode inode)
+{
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+	g_mutex_lock(&tagsistant_deduplication_mutex);
+	gboolean pending = g_hash_table_contains(tagsistant_deduplication_pending, GUINT_TO_POINTER(inode));
+	g_mutex_unlock(&tagsistant_deduplication_mutex);
+
+	return (pending);
+#else
+	(void) inode;
+	return (FALSE);
+#endif
+}
+
+/**
+ * return the statistics of the deduplication and autotagging queues
+ *
+ * @param deduplication_queued the number of objects waiting for deduplication
+ * @param deduplication_coalesced the number of deduplication jobs merged into a newer one
+ * @param deduplication_dropped the number of deduplication jobs abandoned for a newer one
+ * @param autotagging_queued the number of objects waiting for autotagging
+ * @param autotagging_coalesced the number of autotagging jobs merged into a newer one
+ * @param autotagging_dropped the number of autotagging jobs abandoned for a newer one
+ */
+void tagsistant_work_queues_stats(
+	int *deduplication_queued, int *deduplication_coalesced, int *deduplication_dropped,
+	int *autotagging_queued, int *autotagging_coalesced, int *autotagging_dropped)
+{
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+	g_mutex_lock(&tagsistant_deduplication_mutex);
+	*deduplication_queued = g_queue_get_length(tagsistant_deduplication_queue);
+	g_mutex_unlock(&tagsistant_deduplication_mutex);
+#else
+	*deduplication_queued = 0;
+#endif
+
+	g_mutex_lock(&tagsistant_autotagging_mutex);
+	*autotagging_queued = g_hash_table_size(tagsistant_autotagging_pending);
+	g_mutex_unlock(&tagsistant_autotagging_mutex);
+
+	*deduplication_coalesced = g_atomic_int_get(&tagsistant_deduplication_coalesced);
+	*deduplication_dropped = g_atomic_int_get(&tagsistant_deduplication_dropped);
+	*autotagging_coalesced = g_atomic_int_get(&tagsistant_autotagging_coalesced);
+	*autotagging_dropped = g_atomic_int_get(&tagsistant_autotagging_dropped);
+}
+
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+/**
+ * queue an object for deduplication
+ *
+ * @param path the path to be deduplicated
+ * @param save if true, save the job into the work_queue table
+ */
+static void tagsistant_deduplication_enqueue(const gchar *path, gboolean save)
+{
+	tagsistant_inode inode = tagsistant_inode_extract_from_path(path);
+
+	g_mutex_lock(&tagsistant_deduplication_mutex);
+
+	/* a worker processing an older version of the object gives up */
+	tagsistant_deduplication_job *job = inode ? g_hash_table_lookup(tagsistant_deduplication_running, GUINT_TO_POINTER(inode)) : NULL;
+	if (job) g_atomic_int_set(&job->cancelled, 1);
+
+	/* wait for the workers to catch up if the queue is full, unless the object is already queued */
+	while (1) {
+		job = inode ? g_hash_table_lookup(tagsistant_deduplication_pending, GUINT_TO_POINTER(inode)) : NULL;
+		if (job || g_queue_get_length(tagsistant_deduplication_queue) < tagsistant_deduplication_queue_size) break;
+		g_cond_wait(&tagsistant_deduplication_not_full, &tagsistant_deduplication_mutex);
+	}
+
+	gint64 due = g_get_monotonic_time() + tagsistant_deduplication_settle_delay;
+
+	if (job) {
+		/* the object is already waiting for a worker: let it settle again */
+		g_queue_unlink(tagsistant_deduplication_queue, job->link);
+		g_queue_push_tail_link(tagsistant_deduplication_queue, job->link);
+		g_free(job->path);
+		job->path = g_strdup(path);
+		job->due = due;
+
+		g_mutex_unlock(&tagsistant_deduplication_mutex);
+
+		g_atomic_int_inc(&tagsistant_deduplication_coalesced);
+		dbg('2', LOG_INFO, "Deduplication of %s already scheduled, postponed", path);
+		return;
+	}
+
+	job = g_new0(tagsistant_deduplication_job, 1);
+	job->path = g_strdup(path);
+	job->inode = inode;
+	job->due = due;
+
+	g_queue_push_tail(tagsistant_deduplication_queue, job);
+	job->link = g_queue_peek_tail_link(tagsistant_deduplication_queue);
+	if (inode) g_hash_table_insert(tagsistant_deduplication_pending, GUINT_TO_POINTER(inode), job);
+
+	g_cond_signal(&tagsistant_deduplication_not_empty);
+	g_mutex_unlock(&tagsistant_deduplication_mutex);
+
+	/* this also unclaims the job of a worker processing an older version */
+	if (save) tagsistant_work_queue_set(inode, TAGSISTANT_WORK_DEDUPLICATION, 0);
+
+	dbg('2', LOG_INFO, "Scheduled deduplication of %s", path);
+}
+#endif
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Chunk store                                                        ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * With [Deduplication] chunk_store = true, the large objects surviving
+ * whole-file deduplication are moved into the chunk store once they
+ * have been autotagged. They are split into content-defined chunks
+ * (FastCDC: a gear rolling hash with normalized chunking), each chunk
+ * is saved once under chunks/ in the repository, named by its SHA-256,
+ * and the object becomes the list of its chunks in the object_chunks
+ * table. Its file under archive/ is emptied, keeping its size and its
+ * times, so lstat() still works, and the reads are served from the
+ * chunks by tagsistant_chunk_store_pread().
+ *
+ * The rest of tagsistant only sees whole files: a chunked object is
+ * reassembled in place before being written, truncated, hard linked or
+ * deduplicated again. Objects with open handles or more than one link
+ * are never chunked, and the chunks left unreferenced are removed at
+ * mount.
+ */
+
+/** chunk size limits */
+#define TAGSISTANT_CHUNK_MIN_SIZE (64 * 1024)
+#define TAGSISTANT_CHUNK_AVG_SIZE (256 * 1024)
+#define TAGSISTANT_CHUNK_MAX_SIZE (1024 * 1024)
+
+/** cut masks: the stricter one is used below the average size, the looser one above */
+#define TAGSISTANT_CHUNK_MASK_STRICT 0xfffff00000000000ULL
+#define TAGSISTANT_CHUNK_MASK_LOOSE  0xffff000000000000ULL
+
+/** the length of the name of a chunk (its SHA-256) */
+#define TAGSISTANT_CHUNK_CHECKSUM_LENGTH 64
+
+/** the chunk store is enabled by [Deduplication] chunk_store */
+static int tagsistant_chunk_store = 0;
+
+/** objects smaller than [Deduplication] chunk_min_file_size are not chunked */
+static guint64 tagsistant_chunk_min_file_size = 8 * 1024 * 1024;
+
+/** the directory holding the chunks */
+static gchar *tagsistant_chunk_store_path = NULL;
+
+/** the gear table of the rolling hash, filled by tagsistant_chunk_init() */
+static guint64 tagsistant_chunk_gear[256];
+
+/** a chunk of an object */
+typedef struct {
+	guint64 offset;
+	guint64 length;
+	gchar checksum[TAGSISTANT_CHUNK_CHECKSUM_LENGTH + 1];
+} tagsistant_chunk;
+
+/** a descriptor open on an object, with the chunks of the object if chunked */
+typedef struct {
+	tagsistant_inode inode;
+	GArray *chunks;
+} tagsistant_chunk_handle;
+
+/**
+ * the chunked objects, the objects being opened (pinned), the objects
+ * being chunked or reassembled (busy) and the open descriptors, all
+ * guarded by tagsistant_chunk_store_mutex
+ */
+static GHashTable *tagsistant_chunked_objects = NULL;
+static GHashTable *tagsistant_chunk_store_pins = NULL;
+static GHashTable *tagsistant_chunk_store_busy = NULL;
+static GHashTable *tagsistant_chunk_store_handles = NULL;
+static GMutex tagsistant_chunk_store_mutex;
+static GCond tagsistant_chunk_store_cond;
+
+/** held for writing while the unreferenced chunks are removed */
+static GRWLock tagsistant_chunk_store_sweep_lock;
+
+/**
+ * fill the gear table. The values must never change, since the chunk
+ * boundaries of the stored objects depend on them, so they are taken
+ * from a splitmix64 sequence with a fixed seed.
+ */
+static void tagsistant_chunk_init()
+{
+	guint64 state = 0x7461677369737461ULL;
+
+	int i;
+	for (i = 0; i < 256; i++) {
+		guint64 z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		tagsistant_chunk_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/**
+ * find the next cut point
+ *
+ * @param data the data following the previous cut point
+ * @param available the length of data
+ * @return the length of the chunk
+ */
+static gsize tagsistant_chunk_cut(const guchar *data, gsize available)
+{
+	if (available <= TAGSISTANT_CHUNK_MIN_SIZE) return (available);
+
+	gsize limit = MIN(available, TAGSISTANT_CHUNK_MAX_SIZE);
+	gsize normal = MIN(limit, TAGSISTANT_CHUNK_AVG_SIZE);
+	guint64 fingerprint = 0;
+	gsize i;
+
+	/* the hash depends on the last 64 bytes only, so the head of the chunk is skipped */
+	for (i = TAGSISTANT_CHUNK_MIN_SIZE - 64; i < TAGSISTANT_CHUNK_MIN_SIZE; i++)
+		fingerprint = (fingerprint << 1) + tagsistant_chunk_gear[data[i]];
+
+	for (; i < normal; i++) {
+		fingerprint = (fingerprint << 1) + tagsistant_chunk_gear[data[i]];
+		if (!(fingerprint & TAGSISTANT_CHUNK_MASK_STRICT)) return (i + 1);
+	}
+
+	for (; i < limit; i++) {
+		fingerprint = (fingerprint << 1) + tagsistant_chunk_gear[data[i]];
+		if (!(fingerprint & TAGSISTANT_CHUNK_MASK_LOOSE)) return (i + 1);
+	}
+
+	return (limit);
+}
+
+/**
+ * build the path of a chunk, under a directory named after the first
+ * two digits of its checksum
+ *
+ * @param checksum the SHA-256 of the chunk
+ * @return the path (to be freed)
+ */
+static gchar *tagsistant_chunk_path(const gchar *checksum)
+{
+	return (g_strdup_printf("%s%.2s/%s", tagsistant_chunk_store_path, checksum, checksum));
+}
+
+/**
+ * save a chunk, unless already stored. The chunk is written into a
+ * temporary file which is synced and renamed, so a chunk is never seen
+ * incomplete.
+ *
+ * @param checksum the SHA-256 of the chunk
+ * @param data the contents of the chunk
+ * @param length the length of the chunk
+ * @return TRUE on success
+ */
+static gboolean tagsistant_chunk_save(const gchar *checksum, const guchar *data, gsize length)
+{
+	gchar *path = tagsistant_chunk_path(checksum);
+	if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+		g_free(path);
+		return (TRUE);
+	}
+
+	gchar *directory = g_path_get_dirname(path);
+	g_mkdir_with_parents(directory, 0755);
+	g_free(directory);
+
+	gchar *temporary = g_strdup_printf("%s.XXXXXX", path);
+	gboolean saved = FALSE;
+
+	int fd = g_mkstemp(temporary);
+	if (-1 != fd) {
+		gsize written = 0;
+		while (written < length) {
+			ssize_t res = write(fd, data + written, length - written);
+			if (res <= 0) break;
+			written += res;
+		}
+
+		saved = (written == length) && (0 == fdatasync(fd));
+		close(fd);
+
+		if (saved) saved = (0 == rename(temporary, path));
+		if (!saved) unlink(temporary);
+	}
+
+	if (!saved) dbg('2', LOG_ERR, "Unable to save chunk %s", path);
+
+	g_free(temporary);
+	g_free(path);
+
+	return (saved);
+}
+
+/**
+ * split a file into chunks and save them into the chunk store
+ *
+ * @param fd the descriptor of the file
+ * @param inode the inode of the object, to give up if it's written again
+ * @param checksum fed with the whole file
+ * @return a GArray of tagsistant_chunk (to be unreferenced) or NULL on error
+ */
+static GArray *tagsistant_chunk_file(int fd, tagsistant_inode inode, GChecksum *checksum)
+{
+	gsize size = 2 * TAGSISTANT_CHUNK_MAX_SIZE;
+	guchar *buffer = g_malloc(size);
+	gsize start = 0, filled = 0;
+	guint64 offset = 0;
+	gboolean eof = FALSE, failed = FALSE;
+
+	GArray *chunks = g_array_new(FALSE, TRUE, sizeof(tagsistant_chunk));
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (!failed) {
+		/* keep at least a whole chunk in the buffer */
+		if (!eof && (filled - start < TAGSISTANT_CHUNK_MAX_SIZE)) {
+			/* the object has been written again, a newer job will chunk it */
+			if (tagsistant_deduplication_is_pending(inode)) {
+				failed = TRUE;
+				break;
+			}
+
+			memmove(buffer, buffer + start, filled - start);
+			filled -= start;
+			start = 0;
+
+			while (!eof && filled < size) {
+				ssize_t length = read(fd, buffer + filled, size - filled);
+				if (length < 0) {
+					failed = TRUE;
+					break;
+				}
+
+				if (length == 0) eof = TRUE;
+				else g_checksum_update(checksum, buffer + filled, length);
+
+				filled += length;
+				tagsistant_background_throttle(length);
+			}
+
+			if (failed) break;
+		}
+
+		if (start == filled) break;
+
+		tagsistant_chunk chunk;
+		chunk.offset = offset;
+		chunk.length = tagsistant_chunk_cut(buffer + start, filled - start);
+
+		gchar *hex = g_compute_checksum_for_data(G_CHECKSUM_SHA256, buffer + start, chunk.length);
+		g_strlcpy(chunk.checksum, hex, sizeof(chunk.checksum));
+		g_free(hex);
+
+		if (!tagsistant_chunk_save(chunk.checksum, buffer + start, chunk.length)) {
+			failed = TRUE;
+			break;
+		}
+
+		g_array_append_val(chunks, chunk);
+
+		offset += chunk.length;
+		start += chunk.length;
+	}
+
+	g_free(buffer);
+
+	if (failed) {
+		g_array_unref(chunks);
+		return (NULL);
+	}
+
+	return (chunks);
+}
+
+/**
+ * SQL callback: add a chunk to the chunk list of an object
+ *
+ * @param _chunks the GArray of tagsistant_chunk
+ * @param result dbi_result pointer
+ * @return 0 (always, due to SQLite policy)
+ */
+static int tagsistant_chunk_load_callback(void *_chunks, dbi_result result)
+{
+	const gchar *offset = dbi_result_get_string_idx(result, 1);
+	const gchar *length = dbi_result_get_string_idx(result, 2);
+	const gchar *checksum = dbi_result_get_string_idx(result, 3);
+
+	if (offset && length && checksum) {
+		tagsistant_chunk chunk;
+		chunk.offset = g_ascii_strtoull(offset, NULL, 10);
+		chunk.length = g_ascii_strtoull(length, NULL, 10);
+		g_strlcpy(chunk.checksum, checksum, sizeof(chunk.checksum));
+		g_array_append_val((GArray *) _chunks, chunk);
+	}
+
+	return (0);
+}
+
+/**
+ * load the chunk list of an object
+ *
+ * @param inode the inode of the object
+ * @return a GArray of tagsistant_chunk (to be unreferenced) or NULL if not chunked
+ */
+static GArray *tagsistant_chunk_load(tagsistant_inode inode)
+{
+	GArray *chunks = g_array_new(FALSE, TRUE, sizeof(tagsistant_chunk));
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query(
+		"select cast(chunk_offset as varchar(20)), cast(chunk_length as varchar(20)), checksum "
+			"from object_chunks where inode = %d order by chunk_offset",
+		dbi, tagsistant_chunk_load_callback, chunks, inode);
+	tagsistant_db_connection_release(dbi, 0);
+
+	if (!chunks->len) {
+		g_array_unref(chunks);
+		return (NULL);
+	}
+
+	return (chunks);
+}
+
+/**
+ * destroy a tagsistant_chunk_handle
+ *
+ * @param data the handle
+ */
+static void tagsistant_chunk_handle_destroy(gpointer data)
+{
+	tagsistant_chunk_handle *handle = (tagsistant_chunk_handle *) data;
+	if (handle->chunks) g_array_unref(handle->chunks);
+	g_free(handle);
+}
+
+/**
+ * check if an object has open descriptors.
+ * Must be called holding tagsistant_chunk_store_mutex.
+ *
+ * @param inode the inode of the object
+ * @return TRUE if the object is open
+ */
+static gboolean tagsistant_chunk_store_is_open(tagsistant_inode inode)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, tagsistant_chunk_store_handles);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		if (((tagsistant_chunk_handle *) value)->inode == inode) return (TRUE);
+
+	return (FALSE);
+}
+
+/**
+ * check if an object is kept in the chunk store
+ *
+ * @param inode the inode of the object
+ * @return TRUE if chunked
+ */
+gboolean tagsistant_chunk_store_is_chunked(tagsistant_inode inode)
+{
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+	gboolean chunked = g_hash_table_contains(tagsistant_chunked_objects, GUINT_TO_POINTER(inode));
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+	return (chunked);
+}
+
+/**
+ * write the chunks of an object back into its file. The file is
+ * rewritten in place, so the descriptors already open on it see the
+ * whole contents, and the chunk list is deleted once the file is synced.
+ *
+ * @param inode the inode of the object
+ * @param full_archive_path the file of the object
+ * @return TRUE on success
+ */
+static gboolean tagsistant_chunk_store_reassemble(tagsistant_inode inode, const gchar *full_archive_path)
+{
+	GArray *chunks = tagsistant_chunk_load(inode);
+	if (!chunks) return (TRUE);
+
+	struct stat st;
+	int fd = open(full_archive_path, O_WRONLY|O_NOATIME);
+	gboolean reassembled = (-1 != fd) && (0 == fstat(fd, &st));
+
+	guint i;
+	for (i = 0; reassembled && i < chunks->len; i++) {
+		tagsistant_chunk *chunk = &g_array_index(chunks, tagsistant_chunk, i);
+		gchar *path = tagsistant_chunk_path(chunk->checksum);
+		gchar *data = NULL;
+		gsize length = 0;
+
+		reassembled = g_file_get_contents(path, &data, &length, NULL) && (length == chunk->length) &&
+			(pwrite(fd, data, length, chunk->offset) == (ssize_t) length);
+
+		if (!reassembled) dbg('2', LOG_ERR, "Unable to reassemble chunk %s of %s", path, full_archive_path);
+
+		g_free(data);
+		g_free(path);
+	}
+
+	if (reassembled) {
+		/* the object keeps its times */
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		futimens(fd, times);
+		reassembled = (0 == fdatasync(fd));
+	}
+
+	if (-1 != fd) close(fd);
+
+	if (reassembled) {
+		dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+		tagsistant_query("delete from object_chunks where inode = %d", dbi, NULL, NULL, inode);
+		tagsistant_commit_transaction(dbi);
+		tagsistant_db_connection_release(dbi, 1);
+
+		dbg('2', LOG_INFO, "Reassembled %s from %u chunks", full_archive_path, chunks->len);
+	}
+
+	g_array_unref(chunks);
+
+	return (reassembled);
+}
+
+/**
+ * pin an object before opening, truncating or linking its file, so it
+ * can't be chunked meanwhile. An object about to be changed is
+ * reassembled first. The pin must be dropped with
+ * tagsistant_chunk_store_unpin(), even on failure.
+ *
+ * @param inode the inode of the object
+ * @param full_archive_path the file of the object
+ * @param writing TRUE if the file is going to be changed
+ * @return FALSE if the object had to be reassembled and that failed
+ */
+gboolean tagsistant_chunk_store_pin(tagsistant_inode inode, const gchar *full_archive_path, gboolean writing)
+{
+	if (!inode) return (TRUE);
+
+	gpointer key = GUINT_TO_POINTER(inode);
+
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+
+	/* wait for the object to be chunked or reassembled by someone else */
+	while (g_hash_table_contains(tagsistant_chunk_store_busy, key))
+		g_cond_wait(&tagsistant_chunk_store_cond, &tagsistant_chunk_store_mutex);
+
+	guint pins = GPOINTER_TO_UINT(g_hash_table_lookup(tagsistant_chunk_store_pins, key));
+	g_hash_table_replace(tagsistant_chunk_store_pins, key, GUINT_TO_POINTER(pins + 1));
+
+	gboolean reassemble = writing && g_hash_table_contains(tagsistant_chunked_objects, key);
+	if (reassemble) g_hash_table_add(tagsistant_chunk_store_busy, key);
+
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+	if (!reassemble) return (TRUE);
+
+	gboolean reassembled = tagsistant_chunk_store_reassemble(inode, full_archive_path);
+
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+
+	if (reassembled) {
+		g_hash_table_remove(tagsistant_chunked_objects, key);
+
+		/* the descriptors open on the object read the file from now on */
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, tagsistant_chunk_store_handles);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			tagsistant_chunk_handle *handle = (tagsistant_chunk_handle *) value;
+			if ((handle->inode == inode) && handle->chunks) {
+				g_array_unref(handle->chunks);
+				handle->chunks = NULL;
+			}
+		}
+	}
+
+	g_hash_table_remove(tagsistant_chunk_store_busy, key);
+	g_cond_broadcast(&tagsistant_chunk_store_cond);
+
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+	return (reassembled);
+}
+
+/**
+ * drop a pin taken by tagsistant_chunk_store_pin(). If a descriptor
+ * open on the object is given, it's registered, so the reads through
+ * it are served by tagsistant_chunk_store_pread()
+ *
+ * @param inode the inode of the object
+ * @param fd the descriptor open on the object, or -1
+ */
+void tagsistant_chunk_store_unpin(tagsistant_inode inode, int fd)
+{
+	if (!inode) return;
+
+	gpointer key = GUINT_TO_POINTER(inode);
+
+	/* the object is pinned, so it can't be chunked while the list is loaded */
+	GArray *chunks = ((-1 != fd) && tagsistant_chunk_store_is_chunked(inode)) ? tagsistant_chunk_load(inode) : NULL;
+
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+
+	if (-1 != fd) {
+		/* the object could have been reassembled meanwhile */
+		if (chunks && !g_hash_table_contains(tagsistant_chunked_objects, key)) {
+			g_array_unref(chunks);
+			chunks = NULL;
+		}
+
+		tagsistant_chunk_handle *handle = g_new0(tagsistant_chunk_handle, 1);
+		handle->inode = inode;
+		handle->chunks = chunks;
+		g_hash_table_replace(tagsistant_chunk_store_handles, GINT_TO_POINTER(fd), handle);
+	}
+
+	guint pins = GPOINTER_TO_UINT(g_hash_table_lookup(tagsistant_chunk_store_pins, key));
+	if (pins > 1)
+		g_hash_table_replace(tagsistant_chunk_store_pins, key, GUINT_TO_POINTER(pins - 1));
+	else
+		g_hash_table_remove(tagsistant_chunk_store_pins, key);
+
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+}
+
+/**
+ * forget a descriptor registered by tagsistant_chunk_store_unpin(),
+ * before it's closed
+ *
+ * @param fd the descriptor
+ */
+void tagsistant_chunk_store_close(int fd)
+{
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+	g_hash_table_remove(tagsistant_chunk_store_handles, GINT_TO_POINTER(fd));
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+}
+
+/**
+ * pread() an object: a chunked object is read from its chunks, any
+ * other object from its file
+ *
+ * @param fd the descriptor registered by tagsistant_chunk_store_unpin()
+ * @param buf the buffer to be filled
+ * @param size how many bytes should be read
+ * @param offset where the read starts
+ * @return the number of bytes read, or -1 on error (errno is set)
+ */
+ssize_t tagsistant_chunk_store_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	g_mutex_lock(&tagsistant_chunk_store_mutex);
+	tagsistant_chunk_handle *handle = g_hash_table_lookup(tagsistant_chunk_store_handles, GINT_TO_POINTER(fd));
+	GArray *chunks = (handle && handle->chunks) ? g_array_ref(handle->chunks) : NULL;
+	g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+	if (!chunks) return (pread(fd, buf, size, offset));
+
+	/* find the first chunk ending after the offset */
+	guint low = 0, high = chunks->len;
+	while (low < high) {
+		guint middle = (low + high) / 2;
+		tagsistant_chunk *chunk = &g_array_index(chunks, tagsistant_chunk, middle);
+		if (chunk->offset + chunk->length <= (guint64) offset) low = middle + 1;
+		else high = middle;
+	}
+
+	ssize_t done = 0;
+	guint i;
+	for (i = low; (i < chunks->len) && ((size_t) done < size); i++) {
+		tagsistant_chunk *chunk = &g_array_index(chunks, tagsistant_chunk, i);
+		guint64 start = (guint64) offset + done - chunk->offset;
+		size_t length = MIN(size - done, chunk->length - start);
+
+		gchar *path = tagsistant_chunk_path(chunk->checksum);
+		int chunk_fd = open(path, O_RDONLY|O_NOATIME);
+		ssize_t res = (-1 == chunk_fd) ? -1 : pread(chunk_fd, (gchar *) buf + done, length, start);
+		if (-1 != chunk_fd) close(chunk_fd);
+
+		if (res != (ssize_t) length) {
+			dbg('2', LOG_ERR, "Unable to read chunk %s", path);
+			g_free(path);
+			done = -1;
+			break;
+		}
+
+		g_free(path);
+		done += res;
+	}
+
+	g_array_unref(chunks);
+
+	if (-1 == done) errno = EIO;
+	return (done);
+}
+
+/**
+ * move an object into the chunk store: its chunks are saved, its chunk
+ * list is written and its file is emptied, keeping its size and times.
+ * The object is left alone if it's open, linked elsewhere, smaller than
+ * [Deduplication] chunk_min_file_size or changed meanwhile.
+ *
+ * @param inode the inode of the object
+ * @param full_archive_path the file of the object
+ */
+static void tagsistant_chunk_store_add(tagsistant_inode inode, const gchar *full_archive_path)
+{
+	if (!tagsistant_chunk_store || !inode) return;
+
+	int fd = open(full_archive_path, O_RDWR|O_NOATIME);
+	if (-1 == fd) return;
+
+	struct stat st;
+	if ((-1 == fstat(fd, &st)) || !S_ISREG(st.st_mode) || (st.st_nlink > 1) ||
+		((guint64) st.st_size < tagsistant_chunk_min_file_size) || tagsistant_chunk_store_is_chunked(inode)) {
+		close(fd);
+		return;
+	}
+
+	/* the chunks saved are not removed before the chunk list is */
+	g_rw_lock_reader_lock(&tagsistant_chunk_store_sweep_lock);
+
+	GChecksum *checksum = g_checksum_new(tagsistant_deduplication_hash);
+	GArray *chunks = tagsistant_chunk_file(fd, inode, checksum);
+	gchar *hex = tagsistant_checksum_hex(checksum);
+	g_checksum_free(checksum);
+
+	if (chunks) {
+		gpointer key = GUINT_TO_POINTER(inode);
+
+		dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+
+		tagsistant_query("delete from object_chunks where inode = %d", dbi, NULL, NULL, inode);
+
+		guint i;
+		for (i = 0; i < chunks->len; i++) {
+			tagsistant_chunk *chunk = &g_array_index(chunks, tagsistant_chunk, i);
+			tagsistant_query(
+				"insert into object_chunks (inode, chunk_offset, chunk_length, checksum) values (%d, %llu, %llu, '%s')",
+				dbi, NULL, NULL, inode,
+				(unsigned long long) chunk->offset, (unsigned long long) chunk->length, chunk->checksum);
+		}
+
+		/* the file won't hold the contents anymore: the duplicates are compared by the strong hash */
+		tagsistant_query(
+			"update objects set strong_checksum = '%s' where inode = %d and strong_checksum = ''",
+			dbi, NULL, NULL, hex, inode);
+
+		/*
+		 * the object is chunked only if nobody opened, wrote
+		 * or scheduled it again while it was read
+		 */
+		struct stat now;
+		g_mutex_lock(&tagsistant_chunk_store_mutex);
+		gboolean idle =
+			!g_hash_table_contains(tagsistant_chunk_store_pins, key) &&
+			!g_hash_table_contains(tagsistant_chunk_store_busy, key) &&
+			!tagsistant_chunk_store_is_open(inode) &&
+			(0 == fstat(fd, &now)) && (now.st_size == st.st_size) &&
+			(now.st_mtim.tv_sec == st.st_mtim.tv_sec) && (now.st_mtim.tv_nsec == st.st_mtim.tv_nsec) &&
+			!tagsistant_deduplication_is_pending(inode);
+		if (idle) g_hash_table_add(tagsistant_chunk_store_busy, key);
+		g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+		if (idle) {
+			tagsistant_commit_transaction(dbi);
+
+			/* the file keeps its size and times, without data blocks */
+			struct timespec times[2] = { st.st_atim, st.st_mtim };
+			if ((-1 == ftruncate(fd, 0)) || (-1 == ftruncate(fd, st.st_size)) || (-1 == futimens(fd, times)))
+				dbg('2', LOG_ERR, "Unable to empty %s: %s", full_archive_path, strerror(errno));
+
+			g_mutex_lock(&tagsistant_chunk_store_mutex);
+			g_hash_table_add(tagsistant_chunked_objects, key);
+			g_hash_table_remove(tagsistant_chunk_store_busy, key);
+			g_cond_broadcast(&tagsistant_chunk_store_cond);
+			g_mutex_unlock(&tagsistant_chunk_store_mutex);
+
+			dbg('2', LOG_INFO, "Chunked %s: %u chunks", full_archive_path, chunks->len);
+		} else {
+			tagsistant_rollback_transaction(dbi);
+			dbg('2', LOG_INFO, "%s changed while being chunked", full_archive_path);
+		}
+
+		tagsistant_db_connection_release(dbi, 1);
+		g_array_unref(chunks);
+	} else {
+		dbg('2', LOG_ERR, "Error chunking %s", full_archive_path);
+	}
+
+	g_rw_lock_reader_unlock(&tagsistant_chunk_store_sweep_lock);
+
+	g_free(hex);
+	close(fd);
+}
+
+/**
+ * SQL callback: add a chunked object to tagsistant_chunked_objects
+ *
+ * @param unused not used
+ * @param result dbi_result pointer
+ * @return 0 (always, due to SQLite policy)
+ */
+static int tagsistant_chunk_store_init_callback(void *unused, dbi_result result)
+{
+	(void) unused;
+
+	tagsistant_inode inode = 0;
+	tagsistant_return_integer(&inode, result);
+	if (inode) g_hash_table_add(tagsistant_chunked_objects, GUINT_TO_POINTER(inode));
+
+	return (0);
+}
+
+/**
+ * SQL callback: add a chunk to a set of referenced chunks
+ *
+ * @param _referenced the GHashTable set of the checksums
+ * @param result dbi_result pointer
+ * @return 0 (always, due to SQLite policy)
+ */
+static int tagsistant_chunk_store_sweep_callback(void *_referenced, dbi_result result)
+{
+	const gchar *checksum = dbi_result_get_string_idx(result, 1);
+	if (checksum) g_hash_table_add((GHashTable *) _referenced, g_strdup(checksum));
+
+	return (0);
+}
+
+/**
+ * remove the chunks no longer referenced by any object, and the
+ * temporary files left by an interruption. Run once at mount, while
+ * no object can be chunked.
+ *
+ * @param data not used
+ */
+static gpointer tagsistant_chunk_store_sweep(gpointer data)
+{
+	(void) data;
+
+	tagsistant_background_thread_init();
+
+	g_rw_lock_writer_lock(&tagsistant_chunk_store_sweep_lock);
+
+	GHashTable *referenced = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query("select distinct checksum from object_chunks", dbi, tagsistant_chunk_store_sweep_callback, referenced);
+	tagsistant_db_connection_release(dbi, 0);
+
+	guint removed = 0;
+	const gchar *prefix = NULL;
+	GDir *store = g_dir_open(tagsistant_chunk_store_path, 0, NULL);
+
+	while (store && (prefix = g_dir_read_name(store))) {
+		gchar *directory = g_build_filename(tagsistant_chunk_store_path, prefix, NULL);
+		const gchar *name = NULL;
+		GDir *chunks = g_dir_open(directory, 0, NULL);
+
+		while (chunks && (name = g_dir_read_name(chunks))) {
+			if (g_hash_table_contains(referenced, name)) continue;
+
+			gchar *path = g_build_filename(directory, name, NULL);
+			if (0 == unlink(path)) removed++;
+			g_free(path);
+		}
+
+		if (chunks) g_dir_close(chunks);
+		g_free(directory);
+	}
+
+	if (store) g_dir_close(store);
+
+	g_rw_lock_writer_unlock(&tagsistant_chunk_store_sweep_lock);
+
+	dbg('2', LOG_INFO, "Removed %u unreferenced chunks out of %u", removed, removed + g_hash_table_size(referenced));
+	g_hash_table_destroy(referenced);
+
+	return (NULL);
+}
+
 /**
- * deduplication function called by tagsistant_calculate_object_checksum
- *
- * @param inode the object inode
- * @param hex the checksum string
- * @param dbi DBI connection handle
- * @return true if autotagging is requested, false otherwise
+ * setup the chunk store. The chunked objects are loaded even when the
+ * chunk store is disabled, since they must be read and reassembled.
  */
-int tagsistant_querytree_find_duplicates(tagsistant_querytree *qtree, gchar *hex)
+static void tagsistant_chunk_store_init()
 {
-	tagsistant_inode main_inode = 0;
+	tagsistant_chunked_objects = g_hash_table_new(NULL, NULL);
+	tagsistant_chunk_store_pins = g_hash_table_new(NULL, NULL);
+	tagsistant_chunk_store_busy = g_hash_table_new(NULL, NULL);
+	tagsistant_chunk_store_handles = g_hash_table_new_full(NULL, NULL, NULL, tagsistant_chunk_handle_destroy);
 
-	/*
-	 * get the first inode matching the checksum
-	 */
-	tagsistant_query(
-		"select inode from objects where checksum = '%s' order by inode limit 1",
-		qtree->dbi,	tagsistant_return_integer, &main_inode,	hex);
+	tagsistant_chunk_store_path = g_strdup_printf("%s/chunks/", tagsistant.repository);
 
-	/*
-	 * if main_inode is zero, something gone wrong, we must
-	 * return here, but auto-tagging can be performed
-	 */
-	if (!main_inode) {
-		dbg('2', LOG_ERR, "Inode 0 returned for checksum %s", hex);
-		return (TAGSISTANT_DO_AUTOTAGGING);
+	gchar *chunk_store = tagsistant_get_ini_entry("Deduplication", "chunk_store");
+	if (chunk_store) {
+		tagsistant_chunk_store = (g_strcmp0(chunk_store, "1") == 0 || g_ascii_strcasecmp(chunk_store, "true") == 0);
+		g_free(chunk_store);
 	}
 
-	/*
-	 * if this is the only copy of the file, we can
-	 * return and auto-tagging can be performed
-	 */
-	if (qtree->inode == main_inode) return (TAGSISTANT_DO_AUTOTAGGING);
-
-	dbg('2', LOG_INFO, "Deduplicating %s: %d -> %d", qtree->full_archive_path, qtree->inode, main_inode);
-
-	/* first move all the tags of qtree->inode to main_inode */
-	tagsistant_query(
-		"update tagging set inode = %d where inode = %d",
-		qtree->dbi,	NULL, NULL,	main_inode,	qtree->inode);
-
-	/* then delete records left because of duplicates in key(inode, tag_id) in the tagging table */
-	tagsistant_query(
-		"delete from tagging where inode = %d",
-		qtree->dbi,	NULL, NULL,	qtree->inode);
+	gchar *chunk_min_file_size = tagsistant_get_ini_entry("Deduplication", "chunk_min_file_size");
+	if (chunk_min_file_size) {
+		tagsistant_chunk_min_file_size = g_ascii_strtoull(chunk_min_file_size, NULL, 10);
+		g_free(chunk_min_file_size);
+	}
 
-	/* unlink the removable inode */
-	tagsistant_query(
-		"delete from objects where inode = %d",
-		qtree->dbi, NULL, NULL,	qtree->inode);
+	if (tagsistant_chunk_store && (-1 == g_mkdir_with_parents(tagsistant_chunk_store_path, 0755))) {
+		dbg('2', LOG_ERR, "Can't create %s, chunk store disabled: %s", tagsistant_chunk_store_path, strerror(errno));
+		tagsistant_chunk_store = 0;
+	}
 
-	/* and finally delete it from the archive directory */
-	qtree->schedule_for_unlink = 1;
+	tagsistant_chunk_init();
 
-#if TAGSISTANT_ENABLE_AND_SET_CACHE
-	/*
-	 * invalidate the and_set cache
-	 */
-	tagsistant_invalidate_and_set_cache_entries(qtree);
-#endif
+	/* drop the chunk lists of the objects deleted meanwhile and load the chunked objects */
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+	tagsistant_query("delete from object_chunks where inode not in (select inode from objects)", dbi, NULL, NULL);
+	tagsistant_query("select distinct inode from object_chunks", dbi, tagsistant_chunk_store_init_callback, NULL);
+	tagsistant_commit_transaction(dbi);
+	tagsistant_db_connection_release(dbi, 1);
 
-	// don't do autotagging, the file has gone
-	return (TAGSISTANT_DONT_DO_AUTOTAGGING);
+	dbg('2', LOG_INFO, "%u objects in the chunk store", g_hash_table_size(tagsistant_chunked_objects));
 }
 
 /**
  * kernel of the deduplication thread
  *
+ * In full mode the strong hash of the whole file is stored in the
+ * checksum column and duplicates are found by an exact match.
+ *
+ * In staged mode the checksum column holds the fingerprint of the
+ * file (size and fast hash of the head and tail blocks) and the strong
+ * hash is computed only when other objects share the fingerprint, so
+ * unique files are never read in full.
+ *
+ * The strong hash, when known, is saved in the strong_checksum column,
+ * which is cleared when the object is written. An object which still
+ * has it is being checksummed again after a change of the settings:
+ * its contents are known and it's not autotagged again.
+ *
+ * A duplicate is merged into the oldest copy, moving its tags there,
+ * unless [Deduplication] merge is "reflink": then the two objects are
+ * kept and only their data blocks are shared, on filesystems that
+ * support it.
+ *
+ * A chunked object is reassembled first, and the object is kept pinned
+ * until it's done, so it can't be chunked while it's read.
+ *
  * @param data the path to be deduplicated (must be casted back to gchar*)
  */
 gpointer tagsistant_deduplication_kernel(gpointer data)
 {
 	gchar *path = (gchar *) data;
+	gchar *hex = NULL, *checksum = NULL;
+	tagsistant_inode inode = 0, main_inode = 0;
+	GByteArray *contents = NULL;
+
+#if TAGSISTANT_ENABLE_AUTOTAGGING
+	/* keep the contents read for hashing, to share them with the autotagger */
+	GByteArray **shared = &contents;
+#else
+	GByteArray **shared = NULL;
+#endif
+
+	gchar *full_archive_path = tagsistant_object_archive_path(path, &inode);
+	if (!full_archive_path) return (NULL);
+
+	dbg('2', LOG_INFO, "Running deduplication on %s", path);
 
-	// dbg('2', LOG_INFO, "Deduplication request for %s", path);
+	if (!tagsistant_chunk_store_pin(inode, full_archive_path, TRUE)) {
+		/* a chunked object that can't be reassembled is not retried on next mount */
+		tagsistant_chunk_store_unpin(inode, -1);
+		tagsistant_work_queue_set(inode, TAGSISTANT_WORK_DEDUPLICATION, -1);
+		g_free(full_archive_path);
+		return (NULL);
+	}
+
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+	/*
+	 * the file could have been hashed while it was written
+	 */
+	hex = tagsistant_checksum_stream_take(inode);
+	if (hex) dbg('2', LOG_INFO, "Using streamed checksum %s for %s", hex, path);
+#endif
+
+	/*
+	 * or its strong hash could be still valid
+	 */
+	gboolean unchanged = FALSE;
+	if (!hex) {
+		dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+		tagsistant_query(
+			"select strong_checksum from objects where inode = %d",
+			dbi, tagsistant_return_string, &hex, inode);
+		tagsistant_db_connection_release(dbi, 0);
+
+		if (hex && *hex) {
+			dbg('2', LOG_INFO, "Using saved checksum %s for %s", hex, path);
+			unchanged = TRUE;
+		} else {
+			g_free_null(hex);
+		}
+	}
+
+	if (TAGSISTANT_DEDUPLICATION_STAGED == tagsistant_deduplication_mode) {
+		checksum = tagsistant_fingerprint_file(full_archive_path);
+		if (checksum) main_inode = tagsistant_find_staged_duplicate(inode, checksum, full_archive_path, &hex, shared);
+	} else {
+		if (!hex) hex = tagsistant_checksum_file(full_archive_path, shared);
+		checksum = g_strdup(hex);
+	}
+
+	/*
+	 * the object has been written again while it was hashed:
+	 * leave it to the newer job
+	 */
+	if (tagsistant_deduplication_superseded()) {
+		dbg('2', LOG_INFO, "Deduplication of %s superseded by a newer version", path);
+		g_atomic_int_inc(&tagsistant_deduplication_dropped);
+		tagsistant_chunk_store_unpin(inode, -1);
+		g_free_null(hex);
+		g_free_null(checksum);
+		g_free_null(full_archive_path);
+		if (contents) g_byte_array_free(contents, TRUE);
+		return (NULL);
+	}
 
 	/*
-	 * create a qtree object just to extract the full_archive_path
+	 * in reflink mode the duplicate is kept, sharing the data blocks
+	 * of the original object, and is merged only if that fails
 	 */
+	gboolean reflinked = FALSE;
+	if (checksum && (TAGSISTANT_DEDUPLICATION_REFLINK == tagsistant_deduplication_merge)) {
+		tagsistant_inode original = (TAGSISTANT_DEDUPLICATION_STAGED == tagsistant_deduplication_mode)
+			? main_inode
+			: tagsistant_find_older_copy(inode, checksum);
+
+		if (original && tagsistant_reflink_duplicate(original, full_archive_path)) {
+			reflinked = TRUE;
+			main_inode = 0;
+		}
+	}
+
+	g_free_null(full_archive_path);
+
+	if (!checksum) {
+		/* an unreadable object is not retried on next mount */
+		tagsistant_work_queue_set(inode, TAGSISTANT_WORK_DEDUPLICATION, -1);
+		tagsistant_chunk_store_unpin(inode, -1);
+		g_free_null(hex);
+		if (contents) g_byte_array_free(contents, TRUE);
+		return (NULL);
+	}
+
+	/* the object to be chunked, if it survives and it's not autotagged */
+	gchar *chunk_path = NULL;
+
+	/* re-create the qtree object */
 	tagsistant_querytree *qtree = tagsistant_querytree_new(path, 0, 0, 1, 1);
 
 	if (qtree) {
-		int fd = open(qtree->full_archive_path, O_RDONLY|O_NOATIME);
-		// tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
-
-		if (-1 != fd) {
-			dbg('2', LOG_INFO, "Running deduplication on %s", path);
-
-			GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
-			guchar buffer[65535];
-
-			if (checksum) {
-				/* feed the checksum object */
-				int length = 0;
-				do {
-					length = read(fd, buffer, 65535);
-					g_checksum_update(checksum, buffer, length);
-				} while (length > 0);
-
-				/* get the hexadecimal checksum string */
-				gchar *hex = g_strdup(g_checksum_get_string(checksum));
-
-				/* destroy the checksum object */
-				g_checksum_free(checksum);
-
-				/* re-create the qtree object */
-				// qtree = tagsistant_querytree_new(path, 0, 1, 1, 1);
-
-				if (qtree) {
-					/*
-					 * save the string into the objects table
-					 */
-					tagsistant_query(
-						"update objects set checksum = '%s' where inode = %d",
-						qtree->dbi, NULL, NULL, hex, qtree->inode);
-	
-					/*
-					 * look for duplicated objects
-					 */
-					if (tagsistant_querytree_find_duplicates(qtree, hex)) {
-#if TAGSISTANT_ENABLE_AUTOTAGGING
-						/*
-						 * before destroying the qtree, we build the string
-						 * to schedule the object for autotagging
-						 */
-						gchar *paths = g_strdup_printf("%s%s%s",
-							path, TAGSISTANT_AUTOTAGGING_SEPARATOR,
-							qtree->full_archive_path);
-
-						dbg('p', LOG_INFO, "Running autotagging on %s", qtree->object_path);
-
-						/*
-						 * the object is eligible for autotagging,
-						 * so we submit it into the autotagging queue
-						 */
-						g_async_queue_push(tagsistant_autotagging_queue, paths);
+		/*
+		 * save the string into the objects table
+		 */
+		tagsistant_query(
+			"update objects set checksum = '%s', strong_checksum = '%s' where inode = %d",
+			qtree->dbi, NULL, NULL, checksum, hex ? hex : "", qtree->inode);
+
+		/*
+		 * look for duplicated objects
+		 */
+		int do_autotagging = TAGSISTANT_DO_AUTOTAGGING;
+		gboolean queried = FALSE;
+		if (reflinked) {
+			/* the object is kept and autotagged on its own */
+		} else if (TAGSISTANT_DEDUPLICATION_STAGED == tagsistant_deduplication_mode) {
+			if (main_inode) do_autotagging = tagsistant_querytree_merge_duplicate(qtree, main_inode);
+		} else {
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+			/* the database is queried only if an older object could share the checksum */
+			tagsistant_inode indexed = tagsistant_checksum_index_lookup(checksum);
+			if (indexed && indexed < qtree->inode)
 #endif
-					}
+			{
+				do_autotagging = tagsistant_querytree_find_duplicates(qtree, checksum);
+				queried = TRUE;
+			}
+		}
 
-					tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
-				}
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+		/*
+		 * the object survived, so it's the oldest holder of its checksum;
+		 * if the database confirmed it, a stale entry is replaced too
+		 */
+		if (do_autotagging) tagsistant_checksum_index_set(checksum, qtree->inode, queried);
+#else
+		(void) queried;
+#endif
 
-				/* free the hex checksum string */
-				g_free_null(hex);
-			}
+		/*
+		 * a unique object goes into the chunk store once autotagged:
+		 * here if it's not autotagged again, by the autotagger otherwise
+		 */
+		if (do_autotagging && (unchanged || !TAGSISTANT_ENABLE_AUTOTAGGING))
+			chunk_path = g_strdup(qtree->full_archive_path);
+
+		if (do_autotagging && unchanged) {
+			dbg('p', LOG_INFO, "Contents of %s unchanged, not autotagged again", qtree->object_path);
+		} else if (do_autotagging) {
+#if TAGSISTANT_ENABLE_AUTOTAGGING
+			/*
+			 * before destroying the qtree, we build the string
+			 * to schedule the object for autotagging
+			 */
+			gchar *paths = g_strdup_printf("%s%s%s",
+				path, TAGSISTANT_AUTOTAGGING_SEPARATOR,
+				qtree->full_archive_path);
+
+			dbg('p', LOG_INFO, "Running autotagging on %s", qtree->object_path);
+
+			/*
+			 * the contents already read are handed over,
+			 * so the autotagger doesn't read the file again
+			 */
+			tagsistant_shared_contents_put(qtree->full_archive_path, contents);
+			contents = NULL;
+
+			/*
+			 * the object is eligible for autotagging,
+			 * so we submit it into the autotagging queue
+			 */
+			tagsistant_work_queue_add(qtree->dbi, qtree->inode, TAGSISTANT_WORK_AUTOTAGGING);
+			tagsistant_autotagging_schedule(qtree->inode, paths);
+#endif
 		}
 
-		close(fd);
+		/* the autotagging job, if any, is saved before the deduplication one is completed */
+		tagsistant_work_queue_complete(qtree->dbi, inode, TAGSISTANT_WORK_DEDUPLICATION);
+
+		tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
+	}
+
+	tagsistant_chunk_store_unpin(inode, -1);
+
+	/* chunk the object once the transaction has been committed */
+	if (chunk_path) {
+		tagsistant_chunk_store_add(inode, chunk_path);
+		g_free(chunk_path);
 	}
 
+	/* free the checksum strings and the unused contents */
+	g_free_null(hex);
+	g_free_null(checksum);
+	if (contents) g_byte_array_free(contents, TRUE);
+
 	return (NULL);
 }
 
@@ -215,10 +2905,49 @@ gpointer tagsistant_autotagging_kernel(gpointer data)
 	gchar *path = splitted_paths[0];
 	gchar *full_archive_path = splitted_paths[1];
 
+	GByteArray *contents = tagsistant_shared_contents_take(full_archive_path);
+
 	/*
-	 * call the plugin processors
+	 * the object has been written again and will be autotagged
+	 * once the newer version has been deduplicated
 	 */
-	tagsistant_process(path, full_archive_path);
+	tagsistant_inode inode = tagsistant_inode_extract_from_path(path);
+	if (tagsistant_deduplication_is_pending(inode)) {
+		dbg('p', LOG_INFO, "Autotagging of %s superseded by a newer version", path);
+		g_atomic_int_inc(&tagsistant_autotagging_dropped);
+
+		/* the newer version saves its own job, if it needs one */
+		tagsistant_work_queue_set(inode, TAGSISTANT_WORK_AUTOTAGGING, -1);
+	} else if (!tagsistant_chunk_store_pin(inode, full_archive_path, TRUE)) {
+		/* a chunked object that can't be reassembled is not autotagged */
+		tagsistant_chunk_store_unpin(inode, -1);
+		tagsistant_work_queue_set(inode, TAGSISTANT_WORK_AUTOTAGGING, -1);
+	} else {
+		/* the plugins read the file by themselves, account it in advance */
+		struct stat st;
+		if (!contents && (lstat(full_archive_path, &st) == 0)) tagsistant_background_throttle(st.st_size);
+
+		/*
+		 * call the plugin processors on the contents read by the
+		 * deduplication worker, if any, or on the file itself
+		 */
+		tagsistant_process(path, full_archive_path, contents ? contents->data : NULL, contents ? contents->len : 0);
+
+		/*
+		 * record the autotagging time and complete the job
+		 */
+		dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+		tagsistant_query("update objects set last_autotag = current_timestamp where inode = %d", dbi, NULL, NULL, inode);
+		tagsistant_work_queue_complete(dbi, inode, TAGSISTANT_WORK_AUTOTAGGING);
+		tagsistant_commit_transaction(dbi);
+		tagsistant_db_connection_release(dbi, 1);
+
+		/* the object goes into the chunk store once autotagged */
+		tagsistant_chunk_store_unpin(inode, -1);
+		tagsistant_chunk_store_add(inode, full_archive_path);
+	}
+
+	if (contents) g_byte_array_free(contents, TRUE);
 
 	/*
 	 * clean up the string vector and quit
@@ -231,26 +2960,59 @@ gpointer tagsistant_autotagging_kernel(gpointer data)
 
 #if ! TAGSISTANT_INLINE_DEDUPLICATION
 /**
- * This is the loop that calls the deduplication thread
- * when TAGSISTANT_AUTOTAG_IN_MULTIPLE_THREADS is 0
+ * This is the loop run by each deduplication worker
+ * when TAGSISTANT_INLINE_DEDUPLICATION is 0
  */
 gpointer tagsistant_deduplication_loop(gpointer data) {
 	(void) data;
 
+	tagsistant_background_thread_init();
+
 	while (1) {
-		/* get a path from the queue */
-		gchar *path = (gchar *) g_async_queue_pop(tagsistant_deduplication_queue);
+		/* get a job from the queue, once its object has settled */
+		g_mutex_lock(&tagsistant_deduplication_mutex);
+		while (1) {
+			tagsistant_deduplication_job *head = g_queue_peek_head(tagsistant_deduplication_queue);
+			if (!head)
+				g_cond_wait(&tagsistant_deduplication_not_empty, &tagsistant_deduplication_mutex);
+			else if (head->due > g_get_monotonic_time())
+				g_cond_wait_until(&tagsistant_deduplication_not_empty, &tagsistant_deduplication_mutex, head->due);
+			else
+				break;
+		}
+
+		tagsistant_deduplication_job *job = g_queue_pop_head(tagsistant_deduplication_queue);
+		job->link = NULL;
+		if (job->inode) {
+			g_hash_table_remove(tagsistant_deduplication_pending, GUINT_TO_POINTER(job->inode));
+			g_hash_table_replace(tagsistant_deduplication_running, GUINT_TO_POINTER(job->inode), job);
+		}
+
+		g_cond_signal(&tagsistant_deduplication_not_full);
+		g_mutex_unlock(&tagsistant_deduplication_mutex);
+
+		tagsistant_work_queue_set(job->inode, TAGSISTANT_WORK_DEDUPLICATION, 1);
 
 		/* process the path only if it's not null */
-		if (path && strlen(path)) {
-			dbg('2', LOG_ERR, "Starting parallel deduplication of %s", path);
-			tagsistant_deduplication_kernel(path);
+		if (job->path && strlen(job->path)) {
+			dbg('2', LOG_ERR, "Starting parallel deduplication of %s", job->path);
+			tagsistant_background_acquire();
+			g_private_set(&tagsistant_deduplication_current_job, job);
+			tagsistant_deduplication_kernel(job->path);
+			g_private_set(&tagsistant_deduplication_current_job, NULL);
+			tagsistant_background_release();
 		} else {
 			dbg('2', LOG_ERR, "NULL or zero-length path scheduled for deduplication");
 		}
 
-		/* throw away the path */
-		g_free_null(path);
+		/* throw away the job */
+		g_mutex_lock(&tagsistant_deduplication_mutex);
+		if (job->inode && (g_hash_table_lookup(tagsistant_deduplication_running, GUINT_TO_POINTER(job->inode)) == job))
+			g_hash_table_remove(tagsistant_deduplication_running, GUINT_TO_POINTER(job->inode));
+		g_mutex_unlock(&tagsistant_deduplication_mutex);
+
+		g_free_null(job->path);
+		g_free(job);
 	}
 
 	return (NULL);
@@ -258,18 +3020,25 @@ gpointer tagsistant_deduplication_loop(gpointer data) {
 #endif
 
 /**
- * This is the loop that calls the autotagging thread
- * when TAGSISTANT_AUTOTAG_IN_MULTIPLE_THREADS is 0
+ * This is the loop run by each autotagging worker
  */
 gpointer tagsistant_autotagging_loop(gpointer data) {
 	(void) data;
 
+	tagsistant_background_thread_init();
+
 	while (1) {
-		/* get a path from the queue */
-		gchar *path = (gchar *) g_async_queue_pop(tagsistant_autotagging_queue);
+		/* get an object from the queue and its latest paths */
+		tagsistant_inode inode = GPOINTER_TO_UINT(g_async_queue_pop(tagsistant_autotagging_queue));
+		gchar *path = tagsistant_autotagging_take(inode);
+		if (path) tagsistant_work_queue_set(inode, TAGSISTANT_WORK_AUTOTAGGING, 1);
 
 		/* process the path only if it's not null */
-		if (path && strlen(path)) tagsistant_autotagging_kernel(path);
+		if (path && strlen(path)) {
+			tagsistant_background_acquire();
+			tagsistant_autotagging_kernel(path);
+			tagsistant_background_release();
+		}
 
 		/* throw away the path */
 		g_free_null(path);
@@ -278,46 +3047,334 @@ gpointer tagsistant_autotagging_loop(gpointer data) {
 	return (NULL);
 }
 
+/** the number of objects fetched by each query of the checksum backfill */
+#define TAGSISTANT_BACKFILL_BATCH 256
+
+/** the progress of the checksum backfill, guarded by tagsistant_backfill_mutex */
+static struct {
+	int running;
+	int total;
+	int queued;
+	guint64 bytes;
+	tagsistant_inode cursor;
+} tagsistant_backfill = { 0, 0, 0, 0, 0 };
+
+static GMutex tagsistant_backfill_mutex;
+
+/**
+ * return the progress of the checksum backfill
+ *
+ * @param running set to 1 while the backfill is running
+ * @param total the number of objects to be checksummed when the backfill started
+ * @param queued the number of objects already scheduled for deduplication
+ * @param bytes the size of the objects already scheduled
+ * @param cursor the inode of the last object scheduled
+ */
+void tagsistant_checksum_backfill_stats(int *running, int *total, int *queued, guint64 *bytes, tagsistant_inode *cursor)
+{
+	g_mutex_lock(&tagsistant_backfill_mutex);
+	*running = tagsistant_backfill.running;
+	*total = tagsistant_backfill.total;
+	*queued = tagsistant_backfill.queued;
+	*bytes = tagsistant_backfill.bytes;
+	*cursor = tagsistant_backfill.cursor;
+	g_mutex_unlock(&tagsistant_backfill_mutex);
+}
+
+/**
+ * save the backfill cursor into the database, so an interrupted
+ * backfill resumes from there on next mount
+ *
+ * @param cursor the inode of the last object scheduled (0 to restart from the beginning)
+ */
+static void tagsistant_checksum_backfill_save_cursor(tagsistant_inode cursor)
+{
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+
+	tagsistant_query("delete from checksum_backfill", dbi, NULL, NULL);
+	if (cursor) tagsistant_query("insert into checksum_backfill (last_inode) values (%d)", dbi, NULL, NULL, cursor);
+
+	tagsistant_commit_transaction(dbi);
+	tagsistant_db_connection_release(dbi, 1);
+}
+
 /**
- * Callback for tagsistant_fix_checksums()
+ * Callback for tagsistant_checksum_backfill_loop()
+ *
+ * @param _paths a GPtrArray to collect the paths of the objects
+ * @param result dbi_result pointer
  */
-int tagsistant_fix_checksums_callback(void *null_pointer, dbi_result result)
+int tagsistant_fix_checksums_callback(void *_paths, dbi_result result)
 {
-	(void) null_pointer;
+	GPtrArray *paths = (GPtrArray *) _paths;
 
 	/* fetch the inode and the objectname from the query */
 	const gchar *inode = dbi_result_get_string_idx(result, 1);
 	const gchar *objectname = dbi_result_get_string_idx(result, 2);
 
 	/* build the path using the ALL/ tag */
-	gchar *path = g_strdup_printf("/store/ALL/@@/%s%s%s", inode, TAGSISTANT_INODE_DELIMITER, objectname);
+	g_ptr_array_add(paths, g_strdup_printf("/store/ALL/@@/%s%s%s", inode, TAGSISTANT_INODE_DELIMITER, objectname));
 
-	/* deduplicate the object */
-	tagsistant_deduplicate(path);
+	return (0);
+}
 
-	/* free the path and return */
-	g_free(path);
+/**
+ * queue again the jobs left in the work_queue table by the last mount.
+ * The jobs of the objects deleted in the meantime are dropped.
+ */
+static void tagsistant_work_queue_resume()
+{
+	GPtrArray *deduplication = g_ptr_array_new_with_free_func(g_free);
+	GPtrArray *autotagging = g_ptr_array_new_with_free_func(g_free);
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+
+	tagsistant_query("delete from work_queue where inode not in (select inode from objects)", dbi, NULL, NULL);
+	tagsistant_query("update work_queue set claimed = 0", dbi, NULL, NULL);
+
+	tagsistant_query(
+		"select cast(objects.inode as varchar(12)), objectname from work_queue "
+			"join objects on objects.inode = work_queue.inode "
+			"where task = %d order by work_queue.inode",
+		dbi, tagsistant_fix_checksums_callback, deduplication, TAGSISTANT_WORK_DEDUPLICATION);
+
+	tagsistant_query(
+		"select cast(objects.inode as varchar(12)), objectname from work_queue "
+			"join objects on objects.inode = work_queue.inode "
+			"where task = %d order by work_queue.inode",
+		dbi, tagsistant_fix_checksums_callback, autotagging, TAGSISTANT_WORK_AUTOTAGGING);
+
+	tagsistant_commit_transaction(dbi);
+	tagsistant_db_connection_release(dbi, 1);
+
+	dbg('2', LOG_INFO, "Resuming %u deduplication and %u autotagging jobs", deduplication->len, autotagging->len);
+
+	guint i;
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+	for (i = 0; i < deduplication->len; i++)
+		tagsistant_deduplication_enqueue(g_ptr_array_index(deduplication, i), FALSE);
+#endif
+
+	for (i = 0; i < autotagging->len; i++) {
+		gchar *path = g_ptr_array_index(autotagging, i);
+		tagsistant_inode inode = 0;
+
+		gchar *full_archive_path = tagsistant_object_archive_path(path, &inode);
+		if (full_archive_path)
+			tagsistant_autotagging_schedule(inode, g_strdup_printf("%s%s%s", path, TAGSISTANT_AUTOTAGGING_SEPARATOR, full_archive_path));
+		g_free_null(full_archive_path);
+	}
+
+	g_ptr_array_free(deduplication, TRUE);
+	g_ptr_array_free(autotagging, TRUE);
+}
+
+/**
+ * read a rate limit of the checksum backfill from the repository.ini
+ *
+ * @param key the ini key
+ * @return the limit or 0 if unlimited
+ */
+static guint64 tagsistant_checksum_backfill_limit(const gchar *key)
+{
+	guint64 limit = 0;
+
+	gchar *value = tagsistant_get_ini_entry("Deduplication", (gchar *) key);
+	if (value) {
+		limit = g_ascii_strtoull(value, NULL, 10);
+		g_free(value);
+	}
+
+	return (limit);
+}
+
+/**
+ * Schedule the objects lacking the checksum for deduplication. Runs in
+ * its own thread, so mounting is not delayed.
+ *
+ * The jobs saved in the work_queue table by the last mount are queued
+ * first.
+ *
+ * The objects are fetched in batches ordered by inode, and the inode of
+ * the last object scheduled is saved into the checksum_backfill table
+ * before each batch, so an interrupted backfill is resumed from there.
+ * The objects left in the queue at unmount are saved in the work_queue
+ * table, so the cursor is kept when the backfill completes and the
+ * objects already scheduled are never scanned again.
+ *
+ * The pace is limited by the backfill_files_per_second and
+ * backfill_bytes_per_second keys of the [Deduplication] section.
+ */
+gpointer tagsistant_checksum_backfill_loop(gpointer data)
+{
+	(void) data;
+
+	tagsistant_background_thread_init();
+	tagsistant_work_queue_resume();
+
+	guint64 files_per_second = tagsistant_checksum_backfill_limit("backfill_files_per_second");
+	guint64 bytes_per_second = tagsistant_checksum_backfill_limit("backfill_bytes_per_second");
+
+	tagsistant_inode cursor = 0;
+	int total = 0;
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	tagsistant_query("select last_inode from checksum_backfill", dbi, tagsistant_return_integer, &cursor);
+	tagsistant_query("select count(1) from objects where checksum = '' and inode > %d", dbi, tagsistant_return_integer, &total, cursor);
+	tagsistant_db_connection_release(dbi, 0);
+
+	g_mutex_lock(&tagsistant_backfill_mutex);
+	tagsistant_backfill.running = 1;
+	tagsistant_backfill.total = total;
+	tagsistant_backfill.cursor = cursor;
+	g_mutex_unlock(&tagsistant_backfill_mutex);
+
+	dbg('2', LOG_INFO, "Checksum backfill: %d objects after inode %d", total, cursor);
+
+	gint64 start = g_get_monotonic_time();
+	guint64 files = 0, bytes = 0;
+
+	while (1) {
+		GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+
+		/*
+		 * find the next objects without a checksum. the inode is
+		 * cast to varchar(12) to simplify the callback function
+		 */
+		dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+		tagsistant_query(
+			"select cast(inode as varchar(12)), objectname from objects "
+				"where checksum = '' and inode > %d order by inode limit %d",
+			dbi, tagsistant_fix_checksums_callback, paths, cursor, TAGSISTANT_BACKFILL_BATCH);
+		tagsistant_db_connection_release(dbi, 0);
+
+		if (!paths->len) {
+			g_ptr_array_free(paths, TRUE);
+			break;
+		}
+
+		tagsistant_checksum_backfill_save_cursor(cursor);
+
+		/*
+		 * deduplicate the objects once the connection has been released,
+		 * since the workers need one and the queue can block when full
+		 */
+		guint i;
+		for (i = 0; i < paths->len; i++) {
+			gchar *path = g_ptr_array_index(paths, i);
+			struct stat st;
+			guint64 size = 0;
+
+			gchar *full_archive_path = tagsistant_object_archive_path(path, NULL);
+			if (full_archive_path && (lstat(full_archive_path, &st) == 0)) size = st.st_size;
+			g_free_null(full_archive_path);
+
+			/* sleep until the objects scheduled so far fit into the limits */
+			files++;
+			bytes += size;
+
+			gint64 due = 0;
+			if (files_per_second) due = MAX(due, (gint64) (files * G_USEC_PER_SEC / files_per_second));
+			if (bytes_per_second) due = MAX(due, (gint64) ((gdouble) bytes * G_USEC_PER_SEC / bytes_per_second));
+
+			gint64 elapsed = g_get_monotonic_time() - start;
+			if (due > elapsed) g_usleep(due - elapsed);
+
+			tagsistant_deduplicate(path);
+
+			cursor = tagsistant_inode_extract_from_path(path);
+
+			g_mutex_lock(&tagsistant_backfill_mutex);
+			tagsistant_backfill.queued++;
+			tagsistant_backfill.bytes += size;
+			tagsistant_backfill.cursor = cursor;
+			g_mutex_unlock(&tagsistant_backfill_mutex);
+		}
+
+		g_ptr_array_free(paths, TRUE);
+	}
+
+	tagsistant_checksum_backfill_save_cursor(cursor);
+
+	g_mutex_lock(&tagsistant_backfill_mutex);
+	tagsistant_backfill.running = 0;
+	g_mutex_unlock(&tagsistant_backfill_mutex);
+
+	dbg('2', LOG_INFO, "Checksum backfill: %" G_GUINT64_FORMAT " objects (%" G_GUINT64_FORMAT " bytes) scheduled", files, bytes);
+
+	return (NULL);
+}
+
+/**
+ * Callback for tagsistant_checksum_migrate()
+ *
+ * @param _settings an array of two strings, filled with the mode and the hash
+ * @param result dbi_result pointer
+ */
+static int tagsistant_checksum_settings_callback(void *_settings, dbi_result result)
+{
+	gchar **settings = (gchar **) _settings;
+
+	settings[0] = g_strdup(dbi_result_get_string_idx(result, 1));
+	settings[1] = g_strdup(dbi_result_get_string_idx(result, 2));
 
 	return (0);
 }
 
 /**
- * called once() after starting to fix object entries lacking the checksum
+ * Rewrite the checksums of the objects when [Deduplication] mode or
+ * hash differ from the ones they have been computed with, recorded in
+ * the checksum_settings table. Repositories older than the table hold
+ * SHA-1 hashes computed in full mode.
+ *
+ * A new hash invalidates all the checksums. A new mode swaps the
+ * strong hashes and the fingerprints: going to staged mode the strong
+ * hashes are kept in the strong_checksum column, going to full mode
+ * they are moved back into the checksum column. The objects left
+ * without a checksum are checksummed again by the backfill.
  */
-void tagsistant_fix_checksums()
+static void tagsistant_checksum_migrate()
 {
-	/* get a dedicated connection */
-	dbi_conn *dbi = tagsistant_db_connection(0);
+	const gchar *mode = (TAGSISTANT_DEDUPLICATION_STAGED == tagsistant_deduplication_mode) ? "staged" : "full";
+	const gchar *hash =
+		(G_CHECKSUM_SHA256 == tagsistant_deduplication_hash) ? "sha256" :
+		(G_CHECKSUM_MD5 == tagsistant_deduplication_hash) ? "md5" : "sha1";
+
+	gchar *settings[2] = { NULL, NULL };
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+
+	tagsistant_query("select mode, hash from checksum_settings", dbi, tagsistant_checksum_settings_callback, settings);
+	if (!settings[0]) settings[0] = g_strdup("full");
+	if (!settings[1]) settings[1] = g_strdup("sha1");
+
+	if (g_strcmp0(settings[1], hash) != 0) {
+		dbg('2', LOG_INFO, "Deduplication hash changed from %s to %s, checksumming the archive again", settings[1], hash);
+		tagsistant_query("update objects set checksum = '', strong_checksum = ''", dbi, NULL, NULL);
+		tagsistant_query("delete from checksum_backfill", dbi, NULL, NULL);
+	} else if (g_strcmp0(settings[0], mode) != 0) {
+		dbg('2', LOG_INFO, "Deduplication mode changed from %s to %s, checksumming the archive again", settings[0], mode);
+		if (TAGSISTANT_DEDUPLICATION_STAGED == tagsistant_deduplication_mode) {
+			/* MD5 and SHA-1 digests and truncated SHA-256 ones, never fingerprints */
+			tagsistant_query(
+				"update objects set strong_checksum = checksum "
+					"where strong_checksum = '' and length(checksum) in (32, 40)",
+				dbi, NULL, NULL);
+			tagsistant_query("update objects set checksum = ''", dbi, NULL, NULL);
+		} else {
+			tagsistant_query("update objects set checksum = strong_checksum", dbi, NULL, NULL);
+		}
+		tagsistant_query("delete from checksum_backfill", dbi, NULL, NULL);
+	}
 
-	/*
-	 * find all the objects without a checksum. the inode is cast to varchar(12)
-	 * to simplify the callback function
-	 */
-	tagsistant_query(
-		"select cast(inode as varchar(12)), objectname from objects where checksum = ''",
-		dbi, tagsistant_fix_checksums_callback, NULL);
+	tagsistant_query("delete from checksum_settings", dbi, NULL, NULL);
+	tagsistant_query("insert into checksum_settings (mode, hash) values ('%s', '%s')", dbi, NULL, NULL, mode, hash);
 
+	tagsistant_commit_transaction(dbi);
 	tagsistant_db_connection_release(dbi, 1);
+
+	g_free(settings[0]);
+	g_free(settings[1]);
 }
 
 /**
@@ -325,25 +3382,127 @@ void tagsistant_fix_checksums()
  */
 void tagsistant_deduplication_init()
 {
+	/* read the budgets before starting the workers */
+	tagsistant_background_init();
+
 #if ! TAGSISTANT_INLINE_DEDUPLICATION
 
 	/* setup the deduplication queue */
-	tagsistant_deduplication_queue = g_async_queue_new_full(g_free);
-	g_async_queue_ref(tagsistant_deduplication_queue);
+	tagsistant_deduplication_queue = g_queue_new();
+	tagsistant_deduplication_pending = g_hash_table_new(NULL, NULL);
+	tagsistant_deduplication_running = g_hash_table_new(NULL, NULL);
+
+	gchar *queue_size = tagsistant_get_ini_entry("Deduplication", "queue_size");
+	if (queue_size) {
+		if (atoi(queue_size) > 0) tagsistant_deduplication_queue_size = atoi(queue_size);
+		g_free(queue_size);
+	}
 
-	/* start the deduplication thread */
-	g_thread_new("Deduplication thread", tagsistant_deduplication_loop, NULL);
+	gchar *settle_delay = tagsistant_get_ini_entry("Deduplication", "settle_delay");
+	if (settle_delay) {
+		if (atoi(settle_delay) >= 0) tagsistant_deduplication_settle_delay = (gint64) atoi(settle_delay) * 1000;
+		g_free(settle_delay);
+	}
+
+#endif
+
+	/* select the deduplication mode and the strong hash */
+	gchar *mode = tagsistant_get_ini_entry("Deduplication", "mode");
+	if (mode) {
+		if (g_ascii_strcasecmp(mode, "full") == 0) tagsistant_deduplication_mode = TAGSISTANT_DEDUPLICATION_FULL;
+		else if (g_ascii_strcasecmp(mode, "staged") == 0) tagsistant_deduplication_mode = TAGSISTANT_DEDUPLICATION_STAGED;
+		else dbg('2', LOG_ERR, "Unknown deduplication mode %s", mode);
+		g_free(mode);
+	}
+
+	gchar *merge = tagsistant_get_ini_entry("Deduplication", "merge");
+	if (merge) {
+		if (g_ascii_strcasecmp(merge, "retag") == 0) tagsistant_deduplication_merge = TAGSISTANT_DEDUPLICATION_RETAG;
+		else if (g_ascii_strcasecmp(merge, "reflink") == 0) tagsistant_deduplication_merge = TAGSISTANT_DEDUPLICATION_REFLINK;
+		else dbg('2', LOG_ERR, "Unknown deduplication merge %s", merge);
+		g_free(merge);
+	}
+
+	gchar *hash = tagsistant_get_ini_entry("Deduplication", "hash");
+	if (hash) {
+		if (g_ascii_strcasecmp(hash, "sha1") == 0) tagsistant_deduplication_hash = G_CHECKSUM_SHA1;
+		else if (g_ascii_strcasecmp(hash, "sha256") == 0) tagsistant_deduplication_hash = G_CHECKSUM_SHA256;
+		else if (g_ascii_strcasecmp(hash, "md5") == 0) tagsistant_deduplication_hash = G_CHECKSUM_MD5;
+		else dbg('2', LOG_ERR, "Unknown deduplication hash %s", hash);
+		g_free(hash);
+	}
+
+	/* the checksums computed with other settings must be rewritten */
+	tagsistant_checksum_migrate();
+
+	/* load the chunked objects */
+	tagsistant_chunk_store_init();
+
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+	/* setup the checksum streams */
+	tagsistant_checksum_streams = g_hash_table_new_full(NULL, NULL, NULL, tagsistant_checksum_stream_destroy);
+	tagsistant_streamed_checksums = g_hash_table_new_full(NULL, NULL, NULL, g_free);
 #endif
 
+	/* setup the contents shared with the autotagger */
+	tagsistant_shared_contents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
 	/* setup the autotagging queue */
-	tagsistant_autotagging_queue = g_async_queue_new_full(g_free);
+	tagsistant_autotagging_queue = g_async_queue_new();
 	g_async_queue_ref(tagsistant_autotagging_queue);
+	tagsistant_autotagging_pending = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+
+#if TAGSISTANT_ENABLE_CHECKSUM_INDEX
+	/* load the checksums of the existing objects */
+	tagsistant_checksum_index_build();
+#endif
+
+	/*
+	 * the threads are started last, once the settings are read and
+	 * the tables and the checksum index they use are ready
+	 */
+
+#if ! TAGSISTANT_INLINE_DEDUPLICATION
+	/* start the deduplication workers, one per CPU by default */
+	int workers = g_get_num_processors();
+	gchar *workers_entry = tagsistant_get_ini_entry("Deduplication", "workers");
+	if (workers_entry) {
+		if (atoi(workers_entry) > 0) workers = atoi(workers_entry);
+		g_free(workers_entry);
+	}
+
+	int i;
+	for (i = 0; i < workers; i++) {
+		g_thread_new("Deduplication thread", tagsistant_deduplication_loop, NULL);
+	}
+
+	dbg('2', LOG_INFO, "Started %d deduplication workers", workers);
+#endif
+
+	/*
+	 * start the autotagging workers, one per CPU by default;
+	 * each one forks its own extractor helper process
+	 */
+	int autotagging_workers = g_get_num_processors();
+	gchar *autotagging_workers_entry = tagsistant_get_ini_entry("Autotagging", "workers");
+	if (autotagging_workers_entry) {
+		if (atoi(autotagging_workers_entry) > 0) autotagging_workers = atoi(autotagging_workers_entry);
+		g_free(autotagging_workers_entry);
+	}
+
+	int j;
+	for (j = 0; j < autotagging_workers; j++) {
+		g_thread_new("Autotagging thread", tagsistant_autotagging_loop, NULL);
+	}
+
+	dbg('p', LOG_INFO, "Started %d autotagging workers", autotagging_workers);
 
-	/* start the autotagging thread */
-	g_thread_new("Autotagging thread", tagsistant_autotagging_loop, NULL);
+	/* checksum the objects lacking it in background */
+	g_thread_new("Checksum backfill thread", tagsistant_checksum_backfill_loop, NULL);
 
-	/* fix missing checksums */
-	tagsistant_fix_checksums();
+	/* remove the unreferenced chunks in background */
+	if (g_file_test(tagsistant_chunk_store_path, G_FILE_TEST_IS_DIR))
+		g_thread_new("Chunk store sweep thread", tagsistant_chunk_store_sweep, NULL);
 }
 
 /**
@@ -355,9 +3514,8 @@ void tagsistant_deduplicate(gchar *path)
 {
 #if TAGSISTANT_INLINE_DEDUPLICATION
 	dbg('2', LOG_ERR, "Inline deduplication of %s", path);
-	tagsistant_deduplication_kernel(g_strdup(path));
+	tagsistant_deduplication_kernel(path);
 #else
-	dbg('2', LOG_ERR, "Scheduling deduplication of %s", path);
-	g_async_queue_push(tagsistant_deduplication_queue, g_strdup(path));
+	tagsistant_deduplication_enqueue(path, TRUE);
 #endif
 }
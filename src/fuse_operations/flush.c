@@ -52,13 +52,24 @@ int tagsistant_flush(const char *path, struct fuse_file_info *fi)
 
 		if (do_deduplicate) {
 			dbg('2', LOG_INFO, "Deduplicating %s", path);
-			deduplicate = g_strdup(path);
+
+			/* schedule the object by inode, so it's queued only once */
+			if (qtree->inode) {
+				deduplicate = g_strdup_printf("/store/ALL/@@/%d%s%s", qtree->inode, TAGSISTANT_INODE_DELIMITER, qtree->object_path);
+			} else {
+				deduplicate = g_strdup(path);
+			}
 		} else {
 			dbg('2', LOG_INFO, "Skipping deduplication for %s", path);
 		}
 	}
 
 	if (fi->fh) {
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+		// save the checksum computed while writing, if complete
+		tagsistant_checksum_stream_close(fi->fh, do_deduplicate);
+#endif
+
 		dbg('F', LOG_INFO, "Uncaching %" PRIu64 " = open(%s)", fi->fh, path);
 		close(fi->fh);
 		fi->fh = 0;
@@ -69,11 +80,13 @@ TAGSISTANT_EXIT_OPERATION:
 		TAGSISTANT_STOP_ERROR("FLUSH on %s (%s) (%s): %d %d: %s", path, qtree->full_archive_path, tagsistant_querytree_type(qtree), res, tagsistant_errno, strerror(tagsistant_errno));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_ROLLBACK_TRANSACTION);
 		if (do_deduplicate) tagsistant_deduplicate(deduplicate);
+		g_free_null(deduplicate);
 		return (-tagsistant_errno);
 	} else {
 		TAGSISTANT_STOP_OK("FLUSH on %s (%s): OK", path, tagsistant_querytree_type(qtree));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
 		if (do_deduplicate) tagsistant_deduplicate(deduplicate);
+		g_free_null(deduplicate);
 		return (0);
 	}
 }
@@ -176,7 +176,7 @@ int tagsistant_getattr(const char *path, struct stat *stbuf)
 
 	// -- stats --
 	else if (QTREE_IS_STATS(qtree)) {
-		if (g_regex_match_simple("^/stats/(connections|cached_queries|configuration|objects|relations|tags)$", path, 0, 0))
+		if (g_regex_match_simple("^/stats/(checksum_backfill|connections|cached_queries|configuration|objects|queues|reasoner_cache|relations|tags)$", path, 0, 0))
 			lstat_path = tagsistant.tags;
 		else if (g_regex_match_simple("^/stats$", path, 0, 0))
 			lstat_path = tagsistant.archive;
@@ -201,6 +201,9 @@ int tagsistant_getattr(const char *path, struct stat *stbuf)
 		} else if (qtree->points_to_object) {
 			if (tagsistant_is_tags_list_file(qtree)) {
 				stbuf->st_size = 1024 * 1024;
+			} else if (tagsistant_chunk_store_is_chunked(qtree->inode)) {
+				// the file of a chunked object is empty: report the blocks of its contents
+				stbuf->st_blocks = (stbuf->st_size + 511) / 512;
 			}
 		} else if (NULL == qtree->last_tag) {
 			// OK
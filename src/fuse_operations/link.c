@@ -73,10 +73,19 @@ int tagsistant_link(const char *from, const char *to)
 			dbg('F', LOG_ERR, "%s is not taggable!", to_qtree->full_path); // ??? why ??? should be taggable!!
 		}
 
+		// the linked file must hold the contents: a chunked object is reassembled first
+		tagsistant_inode from_inode = from_qtree->full_archive_path ? tagsistant_inode_extract_from_path(from_qtree->full_archive_path) : 0;
+		if (!tagsistant_chunk_store_pin(from_inode, from_qtree->full_archive_path, TRUE)) {
+			tagsistant_chunk_store_unpin(from_inode, -1);
+			TAGSISTANT_ABORT_OPERATION(EIO);
+		}
+
 		// do the real link on disk
 		dbg('F', LOG_INFO, "Hard-linking %s to %s", from_qtree->full_archive_path, to_qtree->object_path);
 		res = link(from_qtree->full_archive_path, to_qtree->full_archive_path);
 		tagsistant_errno = errno;
+
+		tagsistant_chunk_store_unpin(from_inode, -1);
 	}
 
 	// -- store (not complete) --
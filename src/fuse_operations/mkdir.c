@@ -31,6 +31,10 @@ int tagsistant_mkdir(const char *path, mode_t mode)
 	(void) mode;
     int res = 0, tagsistant_errno = 0;
 
+	/* the relation added, applied to the relations graph on commit */
+	tagsistant_tag_id edge_tag1 = 0, edge_tag2 = 0;
+	gchar *edge_relation = NULL;
+
 	TAGSISTANT_START("MKDIR on %s [mode: %d]", path, mode);
 
 	// build querytree
@@ -123,13 +127,24 @@ int tagsistant_mkdir(const char *path, mode_t mode)
 					"insert into relations (tag1_id, tag2_id, relation) values (%d, %d, '%s')",
 					qtree->dbi, NULL, NULL, tag1_id, tag2_id, qtree->relation);
 
+				/* check the insert, since a failed query isn't reported */
+				int inserted = 0;
+				tagsistant_query(
+					"select count(1) from relations where tag1_id = %d and tag2_id = %d and relation = '%s'",
+					qtree->dbi, tagsistant_return_integer, &inserted, tag1_id, tag2_id, qtree->relation);
+
+				if (!inserted) {
+					TAGSISTANT_ABORT_OPERATION(EIO);
+				}
+
+				edge_tag1 = tag1_id;
+				edge_tag2 = tag2_id;
+				edge_relation = g_strdup(qtree->relation);
+
 #if TAGSISTANT_ENABLE_QUERYTREE_CACHE
 				// invalidate the cache entries which involves one of the tags related
 				tagsistant_invalidate_querytree_cache(qtree);
 #endif
-
-				tagsistant_invalidate_reasoning_cache(qtree->first_tag ? qtree->first_tag : qtree->namespace);
-				tagsistant_invalidate_reasoning_cache(qtree->second_tag ? qtree->second_tag : qtree->related_namespace);
 			}
 		} else {
 			TAGSISTANT_ABORT_OPERATION(EROFS);
@@ -144,10 +159,18 @@ TAGSISTANT_EXIT_OPERATION:
 	if ( res == -1 ) {
 		TAGSISTANT_STOP_ERROR("MKDIR on %s (%s): %d %d: %s", path, tagsistant_querytree_type(qtree), res, tagsistant_errno, strerror(tagsistant_errno));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_ROLLBACK_TRANSACTION);
+		g_free_null(edge_relation);
 		return (-tagsistant_errno);
 	} else {
 		TAGSISTANT_STOP_OK("MKDIR on %s (%s): OK", path, tagsistant_querytree_type(qtree));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
+
+		/* the graph follows the relations table only once committed */
+		if (edge_relation) {
+			tagsistant_relations_graph_add_edge(edge_tag1, edge_relation, edge_tag2);
+			g_free_null(edge_relation);
+		}
+
 		return (0);
 	}
 }
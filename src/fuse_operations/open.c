@@ -59,6 +59,12 @@ int tagsistant_open(const char *path, struct fuse_file_info *fi)
 			TAGSISTANT_ABORT_OPERATION(EFAULT);
 		}
 
+		// a chunked object is reassembled before being written
+		if (!tagsistant_chunk_store_pin(qtree->inode, qtree->full_archive_path, (fi->flags & O_WRONLY) || (fi->flags & O_RDWR))) {
+			tagsistant_chunk_store_unpin(qtree->inode, -1);
+			TAGSISTANT_ABORT_OPERATION(EIO);
+		}
+
 		res = open(qtree->full_archive_path, fi->flags /*|O_RDONLY */);
 		tagsistant_errno = errno;
 
@@ -68,8 +74,11 @@ int tagsistant_open(const char *path, struct fuse_file_info *fi)
 			dbg('F', LOG_INFO, "Caching %" PRIu64 " = open(%s)", fi->fh, path);
 //			fprintf(stderr, "Opened FD %lu\n", fi->fh);
 
+			// the reads of a chunked object are served from its chunks
+			tagsistant_chunk_store_unpin(qtree->inode, res);
 #else
 			close(res);
+			tagsistant_chunk_store_unpin(qtree->inode, -1);
 #endif
 
 			tagsistant_querytree_check_tagging_consistency(qtree);
@@ -79,11 +88,17 @@ int tagsistant_open(const char *path, struct fuse_file_info *fi)
 					// invalidate the checksum
 					dbg('2', LOG_INFO, "Invalidating checksum on %s", path);
 					tagsistant_invalidate_object_checksum(qtree->inode, qtree->dbi);
+
+#if TAGSISTANT_ENABLE_FILE_HANDLE_CACHING && TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+					// checksum the file while it's written
+					tagsistant_checksum_stream_open(res, qtree->inode);
+#endif
 				} else {
 					fi->keep_cache = 1;
 				}
 			}
 		} else {
+			tagsistant_chunk_store_unpin(qtree->inode, -1);
 			tagsistant_set_file_handle(fi, 0);
 		}
 	}
@@ -94,27 +94,35 @@ int tagsistant_read(const char *path, char *buf, size_t size, off_t offset, stru
 #if TAGSISTANT_ENABLE_FILE_HANDLE_CACHING
 		if (fi->fh) {
 			tagsistant_get_file_handle(fi, fh);
-			res = pread(fh, buf, size, offset);
+			res = tagsistant_chunk_store_pread(fh, buf, size, offset);
 			tagsistant_errno = errno;
 //			fprintf(stderr, "Trying a read on FD %lu\n", fi->fh);
 		}
 
 		if ((-1 == res) || (0 == fh)) {
-			if (fh) close(fh);
+			if (fh) {
+				tagsistant_chunk_store_close(fh);
+				close(fh);
+			}
+			tagsistant_chunk_store_pin(qtree->inode, qtree->full_archive_path, FALSE);
 			fh = open(qtree->full_archive_path, fi->flags|O_RDONLY);
+			tagsistant_chunk_store_unpin(qtree->inode, fh);
 //			fprintf(stderr, "Re-trying a read on FD %lu\n", fi->fh);
 
-			if (fh)	res = pread(fh, buf, size, offset);
+			if (fh)	res = tagsistant_chunk_store_pread(fh, buf, size, offset);
 			else res = -1;
 			tagsistant_errno = errno;
 		}
 
 		tagsistant_set_file_handle(fi, fh);
 #else
+		tagsistant_chunk_store_pin(qtree->inode, qtree->full_archive_path, FALSE);
 		fh = open(qtree->full_archive_path, fi->flags|O_RDONLY);
+		tagsistant_chunk_store_unpin(qtree->inode, fh);
 		if (fh) {
-			res = pread(fh, buf, size, offset);
+			res = tagsistant_chunk_store_pread(fh, buf, size, offset);
 			tagsistant_errno = errno;
+			tagsistant_chunk_store_close(fh);
 			close(fh);
 		} else {
 			TAGSISTANT_ABORT_OPERATION(errno);
@@ -155,6 +163,16 @@ int tagsistant_read(const char *path, char *buf, size_t size, off_t offset, stru
 		}
 #endif /* TAGSISTANT_ENABLE_QUERYTREE_CACHE */
 
+		// -- checksum_backfill --
+		else if (g_regex_match_simple("/checksum_backfill$", path, 0, 0)) {
+			int running = 0, total = 0, queued = 0;
+			guint64 bytes = 0;
+			tagsistant_inode cursor = 0;
+			tagsistant_checksum_backfill_stats(&running, &total, &queued, &bytes, &cursor);
+			sprintf(stats_buffer, "status: %s\n# of objects: %d\n# of scheduled objects: %d\n# of scheduled bytes: %" G_GUINT64_FORMAT "\nlast inode: %d\n",
+				running ? "running" : "done", total, queued, bytes, cursor);
+		}
+
 		// -- configuration --
 		else if (g_regex_match_simple("/configuration$", path, 0, 0)) {
 			tagsistant_read_stats_configuration(stats_buffer);
@@ -167,6 +185,29 @@ int tagsistant_read(const char *path, char *buf, size_t size, off_t offset, stru
 			sprintf(stats_buffer, "# of objects: %d\n", entries);
 		}
 
+		// -- queues --
+		else if (g_regex_match_simple("/queues$", path, 0, 0)) {
+			int dq = 0, dc = 0, dd = 0, aq = 0, ac = 0, ad = 0, active = 0, congested = 0;
+			gint64 p95 = 0;
+			tagsistant_work_queues_stats(&dq, &dc, &dd, &aq, &ac, &ad);
+			tagsistant_background_stats(&active, &p95, &congested);
+			sprintf(stats_buffer,
+				"deduplication:\n  # of queued objects: %d\n  # of coalesced jobs: %d\n  # of dropped jobs: %d\n"
+				"autotagging:\n  # of queued objects: %d\n  # of coalesced jobs: %d\n  # of dropped jobs: %d\n"
+				"background:\n  # of active workers: %d\n  foreground p95 latency: %" G_GINT64_FORMAT "us\n  backing off: %s\n",
+				dq, dc, dd, aq, ac, ad, active, p95, congested ? "yes" : "no");
+		}
+
+#if TAGSISTANT_ENABLE_REASONER_CACHE
+		// -- reasoner_cache --
+		else if (g_regex_match_simple("/reasoner_cache$", path, 0, 0)) {
+			int hits = 0, misses = 0, entries = 0;
+			tagsistant_reasoner_cache_stats(&hits, &misses, &entries);
+			sprintf(stats_buffer, "# of cached reasonings: %d\n# of hits: %d\n# of misses: %d\nhit rate: %.1f%%\n",
+				entries, hits, misses, (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+		}
+#endif /* TAGSISTANT_ENABLE_REASONER_CACHE */
+
 		// -- tags --
 		else if (g_regex_match_simple("/tags$", path, 0, 0)) {
 			int entries = 2;
@@ -255,7 +296,11 @@ void tagsistant_read_stats_configuration(gchar stats_buffer[TAGSISTANT_STATS_BUF
 		"       TAGSISTANT_ENABLE_TAG_ID_CACHE: %d\n"
 		"      TAGSISTANT_ENABLE_AND_SET_CACHE: %d\n"
 		"     TAGSISTANT_ENABLE_REASONER_CACHE: %d\n"
+		"      TAGSISTANT_ENABLE_TRIGRAM_INDEX: %d\n"
 		"        TAGSISTANT_ENABLE_AUTOTAGGING: %d\n"
+		"  TAGSISTANT_ENABLE_NATIVE_EXTRACTORS: %d\n"
+		" TAGSISTANT_ENABLE_STREAMING_CHECKSUM: %d\n"
+		"     TAGSISTANT_ENABLE_CHECKSUM_INDEX: %d\n"
 		"           TAGSISTANT_VERBOSE_LOGGING: %d\n"
 		"           TAGSISTANT_QUERY_DELIMITER: %c (to avoid reasoning use: %s)\n"
 		"          TAGSISTANT_ANDSET_DELIMITER: %c\n"
@@ -288,7 +333,11 @@ void tagsistant_read_stats_configuration(gchar stats_buffer[TAGSISTANT_STATS_BUF
 		TAGSISTANT_ENABLE_TAG_ID_CACHE,
 		TAGSISTANT_ENABLE_AND_SET_CACHE,
 		TAGSISTANT_ENABLE_REASONER_CACHE,
+		TAGSISTANT_ENABLE_TRIGRAM_INDEX,
 		TAGSISTANT_ENABLE_AUTOTAGGING,
+		TAGSISTANT_ENABLE_NATIVE_EXTRACTORS,
+		TAGSISTANT_ENABLE_STREAMING_CHECKSUM,
+		TAGSISTANT_ENABLE_CHECKSUM_INDEX,
 		TAGSISTANT_VERBOSE_LOGGING,
 		TAGSISTANT_QUERY_DELIMITER_CHAR, TAGSISTANT_QUERY_DELIMITER_NO_REASONING,
 		TAGSISTANT_ANDSET_DELIMITER_CHAR,
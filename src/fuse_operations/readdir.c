@@ -498,9 +498,14 @@ int tagsistant_readdir_on_stats(
 #if TAGSISTANT_ENABLE_QUERYTREE_CACHE
 	filler(buf, "cached_queries", NULL, 0);
 #endif /* TAGSISTANT_ENABLE_QUERYTREE_CACHE */
+	filler(buf, "checksum_backfill", NULL, 0);
 	filler(buf, "configuration", NULL, 0);
 	filler(buf, "connections", NULL, 0);
 	filler(buf, "objects", NULL, 0);
+	filler(buf, "queues", NULL, 0);
+#if TAGSISTANT_ENABLE_REASONER_CACHE
+	filler(buf, "reasoner_cache", NULL, 0);
+#endif /* TAGSISTANT_ENABLE_REASONER_CACHE */
 	filler(buf, "relations", NULL, 0);
 	filler(buf, "tags", NULL, 0);
 
@@ -44,7 +44,13 @@ int tagsistant_release(const char *path, struct fuse_file_info *fi)
 
 	// -- object --
 	if (QTREE_IS_TAGGABLE(qtree) && fi->fh) {
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+		// drop the stream, the descriptor number will be reused
+		tagsistant_checksum_stream_close(fi->fh, 0);
+#endif
+
 		dbg('F', LOG_INFO, "Uncaching %" PRIu64 " = open(%s)", fi->fh, path);
+		tagsistant_chunk_store_close(fi->fh);
 		close(fi->fh);
 		fi->fh = 0;
 	}
@@ -28,7 +28,7 @@
  */
 int tagsistant_rename(const char *from, const char *to)
 {
-    int res = 0, tagsistant_errno = 0;
+    int res = 0, tagsistant_errno = 0, invalidate_reasoning = 0;
 
 	TAGSISTANT_START("RENAME %s as %s", from, to);
 
@@ -120,6 +120,9 @@ int tagsistant_rename(const char *from, const char *to)
 		} else {
 			tagsistant_remove_tag_from_cache(from_qtree->last_tag, NULL, NULL);
 		}
+
+		// the reasoner cache holds tag names
+		invalidate_reasoning = 1;
 	} else
 
 	// -- tags --
@@ -137,6 +140,9 @@ int tagsistant_rename(const char *from, const char *to)
 		} else {
 			tagsistant_remove_tag_from_cache(from_qtree->last_tag, NULL, NULL);
 		}
+
+		// the reasoner cache holds tag names
+		invalidate_reasoning = 1;
 	} else
 
 	// -- alias --
@@ -162,6 +168,10 @@ TAGSISTANT_EXIT_OPERATION:
 		TAGSISTANT_STOP_OK("RENAME %s (%s) to %s (%s): OK", from, tagsistant_querytree_type(from_qtree), to, tagsistant_querytree_type(to_qtree));
 		tagsistant_querytree_destroy(from_qtree, TAGSISTANT_COMMIT_TRANSACTION);
 		tagsistant_querytree_destroy(to_qtree, TAGSISTANT_COMMIT_TRANSACTION);
+
+		// invalidated once committed, so a concurrent reasoning can't cache the old names again
+		if (invalidate_reasoning) tagsistant_invalidate_reasoning_cache();
+
 		return (0);
 	}
 }
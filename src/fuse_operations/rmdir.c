@@ -19,16 +19,28 @@
 
 #include "../tagsistant.h"
 
-void tagsistant_sql_delete_tag_proxy(
-	dbi_conn dbi,
-	const gchar *namespace,
-	const gchar *key,
-	const gchar *value,
-	tagsistant_inode unused)
+/**
+ * delete all the tags of a querytree, recording their ids
+ *
+ * @param qtree the querytree
+ * @param deleted_tags the GArray of tagsistant_tag_id to be filled
+ */
+static void tagsistant_rmdir_delete_tags(tagsistant_querytree *qtree, GArray *deleted_tags)
 {
-	(void) unused;
+	qtree_or_node *ptx = qtree->tree;
+	while (ptx) {
+		qtree_and_node *andptx = ptx->and_set;
+		while (andptx) {
+			tagsistant_tag_id tag_id = andptx->tag
+				? tagsistant_sql_delete_tag(qtree->dbi, andptx->tag, NULL, NULL)
+				: tagsistant_sql_delete_tag(qtree->dbi, andptx->namespace, andptx->key, andptx->value);
 
-	tagsistant_sql_delete_tag(dbi, namespace, key, value);
+			if (tag_id) g_array_append_val(deleted_tags, tag_id);
+
+			andptx = andptx->next;
+		}
+		ptx = ptx->next;
+	}
 }
 
 /**
@@ -42,6 +54,14 @@ int tagsistant_rmdir(const char *path)
     int res = 0, tagsistant_errno = 0, do_rmdir = 1;
 	gchar *rmdir_path = NULL;
 
+	/* the relation deleted, removed from the relations graph on commit */
+	tagsistant_tag_id edge_tag1 = 0, edge_tag2 = 0;
+	gchar *edge_relation = NULL;
+
+	/* the tags deleted, removed from the relations graph on commit */
+	GArray *deleted_tags = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+	tagsistant_tag_id tag_id = 0;
+
 	TAGSISTANT_START("RMDIR on %s", path);
 
 	tagsistant_querytree *qtree = tagsistant_querytree_new(path, 0, 1, 1, 0);
@@ -62,7 +82,7 @@ int tagsistant_rmdir(const char *path)
 
 		if (!QTREE_IS_COMPLETE(qtree)) {
 			// -- tags but incomplete (means: delete a tag) --
-			tagsistant_querytree_traverse(qtree, tagsistant_sql_delete_tag_proxy, 0);
+			tagsistant_rmdir_delete_tags(qtree, deleted_tags);
 			do_rmdir = 0;
 		} else if (QTREE_IS_TAGGABLE(qtree)) {
 			/*
@@ -114,13 +134,24 @@ int tagsistant_rmdir(const char *path)
 					"delete from relations where tag1_id = '%d' and tag2_id = '%d' and relation = '%s'",
 					qtree->dbi, NULL, NULL, tag1_id, tag2_id, qtree->relation);
 
+				/* check the delete, since a failed query isn't reported */
+				int left = 0;
+				tagsistant_query(
+					"select count(1) from relations where tag1_id = %d and tag2_id = %d and relation = '%s'",
+					qtree->dbi, tagsistant_return_integer, &left, tag1_id, tag2_id, qtree->relation);
+
+				if (left) {
+					TAGSISTANT_ABORT_OPERATION(EIO);
+				}
+
+				edge_tag1 = tag1_id;
+				edge_tag2 = tag2_id;
+				edge_relation = g_strdup(qtree->relation);
+
 #if TAGSISTANT_ENABLE_QUERYTREE_CACHE
 				// invalidate the cache entries which involves one of the tags related
 				tagsistant_invalidate_querytree_cache(qtree);
 #endif
-
-				tagsistant_invalidate_reasoning_cache(qtree->first_tag);
-				tagsistant_invalidate_reasoning_cache(qtree->second_tag);
 			} else {
 				TAGSISTANT_ABORT_OPERATION(EFAULT);
 			}
@@ -136,13 +167,13 @@ int tagsistant_rmdir(const char *path)
 		}
 
 		if (qtree->first_tag) {
-			tagsistant_sql_delete_tag(qtree->dbi, qtree->first_tag, NULL, NULL);
-			tagsistant_invalidate_reasoning_cache(qtree->first_tag);
+			tag_id = tagsistant_sql_delete_tag(qtree->dbi, qtree->first_tag, NULL, NULL);
 		} else if (qtree->namespace) {
-			tagsistant_sql_delete_tag(qtree->dbi, qtree->namespace, qtree->key, qtree->value);
-			tagsistant_invalidate_reasoning_cache(qtree->namespace);
+			tag_id = tagsistant_sql_delete_tag(qtree->dbi, qtree->namespace, qtree->key, qtree->value);
 		}
 
+		if (tag_id) g_array_append_val(deleted_tags, tag_id);
+
 #if TAGSISTANT_ENABLE_QUERYTREE_CACHE
 		// invalidate the cache entries which involves one of the tags related
 		tagsistant_invalidate_querytree_cache(qtree);
@@ -160,10 +191,24 @@ TAGSISTANT_EXIT_OPERATION:
 	if ( res == -1 ) {
 		TAGSISTANT_STOP_ERROR("RMDIR on %s (%s): %d %d: %s", path, tagsistant_querytree_type(qtree), res, tagsistant_errno, strerror(tagsistant_errno));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_ROLLBACK_TRANSACTION);
+		g_free_null(edge_relation);
+		g_array_free(deleted_tags, TRUE);
 		return (-tagsistant_errno);
 	} else {
 		TAGSISTANT_STOP_OK("RMDIR on %s (%s): OK", path, tagsistant_querytree_type(qtree));
 		tagsistant_querytree_destroy(qtree, TAGSISTANT_COMMIT_TRANSACTION);
+
+		/* the graph follows the relations table only once committed */
+		if (edge_relation) {
+			tagsistant_relations_graph_remove_edge(edge_tag1, edge_relation, edge_tag2);
+			g_free_null(edge_relation);
+		}
+
+		guint i;
+		for (i = 0; i < deleted_tags->len; i++)
+			tagsistant_relations_graph_remove_tag(g_array_index(deleted_tags, tagsistant_tag_id, i));
+		g_array_free(deleted_tags, TRUE);
+
 		return (0);
 	}
 }
@@ -39,8 +39,23 @@ int tagsistant_truncate(const char *path, off_t size)
 
 	// -- object on disk --
 	if (QTREE_POINTS_TO_OBJECT(qtree)) {
-		res = truncate(qtree->full_archive_path, size);
-		tagsistant_errno = errno;
+		// a chunked object is reassembled before being truncated
+		if (tagsistant_chunk_store_pin(qtree->inode, qtree->full_archive_path, TRUE)) {
+			res = truncate(qtree->full_archive_path, size);
+			tagsistant_errno = errno;
+		} else {
+			res = -1;
+			tagsistant_errno = EIO;
+		}
+		tagsistant_chunk_store_unpin(qtree->inode, -1);
+
+		// the saved strong hash no longer matches the file
+		if (QTREE_IS_TAGGABLE(qtree)) tagsistant_invalidate_object_checksum(qtree->inode, qtree->dbi);
+
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+		// the checksum computed while writing no longer matches the file
+		tagsistant_checksum_stream_invalidate(qtree->inode);
+#endif
 	} else
 
 	// -- alias --
@@ -91,13 +91,29 @@ int tagsistant_write(const char *path, const char *buf, size_t size, off_t offse
 		}
 
 		if ((-1 == res) || (0 == fh)) {
-			if (fh) close(fh);
-			fh = open(qtree->full_archive_path, fi->flags|O_WRONLY);
+			if (fh) {
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+				tagsistant_checksum_stream_close(fh, 0);
+#endif
+				tagsistant_chunk_store_close(fh);
+				close(fh);
+			}
+			// a chunked object is reassembled before being written
+			if (tagsistant_chunk_store_pin(qtree->inode, qtree->full_archive_path, TRUE))
+				fh = open(qtree->full_archive_path, fi->flags|O_WRONLY);
+			else
+				fh = 0;
+			tagsistant_chunk_store_unpin(qtree->inode, fh ? fh : -1);
+
 			if (fh)	res = pwrite(fh, buf, size, offset);
 			else res = -1;
-			tagsistant_errno = errno;
+			tagsistant_errno = fh ? errno : EIO;
 		}
 
+#if TAGSISTANT_ENABLE_STREAMING_CHECKSUM
+		if (res > 0) tagsistant_checksum_stream_update(fh, qtree->inode, buf, res, offset);
+#endif
+
 		tagsistant_set_file_handle(fi, fh);
 #else
 		fh = open(qtree->full_archive_path, fi->flags|O_WRONLY);
@@ -113,6 +113,9 @@ void tagsistant_path_resolution_init()
 	/* compile regular expressions */
 	tagsistant_inode_extract_from_path_regex_1 = g_regex_new("^([0-9]+)" TAGSISTANT_INODE_DELIMITER, 0, 0, NULL);
 	tagsistant_inode_extract_from_path_regex_2 = g_regex_new("/([0-9]+)" TAGSISTANT_INODE_DELIMITER, 0, 0, NULL);
+
+	/* start the pool evaluating the or-branches of store/ queries */
+	tagsistant_RDS_init();
 }
 
 /**
@@ -357,41 +360,26 @@ tagsistant_inode tagsistant_guess_inode_from_and_set(qtree_and_node *and_set, db
 	inode = guessed_inode;
 
 	/*
-	 * the second step involves negated tags
+	 * the second step involves negated tags: all of them, including
+	 * the related ones, are checked at once by a single query
 	 */
-	and_set_ptr = and_set->negated;
-	while (and_set_ptr) {
-		tagsistant_inode single_and_inode = tagsistant_check_single_tagging(and_set_ptr, dbi, objectname);
-
-		/*
-		 * if no match has been found, try with related tags
-		 */
-		if (!single_and_inode) {
-			qtree_and_node *related = and_set_ptr->related;
+	if (inode) {
+		gchar *negated_ids = tagsistant_RDS_compile_negations(and_set, dbi);
+		if (negated_ids) {
+			tagsistant_inode negated_inode = 0;
 
-			while (related) {
-				single_and_inode = tagsistant_check_single_tagging(related, dbi, objectname);
+			tagsistant_query(
+				"select inode from tagging where inode = %d and tag_id in (%s) limit 1",
+				dbi, tagsistant_return_integer, &negated_inode, inode, negated_ids);
 
-				/* if a related tag match, break the while loop */
-				if (single_and_inode) break;
-
-				related = related->related;
-			}
-		}
+			g_free_null(negated_ids);
 
-		/*
-		 * if we have a match, the file must be discarder (returning 0)
-		 * because this is the ->negated branch of the tree
-		 */
-		if (single_and_inode) {
-			inode = 0;
-			goto BREAK_LOOKUP;
+			/*
+			 * if we have a match, the file must be discarded (returning 0)
+			 * because this is the ->negated branch of the tree
+			 */
+			if (negated_inode) inode = 0;
 		}
-
-		/*
-		 * otherwise we continue with the next tag
-		 */
-		and_set_ptr = and_set_ptr->next;
 	}
 
 BREAK_LOOKUP:
@@ -723,22 +711,6 @@ int tagsistant_querytree_parse_store (
 			if (TAGSISTANT_TAG_GROUP_ADD_NEW_NODE == tag_group) {
 				tag_group = TAGSISTANT_TAG_GROUP_ADD_TO_NODE;
 			}
-
-			/* search related tags */
-			if (qtree->do_reasoning && (and->tag || (and->namespace && and->key && and->value))) {
-				dbg('q', LOG_INFO, "Searching for other tags related to %s", and->tag);
-
-				tagsistant_reasoning *reasoning = g_malloc(sizeof(tagsistant_reasoning));
-				if (reasoning != NULL) {
-					reasoning->start_node = and;
-					reasoning->current_node = and;
-					reasoning->added_tags = 0;
-					reasoning->conn = qtree->dbi;
-					int newtags = tagsistant_reasoner(reasoning);
-					dbg('q', LOG_INFO, "Reasoning added %d tags", newtags);
-					g_free_null(reasoning);
-				}
-			}
 		}
 
 		// save last tag found
@@ -748,6 +720,12 @@ int tagsistant_querytree_parse_store (
 		__SLIDE_TOKEN;
 	}
 
+	// search related tags for all the nodes of the query at once
+	if (qtree->do_reasoning) {
+		int newtags = tagsistant_reasoner(qtree->tree, qtree->dbi);
+		dbg('q', LOG_INFO, "Reasoning added %d tags", newtags);
+	}
+
 	// if last token is TAGSISTANT_QUERY_DELIMITER_CHAR,
 	// move the pointer one element forward
 	if (__TOKEN && (TAGSISTANT_QUERY_DELIMITER_CHAR == *__TOKEN))
@@ -1621,10 +1599,14 @@ RETURN:
  * @param andnode a qtree_and_node to be freed
  */
 #define qtree_and_node_destroy(andnode) {\
-	g_free_null(andnode->tag);\
-	g_free_null(andnode->namespace);\
-	g_free_null(andnode->key);\
-	g_free_null(andnode->value);\
+	if (andnode->interned) {\
+		tagsistant_reasoner_node_release(andnode);\
+	} else {\
+		g_free_null(andnode->tag);\
+		g_free_null(andnode->namespace);\
+		g_free_null(andnode->key);\
+		g_free_null(andnode->value);\
+	}\
 	g_free_null(andnode);\
 }
 
@@ -1675,6 +1657,13 @@ void tagsistant_querytree_destroy(tagsistant_querytree *qtree, guint commit_tran
 					qtree_and_node_destroy(related);
 				}
 
+				// walk negated tags
+				while (tag->negated) {
+					qtree_and_node *negated = tag->negated;
+					tag->negated = tag->negated->negated;
+					qtree_and_node_destroy(negated);
+				}
+
 				// free the ptree_and_node_t node
 				qtree_and_node *next = tag->next;
 				qtree_and_node_destroy(tag);
@@ -63,6 +63,9 @@ typedef struct ptree_and_node {
 	/** the value **/
 	char *value;
 
+	/** the strings are references to the reasoner string pool, released with tagsistant_reasoner_node_release() **/
+	int interned;
+
 	/** list of all related tags **/
 	struct ptree_and_node *related;
 
@@ -394,13 +397,19 @@ extern tagsistant_inode			tagsistant_inode_extract_from_path(const gchar *path);
 extern tagsistant_inode			tagsistant_inode_extract_from_querytree(tagsistant_querytree *qtree);
 
 // reasoner functions
-#define 						tagsistant_reasoner(reasoning) tagsistant_reasoner_inner(reasoning, 1)
-extern int						tagsistant_reasoner_inner(tagsistant_reasoning *reasoning, int do_caching);
-extern void						tagsistant_invalidate_reasoning_cache(gchar *tag);
+extern int						tagsistant_reasoner(qtree_or_node *tree, dbi_conn conn);
+extern void						tagsistant_invalidate_reasoning_cache();
+extern void						tagsistant_reasoner_cache_stats(int *hits, int *misses, int *entries);
+extern void						tagsistant_reasoner_node_release(qtree_and_node *node);
+extern void						tagsistant_relations_graph_add_edge(tagsistant_tag_id tag1_id, const gchar *relation, tagsistant_tag_id tag2_id);
+extern void						tagsistant_relations_graph_remove_edge(tagsistant_tag_id tag1_id, const gchar *relation, tagsistant_tag_id tag2_id);
+extern void						tagsistant_relations_graph_remove_tag(tagsistant_tag_id tag_id);
 
 // RDS functions
+extern void						tagsistant_RDS_init();
 extern GHashTable *				tagsistant_RDS_new(qtree_or_node *query, dbi_conn conn, int is_all_path);
 extern void 					tagsistant_RDS_destroy_value_list(gchar *key, GList *list, gpointer data);
+extern gchar *					tagsistant_RDS_compile_negations(qtree_and_node *and_set, dbi_conn conn);
 
 /**
  * ERROR MESSAGES
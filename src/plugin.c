@@ -20,362 +20,1605 @@
 */
 
 #include "tagsistant.h"
+#include <poll.h>
+#include <sys/wait.h>
 
 /******************\
  * PLUGIN SUPPORT *
 \******************/
 
+static GRegex *tagsistant_rx_date;
+
+/** maps each byte of a keyword or of its value to its replacement in a tag */
+static gchar tagsistant_tag_cleaner[256];
+
+#ifndef errno
+#define errno
+#endif
+
+/**
+ * Load the contents of the file for the plugins needing them. The
+ * contents already in memory are used as they are, otherwise the file
+ * is read once by the shared object reader and kept for the whole chain.
+ * Files larger than 16 MiB are not loaded.
+ *
+ * @param job the file being processed
+ */
+static void tagsistant_plugin_job_load_content(tagsistant_plugin_job *job)
+{
+	if (job->content_loaded) return;
+	job->content_loaded = TRUE;
+
+	if (job->data) return;
+
+	job->buffer = tagsistant_read_object(job->full_archive_path);
+	if (job->buffer) {
+		job->data = job->buffer->data;
+		job->size = job->buffer->len;
+	}
+}
+
+/**
+ * release the contents read for the plugins and the keywords
+ * copied for the version 0 plugins, if any
+ *
+ * @param job the file being processed
+ */
+static void tagsistant_plugin_job_release(tagsistant_plugin_job *job)
+{
+	if (job->buffer) g_byte_array_free(job->buffer, TRUE);
+	job->buffer = NULL;
+	job->data = NULL;
+	job->size = 0;
+
+	g_free_null(job->legacy_keywords);
+}
+
+/**
+ * feed a TP_CAP_STREAM plugin with the contents of the file, from
+ * memory if already loaded or reading the file chunk by chunk
+ *
+ * @param plugin the plugin
+ * @param job the file being processed
+ */
+static void tagsistant_plugin_job_stream(tagsistant_plugin_t *plugin, tagsistant_plugin_job *job)
+{
+	if (job->data) {
+		gsize offset = 0;
+		while (offset < job->size) {
+			gsize length = MIN(TAGSISTANT_PLUGIN_CHUNK_SIZE, job->size - offset);
+			if (!(plugin->chunk)(job, job->data + offset, length)) break;
+			offset += length;
+		}
+		return;
+	}
+
+	int fd = open(job->full_archive_path, O_RDONLY|O_NOATIME);
+	if (-1 == fd) {
+		dbg('p', LOG_ERR, "Unable to open %s for the plugins", job->full_archive_path);
+		return;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	guchar *chunk = g_malloc(TAGSISTANT_PLUGIN_CHUNK_SIZE);
+	ssize_t length = 0;
+	while ((length = read(fd, chunk, TAGSISTANT_PLUGIN_CHUNK_SIZE)) > 0) {
+		tagsistant_background_throttle(length);
+		if (!(plugin->chunk)(job, chunk, length)) break;
+	}
+
+	if (length < 0) dbg('p', LOG_ERR, "Error reading %s for the plugins", job->full_archive_path);
+
+	g_free(chunk);
+	close(fd);
+}
+
+/**
+ * Tag the object on behalf of a version 2 plugin
+ *
+ * @param emitter the emitter of the job
+ * @param tagname the tag name or the namespace of a triple tag
+ * @param key the key of a triple tag, or NULL
+ * @param value the value of a triple tag, or NULL
+ */
+void tagsistant_emit_tag(tagsistant_tag_emitter *emitter, const gchar *tagname, const gchar *key, const gchar *value)
+{
+	if (!emitter || !tagname) return;
+
+	tagsistant_plugin_tag(emitter->qtree, tagname, key, value);
+	emitter->count++;
+}
+
+/**
+ * the keywords passed to the version 0 plugin run by the calling thread,
+ * both as the legacy array and as the original list
+ */
+typedef struct {
+	tagsistant_legacy_keyword *array;
+	tagsistant_keywords *keywords;
+} tagsistant_legacy_call;
+
+static GPrivate tagsistant_legacy_call_key = G_PRIVATE_INIT(NULL);
+
+/**
+ * Version 0 plugins pass their keyword array to tagsistant_plugin_iterator()
+ * and tagsistant_plugin_get_keyword_value(). Return the keyword list the
+ * array has been copied from, or the argument itself if it's a list.
+ *
+ * @param keywords the keyword list or the array of a version 0 plugin
+ * @return the keyword list
+ */
+static tagsistant_keywords *tagsistant_keywords_resolve(gpointer keywords)
+{
+	tagsistant_legacy_call *call = g_private_get(&tagsistant_legacy_call_key);
+	if (call && (keywords == (gpointer) call->array)) return (call->keywords);
+	return ((tagsistant_keywords *) keywords);
+}
+
+/**
+ * copy the keywords of a job into the fixed array of the version 0
+ * plugins, once for the whole chain. Longer strings are truncated.
+ *
+ * @param job the file being processed
+ * @return the array, ended by an empty keyword if not full
+ */
+static tagsistant_legacy_keyword *tagsistant_plugin_job_legacy_keywords(tagsistant_plugin_job *job)
+{
+	if (job->legacy_keywords) return (job->legacy_keywords);
+
+	job->legacy_keywords = g_new0(tagsistant_legacy_keyword, TAGSISTANT_MAX_KEYWORDS);
+
+	guint c;
+	for (c = 0; c < job->keywords->list->len && c < TAGSISTANT_MAX_KEYWORDS; c++) {
+		tagsistant_keyword *keyword = &g_array_index(job->keywords->list, tagsistant_keyword, c);
+		g_strlcpy(job->legacy_keywords[c].keyword, keyword->keyword, TAGSISTANT_MAX_KEYWORD_LENGTH);
+		g_strlcpy(job->legacy_keywords[c].value, keyword->value, TAGSISTANT_MAX_KEYWORD_LENGTH);
+	}
+
+	return (job->legacy_keywords);
+}
+
+/**
+ * call a plugin on a file. Version 0 plugins get the querytree and the
+ * keywords copied into a fixed array, version 1 plugins get the querytree
+ * and the keyword list, version 2 plugins get the job, with the contents
+ * if they declared TP_CAP_CONTENT, and are fed the chunks first if they
+ * declared TP_CAP_STREAM. The contents are always read into memory,
+ * never mapped, so a file truncated meanwhile can't crash the mount.
+ *
+ * @param plugin the plugin
+ * @param job the file being processed
+ * @return the result of the plugin
+ */
+int tagsistant_run_processor(tagsistant_plugin_t *plugin, tagsistant_plugin_job *job)
+{
+	/* call plugin processor */
+	dbg('p', LOG_INFO, "Applying plugin %s", plugin->filename);
+
+	int res = TP_NULL;
+	if (0 == plugin->abi) {
+		tagsistant_legacy_call call;
+		call.array = tagsistant_plugin_job_legacy_keywords(job);
+		call.keywords = job->keywords;
+
+		g_private_set(&tagsistant_legacy_call_key, &call);
+		res = (plugin->legacy_processor)(job->qtree, call.array);
+		g_private_set(&tagsistant_legacy_call_key, NULL);
+	} else if (1 == plugin->abi) {
+		res = (plugin->processor)(job->qtree, job->keywords);
+	} else {
+		job->content.data = NULL;
+		job->content.size = 0;
+		job->plugin_data = NULL;
+
+		if (plugin->capabilities & TP_CAP_CONTENT) {
+			tagsistant_plugin_job_load_content(job);
+			job->content.data = job->data;
+			job->content.size = job->size;
+		}
+
+		if ((plugin->capabilities & TP_CAP_STREAM) && plugin->chunk) tagsistant_plugin_job_stream(plugin, job);
+
+		res = (plugin->processor_v2)(job);
+	}
+
+	/* report about processing */
+	switch (res) {
+		case TP_ERROR:
+			dbg('p', LOG_ERR, "Plugin %s was supposed to apply to %s, but failed!", plugin->filename, job->full_archive_path);
+			break;
+		case TP_OK:
+			dbg('p', LOG_INFO, "Plugin %s tagged %s", plugin->filename, job->full_archive_path);
+			break;
+		case TP_STOP:
+			dbg('p', LOG_INFO, "Plugin %s stopped chain on %s", plugin->filename, job->full_archive_path);
+			break;
+		case TP_NULL:
+			dbg('p', LOG_INFO, "Plugin %s did not tagged %s", plugin->filename, job->full_archive_path);
+			break;
+		default:
+			dbg('p', LOG_ERR, "Plugin %s returned unknown result %d", plugin->filename, res);
+			break;
+	}
+
+	return (res);
+}
+
+/**
+ * create an empty keyword list
+ *
+ * @return the keyword list (to be freed with tagsistant_keywords_free())
+ */
+tagsistant_keywords *tagsistant_keywords_new()
+{
+	tagsistant_keywords *keywords = g_new0(tagsistant_keywords, 1);
+
+	keywords->list = g_array_new(FALSE, FALSE, sizeof(tagsistant_keyword));
+	keywords->index = g_hash_table_new(g_str_hash, g_str_equal);
+	keywords->arena = g_string_chunk_new(4096);
+	keywords->masks = g_array_new(FALSE, TRUE, sizeof(guint64));
+
+	return (keywords);
+}
+
+/**
+ * add a keyword to a keyword list. The strings are copied into the
+ * arena of the list, so they can be of any length.
+ *
+ * @param keywords the keyword list
+ * @param keyword the name of the keyword
+ * @param value the value of the keyword
+ */
+void tagsistant_keywords_add(tagsistant_keywords *keywords, const gchar *keyword, const gchar *value)
+{
+	if (!keyword || !*keyword || !value) return;
+	if (keywords->list->len >= TAGSISTANT_MAX_KEYWORDS) return;
+
+	tagsistant_keyword item;
+	item.keyword = g_string_chunk_insert_const(keywords->arena, keyword);
+	item.value = g_string_chunk_insert(keywords->arena, value);
+	g_array_append_val(keywords->list, item);
+
+	if (!g_hash_table_lookup(keywords->index, item.keyword))
+		g_hash_table_insert(keywords->index, (gpointer) item.keyword, (gpointer) item.value);
+}
+
+/**
+ * free a keyword list and all its strings
+ *
+ * @param keywords the keyword list
+ */
+void tagsistant_keywords_free(tagsistant_keywords *keywords)
+{
+	if (!keywords) return;
+
+	g_array_free(keywords->list, TRUE);
+	g_hash_table_destroy(keywords->index);
+	g_string_chunk_free(keywords->arena);
+	g_array_free(keywords->masks, TRUE);
+	g_free(keywords);
+}
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Keyword filters                                                    ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * Plugins select the keywords to be turned into tags with a regular
+ * expression, usually a list of names like "^(size|orientation)$".
+ *
+ * The first time a plugin passes its regular expression to
+ * tagsistant_plugin_iterator(), the expression is registered as a
+ * keyword filter. If it's a list of names, each name is added to a table
+ * shared by all the filters, mapping the name to a bit mask of the
+ * filters listing it. Each keyword of a file is then looked up in the
+ * table once, and each plugin only tests its own bit. The other regular
+ * expressions are still matched against each keyword.
+ */
+
+/** the maximum number of filters handled by the shared table */
+#define TAGSISTANT_MAX_KEYWORD_FILTERS 64
+
+/** a keyword filter */
+typedef struct {
+	/** the regular expression of the plugin */
+	GRegex *rx;
+
+	/** the filter matches any keyword */
+	gboolean match_all;
+
+	/** the filter is a list of names, registered in the shared table */
+	gboolean listed;
+
+	/** the bit of this filter in the masks, if listed */
+	guint64 bit;
+} tagsistant_keyword_filter;
+
+/** maps each registered GRegex to its tagsistant_keyword_filter */
+static GHashTable *tagsistant_keyword_filters = NULL;
+
+/** map the names listed by the filters to their guint64 masks, case sensitive and caseless */
+static GHashTable *tagsistant_keyword_names = NULL;
+static GHashTable *tagsistant_keyword_folded_names = NULL;
+
+/** the number of filters registered in the shared table */
+static guint tagsistant_keyword_listed_filters = 0;
+
+static GRWLock tagsistant_keyword_filters_lock;
+
+/**
+ * add a name to a table of the filters
+ *
+ * @param table the table
+ * @param name the name (ownership is taken)
+ * @param bit the bit of the filter listing the name
+ */
+static void tagsistant_keyword_filter_add_name(GHashTable *table, gchar *name, guint64 bit)
+{
+	guint64 *mask = g_hash_table_lookup(table, name);
+	if (mask) {
+		*mask |= bit;
+		g_free(name);
+		return;
+	}
+
+	mask = g_new0(guint64, 1);
+	*mask = bit;
+	g_hash_table_insert(table, name, mask);
+}
+
+/**
+ * split a regular expression like "^(name1|name2|...)$" into its names
+ *
+ * @param pattern the regular expression
+ * @param flags the compile flags of the regular expression
+ * @return a NULL terminated vector of names (to be freed with g_strfreev())
+ *   or NULL if the regular expression is not a plain list of names
+ */
+static gchar **tagsistant_keyword_filter_split(const gchar *pattern, GRegexCompileFlags flags)
+{
+	if (flags & (G_REGEX_MULTILINE|G_REGEX_DOLLAR_ENDONLY)) return (NULL);
+
+	size_t length = strlen(pattern);
+	if (length < 4 || strncmp(pattern, "^(", 2) != 0 || strcmp(pattern + length - 2, ")$") != 0) return (NULL);
+
+	gchar *list = g_strndup(pattern + 2, length - 4);
+	gchar *in, *out;
+	for (in = out = list; *in; in++) {
+		/* extended expressions ignore blanks */
+		if ((flags & G_REGEX_EXTENDED) && g_ascii_isspace(*in)) continue;
+
+		if (!g_ascii_isalnum(*in) && !strchr(" _-:|", *in)) {
+			g_free(list);
+			return (NULL);
+		}
+
+		*out++ = *in;
+	}
+	*out = '\0';
+
+	gchar **names = g_strsplit(list, "|", -1);
+	g_free(list);
+
+	return (names);
+}
+
+/**
+ * get the keyword filter of a regular expression, registering it
+ * the first time
+ *
+ * @param rx the regular expression
+ * @return the tagsistant_keyword_filter
+ */
+static tagsistant_keyword_filter *tagsistant_keyword_filter_get(GRegex *rx)
+{
+	g_rw_lock_reader_lock(&tagsistant_keyword_filters_lock);
+	tagsistant_keyword_filter *filter = g_hash_table_lookup(tagsistant_keyword_filters, rx);
+	g_rw_lock_reader_unlock(&tagsistant_keyword_filters_lock);
+
+	if (filter) return (filter);
+
+	g_rw_lock_writer_lock(&tagsistant_keyword_filters_lock);
+
+	filter = g_hash_table_lookup(tagsistant_keyword_filters, rx);
+	if (!filter) {
+		filter = g_new0(tagsistant_keyword_filter, 1);
+		filter->rx = rx;
+
+		const gchar *pattern = g_regex_get_pattern(rx);
+		GRegexCompileFlags flags = g_regex_get_compile_flags(rx);
+		gchar **names = NULL;
+
+		if (!pattern || !*pattern) {
+			filter->match_all = TRUE;
+		} else if ((tagsistant_keyword_listed_filters < TAGSISTANT_MAX_KEYWORD_FILTERS) &&
+				(names = tagsistant_keyword_filter_split(pattern, flags))) {
+			filter->listed = TRUE;
+			filter->bit = G_GUINT64_CONSTANT(1) << tagsistant_keyword_listed_filters++;
+
+			gchar **name;
+			for (name = names; *name; name++) {
+				if (flags & G_REGEX_CASELESS)
+					tagsistant_keyword_filter_add_name(tagsistant_keyword_folded_names, g_utf8_casefold(*name, -1), filter->bit);
+				else
+					tagsistant_keyword_filter_add_name(tagsistant_keyword_names, g_strdup(*name), filter->bit);
+			}
+
+			g_strfreev(names);
+		}
+
+		g_hash_table_insert(tagsistant_keyword_filters, rx, filter);
+
+		dbg('p', LOG_INFO, "Registered keyword filter %s (%s)", pattern,
+			filter->match_all ? "any keyword" : (filter->listed ? "list of names" : "regular expression"));
+	}
+
+	g_rw_lock_writer_unlock(&tagsistant_keyword_filters_lock);
+
+	return (filter);
+}
+
+/**
+ * compute the filters matched by each keyword of a list, unless
+ * already done with the same set of filters
+ *
+ * @param keywords the keyword list
+ */
+static void tagsistant_keywords_mask(tagsistant_keywords *keywords)
+{
+	g_rw_lock_reader_lock(&tagsistant_keyword_filters_lock);
+
+	if (keywords->masks->len != keywords->list->len || keywords->masked_filters != tagsistant_keyword_listed_filters) {
+		g_array_set_size(keywords->masks, keywords->list->len);
+
+		guint c;
+		for (c = 0; c < keywords->list->len; c++) {
+			const gchar *keyword = g_array_index(keywords->list, tagsistant_keyword, c).keyword;
+			guint64 mask = 0;
+
+			/* like $ in a regular expression, ignore a final newline */
+			gchar *name = g_strdup(keyword);
+			if (g_str_has_suffix(name, "\n")) name[strlen(name) - 1] = '\0';
+
+			guint64 *listed = g_hash_table_lookup(tagsistant_keyword_names, name);
+			if (listed) mask |= *listed;
+
+			if (g_hash_table_size(tagsistant_keyword_folded_names)) {
+				gchar *folded = g_utf8_casefold(name, -1);
+				listed = g_hash_table_lookup(tagsistant_keyword_folded_names, folded);
+				if (listed) mask |= *listed;
+				g_free(folded);
+			}
+
+			g_free(name);
+
+			g_array_index(keywords->masks, guint64, c) = mask;
+		}
+
+		keywords->masked_filters = tagsistant_keyword_listed_filters;
+	}
+
+	g_rw_lock_reader_unlock(&tagsistant_keyword_filters_lock);
+}
+
+/**
+ * clean a keyword or a value to be used in a tag,
+ * turning each slash and space in a dash
+ *
+ * @param string the string to be cleaned
+ * @return the cleaned string (to be freed)
+ */
+static gchar *tagsistant_clean_tag_string(const gchar *string)
+{
+	gchar *clean = g_strdup(string);
+
+	gchar *p;
+	for (p = clean; *p; p++) *p = tagsistant_tag_cleaner[(guchar) *p];
+
+	return (clean);
+}
+
+#if TAGSISTANT_ENABLE_NATIVE_EXTRACTORS
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Native extractors                                                  ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * The plugins of the most common media types only use a few header
+ * fields, so JPEG, PNG, GIF, MP3 and Ogg files are parsed here, reading
+ * just the head of the file (and the ID3v1 tag at the end of an MP3).
+ * The keywords are named like the ones of libextractor used by the
+ * default filters. Any other file is handed to libextractor.
+ */
+
+/** the bytes read from the head of a file */
+#define TAGSISTANT_NATIVE_HEAD_SIZE 65536
+
+/** the size of an ID3v1 tag */
+#define TAGSISTANT_ID3V1_SIZE 128
+
+/** read a 16 bit integer in the byte order of a TIFF header */
+static inline guint16 tagsistant_native_read16(const guchar *p, gboolean le)
+{
+	return (le ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]));
+}
+
+/** read a 32 bit integer in the byte order of a TIFF header */
+static inline guint32 tagsistant_native_read32(const guchar *p, gboolean le)
+{
+	return (le
+		? ((guint32) p[0] | ((guint32) p[1] << 8) | ((guint32) p[2] << 16) | ((guint32) p[3] << 24))
+		: (((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | (guint32) p[3]));
+}
+
+/**
+ * add a keyword from a string of a given length, converting it to
+ * UTF-8 and removing trailing blanks and NULs
+ *
+ * @param keywords the keyword list
+ * @param keyword the name of the keyword
+ * @param value the value (not NUL terminated)
+ * @param length the length of the value
+ * @param charset the charset of the value
+ */
+static void tagsistant_native_add(tagsistant_keywords *keywords, const gchar *keyword, const guchar *value, gsize length, const gchar *charset)
+{
+	gchar *utf8 = g_convert((const gchar *) value, length, "UTF-8", charset, NULL, NULL, NULL);
+	if (!utf8) return;
+
+	/* keep the first string of a list and drop trailing blanks */
+	g_strchomp(utf8);
+	if (*utf8 && g_utf8_validate(utf8, -1, NULL)) tagsistant_keywords_add(keywords, keyword, utf8);
+
+	g_free(utf8);
+}
+
+/**
+ * parse an EXIF image file directory
+ *
+ * @param tiff the TIFF header
+ * @param length the length of the EXIF data
+ * @param offset the offset of the directory
+ * @param le TRUE if the data is little endian
+ * @param nested TRUE if this is the EXIF sub directory
+ * @param keywords the keyword list
+ */
+static void tagsistant_native_exif_ifd(const guchar *tiff, gsize length, guint32 offset, gboolean le, gboolean nested, tagsistant_keywords *keywords)
+{
+	static const gchar *orientations[] = { NULL,
+		"top, left", "top, right", "bottom, right", "bottom, left",
+		"left, top", "right, top", "right, bottom", "left, bottom" };
+
+	if ((gsize) offset + 2 > length) return;
+
+	guint16 entries = tagsistant_native_read16(tiff + offset, le);
+	guint16 e;
+	for (e = 0; e < entries; e++) {
+		guint32 entry = offset + 2 + e * 12;
+		if (entry + 12 > length) return;
+
+		guint16 tag = tagsistant_native_read16(tiff + entry, le);
+		guint16 type = tagsistant_native_read16(tiff + entry + 2, le);
+		guint32 count = tagsistant_native_read32(tiff + entry + 4, le);
+
+		/* ASCII values longer than 4 bytes are stored elsewhere */
+		const guchar *ascii = NULL;
+		if (2 == type) {
+			guint32 at = (count <= 4) ? entry + 8 : tagsistant_native_read32(tiff + entry + 8, le);
+			if (at < length && count <= length - at) ascii = tiff + at;
+		}
+
+		switch (tag) {
+			case 0x010f: if (ascii) tagsistant_native_add(keywords, "camera make", ascii, strnlen((const gchar *) ascii, count), "ISO-8859-1"); break;
+			case 0x0110: if (ascii) tagsistant_native_add(keywords, "camera model", ascii, strnlen((const gchar *) ascii, count), "ISO-8859-1"); break;
+			case 0x0131: if (ascii) tagsistant_native_add(keywords, "software", ascii, strnlen((const gchar *) ascii, count), "ISO-8859-1"); break;
+			case 0x0132: if (ascii) tagsistant_native_add(keywords, "date", ascii, strnlen((const gchar *) ascii, count), "ISO-8859-1"); break;
+			case 0x9003: if (ascii) tagsistant_native_add(keywords, "creation date", ascii, strnlen((const gchar *) ascii, count), "ISO-8859-1"); break;
+			case 0x0112:
+				if (3 == type) {
+					guint16 orientation = tagsistant_native_read16(tiff + entry + 8, le);
+					if (orientation >= 1 && orientation <= 8) tagsistant_keywords_add(keywords, "orientation", orientations[orientation]);
+				}
+				break;
+			case 0x8769:
+				/* the EXIF sub directory, holding the creation date */
+				if (!nested) tagsistant_native_exif_ifd(tiff, length, tagsistant_native_read32(tiff + entry + 8, le), le, TRUE, keywords);
+				break;
+		}
+	}
+}
+
+/**
+ * parse the head of a JPEG file: its size and its EXIF tags
+ */
+static void tagsistant_native_jpeg(const guchar *head, gsize length, tagsistant_keywords *keywords)
+{
+	gsize pos = 2;
+	gboolean sized = FALSE;
+
+	while (pos + 4 <= length && 0xff == head[pos]) {
+		guchar marker = head[pos + 1];
+
+		/* fill bytes and markers without a segment */
+		if (0xff == marker) { pos++; continue; }
+		if (0x01 == marker || (marker >= 0xd0 && marker <= 0xd7)) { pos += 2; continue; }
+
+		/* the image data starts here */
+		if (0xda == marker || 0xd9 == marker) break;
+
+		guint16 segment = tagsistant_native_read16(head + pos + 2, FALSE);
+		if (segment < 2) break;
+
+		const guchar *data = head + pos + 4;
+		gsize available = MIN((gsize) segment - 2, length - pos - 4);
+
+		if (0xe1 == marker && available > 14 && memcmp(data, "Exif\0\0", 6) == 0) {
+			const guchar *tiff = data + 6;
+			gsize tiff_length = available - 6;
+			gboolean le = (tiff[0] == 'I' && tiff[1] == 'I');
+			if ((le || (tiff[0] == 'M' && tiff[1] == 'M')) && 42 == tagsistant_native_read16(tiff + 2, le))
+				tagsistant_native_exif_ifd(tiff, tiff_length, tagsistant_native_read32(tiff + 4, le), le, FALSE, keywords);
+		} else if (!sized && marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc && available >= 5) {
+			gchar *size = g_strdup_printf("%ux%u", tagsistant_native_read16(data + 3, FALSE), tagsistant_native_read16(data + 1, FALSE));
+			tagsistant_keywords_add(keywords, "size", size);
+			g_free(size);
+			sized = TRUE;
+		}
+
+		pos += 2 + segment;
+	}
+}
+
+/**
+ * parse the head of a PNG file: its size and its text chunks
+ */
+static void tagsistant_native_png(const guchar *head, gsize length, tagsistant_keywords *keywords)
+{
+	gsize pos = 8;
+
+	while (pos + 12 <= length) {
+		guint32 chunk = tagsistant_native_read32(head + pos, FALSE);
+		const guchar *type = head + pos + 4;
+		const guchar *data = head + pos + 8;
+		if (chunk > length - pos - 12) break;
+
+		if (memcmp(type, "IHDR", 4) == 0 && chunk >= 8) {
+			gchar *size = g_strdup_printf("%ux%u", tagsistant_native_read32(data, FALSE), tagsistant_native_read32(data + 4, FALSE));
+			tagsistant_keywords_add(keywords, "size", size);
+			g_free(size);
+		} else if (memcmp(type, "tEXt", 4) == 0) {
+			/* a latin1 keyword and its value, separated by a NUL */
+			gsize name_length = strnlen((const gchar *) data, chunk);
+			if (name_length && name_length < chunk) {
+				gchar *name = g_ascii_strdown((const gchar *) data, name_length);
+				tagsistant_native_add(keywords, name, data + name_length + 1, chunk - name_length - 1, "ISO-8859-1");
+				g_free(name);
+			}
+		} else if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0) {
+			break;
+		}
+
+		pos += 12 + chunk;
+	}
+}
+
+/**
+ * parse the head of a GIF file: its size
+ */
+static void tagsistant_native_gif(const guchar *head, gsize length, tagsistant_keywords *keywords)
+{
+	if (length < 10) return;
+
+	gchar *size = g_strdup_printf("%ux%u", tagsistant_native_read16(head + 6, TRUE), tagsistant_native_read16(head + 8, TRUE));
+	tagsistant_keywords_add(keywords, "size", size);
+	g_free(size);
+}
+
+/**
+ * add a keyword from an ID3v2 text frame
+ */
+static void tagsistant_native_id3v2_text(const gchar *keyword, const guchar *frame, gsize length, tagsistant_keywords *keywords)
+{
+	static const gchar *charsets[] = { "ISO-8859-1", "UTF-16", "UTF-16BE", "UTF-8" };
+
+	if (length < 2 || frame[0] > 3) return;
+
+	/* cut the value at the first terminator, keeping the first string of a list */
+	gsize unit = (1 == frame[0] || 2 == frame[0]) ? 2 : 1;
+	gsize end = 1;
+	while (end + unit <= length && (frame[end] || (2 == unit && frame[end + 1]))) end += unit;
+
+	tagsistant_native_add(keywords, keyword, frame + 1, end - 1, charsets[frame[0]]);
+}
+
+/**
+ * parse an ID3v2 tag
+ *
+ * @return TRUE if the tag was found
+ */
+static gboolean tagsistant_native_id3v2(const guchar *head, gsize length, tagsistant_keywords *keywords)
+{
+	if (length < 10 || memcmp(head, "ID3", 3) != 0) return (FALSE);
+
+	guchar version = head[3];
+	if (version < 2 || version > 4) return (FALSE);
+
+	gsize tag_size = ((head[6] & 0x7f) << 21) | ((head[7] & 0x7f) << 14) | ((head[8] & 0x7f) << 7) | (head[9] & 0x7f);
+	gsize end = MIN(length, 10 + tag_size);
+	gsize pos = 10;
+
+	/* skip the extended header */
+	if ((head[5] & 0x40) && version > 2 && pos + 4 <= end) {
+		guint32 extended = tagsistant_native_read32(head + pos, FALSE);
+		if (4 == version)
+			extended = ((extended & 0x7f000000) >> 3) | ((extended & 0x7f0000) >> 2) | ((extended & 0x7f00) >> 1) | (extended & 0x7f);
+		else
+			extended += 4;
+		pos += extended;
+	}
+
+	gsize header = (2 == version) ? 6 : 10;
+	while (pos + header <= end && head[pos]) {
+		gsize frame;
+		if (2 == version) {
+			frame = (head[pos + 3] << 16) | (head[pos + 4] << 8) | head[pos + 5];
+		} else if (3 == version) {
+			frame = tagsistant_native_read32(head + pos + 4, FALSE);
+		} else {
+			frame = ((head[pos + 4] & 0x7f) << 21) | ((head[pos + 5] & 0x7f) << 14) | ((head[pos + 6] & 0x7f) << 7) | (head[pos + 7] & 0x7f);
+		}
+
+		if (frame > end - pos - header) break;
+
+		const guchar *id = head + pos;
+		const guchar *data = head + pos + header;
+		const gchar *keyword = NULL;
+
+		if (2 == version) {
+			if (memcmp(id, "TT2", 3) == 0) keyword = "title";
+			else if (memcmp(id, "TP1", 3) == 0) keyword = "artist";
+			else if (memcmp(id, "TAL", 3) == 0) keyword = "album";
+			else if (memcmp(id, "TYE", 3) == 0) keyword = "year";
+			else if (memcmp(id, "TCO", 3) == 0) keyword = "genre";
+		} else {
+			if (memcmp(id, "TIT2", 4) == 0) keyword = "title";
+			else if (memcmp(id, "TPE1", 4) == 0) keyword = "artist";
+			else if (memcmp(id, "TALB", 4) == 0) keyword = "album";
+			else if (memcmp(id, "TYER", 4) == 0) keyword = "year";
+			else if (memcmp(id, "TCON", 4) == 0) keyword = "genre";
+			else if (memcmp(id, "TDRC", 4) == 0) keyword = "year";
+		}
+
+		/* the recording time of ID3v2.4 starts with the year */
+		if (keyword && 4 == version && memcmp(id, "TDRC", 4) == 0 && frame > 5 && 0 == data[0])
+			tagsistant_native_add(keywords, keyword, data + 1, 4, "ISO-8859-1");
+		else if (keyword)
+			tagsistant_native_id3v2_text(keyword, data, frame, keywords);
+
+		pos += header + frame;
+	}
+
+	return (TRUE);
+}
+
+/**
+ * parse an ID3v1 tag
+ */
+static void tagsistant_native_id3v1(const guchar *tag, tagsistant_keywords *keywords)
+{
+	if (memcmp(tag, "TAG", 3) != 0) return;
+
+	tagsistant_native_add(keywords, "title", tag + 3, strnlen((const gchar *) tag + 3, 30), "ISO-8859-1");
+	tagsistant_native_add(keywords, "artist", tag + 33, strnlen((const gchar *) tag + 33, 30), "ISO-8859-1");
+	tagsistant_native_add(keywords, "album", tag + 63, strnlen((const gchar *) tag + 63, 30), "ISO-8859-1");
+	tagsistant_native_add(keywords, "year", tag + 93, strnlen((const gchar *) tag + 93, 4), "ISO-8859-1");
+}
+
+/**
+ * parse the head of an Ogg file: the Vorbis or Opus comments
+ */
+static void tagsistant_native_ogg(const guchar *head, gsize length, tagsistant_keywords *keywords)
+{
+	/* look for the comment header in the first pages */
+	const guchar *comments = NULL;
+	gsize pos;
+	for (pos = 0; pos + 8 <= MIN(length, TAGSISTANT_NATIVE_HEAD_SIZE) && !comments; pos++) {
+		if (memcmp(head + pos, "\3vorbis", 7) == 0) comments = head + pos + 7;
+		else if (memcmp(head + pos, "OpusTags", 8) == 0) comments = head + pos + 8;
+	}
+	if (!comments) return;
+
+	const guchar *end = head + length;
+	if (end - comments < 4) return;
+
+	/* skip the vendor string */
+	guint32 vendor = tagsistant_native_read32(comments, TRUE);
+	if (vendor > (guint32) (end - comments - 4)) return;
+	comments += 4 + vendor;
+
+	if (end - comments < 4) return;
+	guint32 count = tagsistant_native_read32(comments, TRUE);
+	comments += 4;
+
+	guint32 c;
+	for (c = 0; c < count && end - comments >= 4; c++) {
+		guint32 comment = tagsistant_native_read32(comments, TRUE);
+		comments += 4;
+		if (comment > (guint32) (end - comments)) break;
+
+		/* each comment is "NAME=value" */
+		const guchar *equal = memchr(comments, '=', comment);
+		if (equal) {
+			gsize name_length = equal - comments;
+			gchar *name = g_ascii_strdown((const gchar *) comments, name_length);
+			if (!strcmp(name, "title") || !strcmp(name, "artist") || !strcmp(name, "album") || !strcmp(name, "date") || !strcmp(name, "genre"))
+				tagsistant_native_add(keywords, name, equal + 1, comment - name_length - 1, "UTF-8");
+			g_free(name);
+		}
+
+		comments += comment;
+	}
+}
+
+/**
+ * extract the keywords of a JPEG, PNG, GIF, MP3 or Ogg file
+ *
+ * @param full_archive_path the file
+ * @param data the contents of the file, if already in memory, or NULL
+ * @param size the size of data
+ * @param keywords the keyword list to be filled
+ * @param mime_type filled with the MIME type of the file (to be freed)
+ * @return TRUE if the file type is handled here, FALSE otherwise
+ */
+static gboolean tagsistant_native_extract(
+	const gchar *full_archive_path, const guchar *data, gsize size,
+	tagsistant_keywords *keywords, gchar **mime_type)
+{
+	guchar *buffer = NULL;
+	const guchar *head = data;
+	gsize length = size;
+	int fd = -1;
+
+	/* read the head of the file, unless already in memory */
+	if (!data) {
+		fd = open(full_archive_path, O_RDONLY|O_NOATIME);
+		if (-1 == fd) return (FALSE);
+
+		buffer = g_malloc(TAGSISTANT_NATIVE_HEAD_SIZE);
+		ssize_t got = pread(fd, buffer, TAGSISTANT_NATIVE_HEAD_SIZE, 0);
+		length = (got > 0) ? (gsize) got : 0;
+		head = buffer;
+	}
+
+	const gchar *mime = NULL;
+
+	if (length >= 3 && 0xff == head[0] && 0xd8 == head[1] && 0xff == head[2]) {
+		mime = "image/jpeg";
+		tagsistant_native_jpeg(head, length, keywords);
+	} else if (length >= 8 && memcmp(head, "\211PNG\r\n\032\n", 8) == 0) {
+		mime = "image/png";
+		tagsistant_native_png(head, length, keywords);
+	} else if (length >= 6 && (memcmp(head, "GIF87a", 6) == 0 || memcmp(head, "GIF89a", 6) == 0)) {
+		mime = "image/gif";
+		tagsistant_native_gif(head, length, keywords);
+	} else if (length >= 4 && memcmp(head, "OggS", 4) == 0) {
+		mime = "application/ogg";
+		tagsistant_native_ogg(head, length, keywords);
+	} else if ((length >= 3 && memcmp(head, "ID3", 3) == 0) ||
+			(length >= 3 && 0xff == head[0] && 0xe0 == (head[1] & 0xe0) && (head[1] & 0x06) && 0xf0 != (head[2] & 0xf0))) {
+		mime = "audio/mpeg";
+
+		/* files without an ID3v2 tag can have an ID3v1 tag at the end */
+		if (!tagsistant_native_id3v2(head, length, keywords)) {
+			if (data && size >= TAGSISTANT_ID3V1_SIZE) {
+				tagsistant_native_id3v1(data + size - TAGSISTANT_ID3V1_SIZE, keywords);
+			} else if (fd != -1) {
+				struct stat st;
+				guchar tag[TAGSISTANT_ID3V1_SIZE];
+				if (fstat(fd, &st) == 0 && st.st_size >= TAGSISTANT_ID3V1_SIZE &&
+					pread(fd, tag, TAGSISTANT_ID3V1_SIZE, st.st_size - TAGSISTANT_ID3V1_SIZE) == TAGSISTANT_ID3V1_SIZE)
+					tagsistant_native_id3v1(tag, keywords);
+			}
+		}
+	}
+
+	if (fd != -1) close(fd);
+	g_free(buffer);
+
+	if (!mime) return (FALSE);
+
+	tagsistant_keywords_add(keywords, "mimetype", mime);
+	g_free_null(*mime_type);
+	*mime_type = g_strdup(mime);
+
+	dbg('p', LOG_INFO, "Natively extracted %u keywords from %s (%s)", keywords->list->len, full_archive_path, mime);
+
+	return (TRUE);
+}
+
+#endif /* TAGSISTANT_ENABLE_NATIVE_EXTRACTORS */
+
+/****************************************************************************/
+/***                                                                      ***/
+/***   Extractor helpers                                                  ***/
+/***                                                                      ***/
+/****************************************************************************/
+
+/*
+ * libextractor is not thread safe and its plugins can crash on broken
+ * files, so keywords are extracted by helper processes forked by the
+ * autotagging workers, one for each worker. A worker sends the path of
+ * the file (and its contents, if already in memory) to its helper over
+ * a pipe and reads back a list of records:
+ *
+ *   'M' <mime type>
+ *   'K' <keyword> <value>
+ *   'E'
+ *
+ * where each string is sent as a 32 bit length followed by its bytes.
+ * If the helper dies or doesn't answer all the records of a file in
+ * time, it's killed and a new one is forked for the next file.
+ */
+
+/** seconds a helper is given to extract all the keywords of a file */
+#define TAGSISTANT_EXTRACTOR_TIMEOUT 60
+
+#define TAGSISTANT_EXTRACTOR_MIME 'M'
+#define TAGSISTANT_EXTRACTOR_KEYWORD 'K'
+#define TAGSISTANT_EXTRACTOR_END 'E'
+
+typedef struct {
+	pid_t pid;
+	int request;	/**< pipe to the helper */
+	int reply;		/**< pipe from the helper */
+} tagsistant_extractor_helper;
+
+/**
+ * write a buffer to a pipe
+ *
+ * @return TRUE on success
+ */
+static gboolean tagsistant_pipe_write(int fd, const void *buffer, gsize length)
+{
+	const gchar *ptr = buffer;
+	while (length) {
+		ssize_t written = write(fd, ptr, length);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return (FALSE);
+		ptr += written;
+		length -= written;
+	}
+	return (TRUE);
+}
+
+/**
+ * read a buffer from a pipe, waiting for the data to come until
+ * a deadline (no limit if deadline is 0)
+ *
+ * @param deadline the monotonic time (in µs) the data must come by
+ * @return TRUE on success
+ */
+static gboolean tagsistant_pipe_read(int fd, void *buffer, gsize length, gint64 deadline)
+{
+	gchar *ptr = buffer;
+	while (length) {
+		if (deadline) {
+			gint64 left = deadline - g_get_monotonic_time();
+			if (left <= 0) return (FALSE);
+
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			int ready = poll(&pfd, 1, (int) ((left + 999) / 1000));
+			if (ready < 0 && errno == EINTR) continue;
+			if (ready <= 0) return (FALSE);
+		}
+
+		ssize_t got = read(fd, ptr, length);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return (FALSE);
+		ptr += got;
+		length -= got;
+	}
+	return (TRUE);
+}
+
+/**
+ * write a length-prefixed string to a pipe
+ */
+static gboolean tagsistant_pipe_write_string(int fd, const void *string, guint32 length)
+{
+	return (tagsistant_pipe_write(fd, &length, sizeof(guint32)) && (!length || tagsistant_pipe_write(fd, string, length)));
+}
+
+/**
+ * read a length-prefixed string from a pipe
+ *
+ * @return the string (to be freed) or NULL on error
+ */
+static gchar *tagsistant_pipe_read_string(int fd, guint32 *length, gint64 deadline)
+{
+	if (!tagsistant_pipe_read(fd, length, sizeof(guint32), deadline)) return (NULL);
+
+	gchar *string = g_malloc(*length + 1);
+	if (*length && !tagsistant_pipe_read(fd, string, *length, deadline)) {
+		g_free(string);
+		return (NULL);
+	}
+	string[*length] = '\0';
+
+	return (string);
+}
+
+/**
+ * send a keyword from the helper to its worker
+ */
+static void tagsistant_extractor_helper_send(int reply, const gchar *keyword, const gchar *value, gsize value_length)
+{
+	gchar kind = TAGSISTANT_EXTRACTOR_KEYWORD;
+	tagsistant_pipe_write(reply, &kind, 1);
+	tagsistant_pipe_write_string(reply, keyword, strlen(keyword));
+	tagsistant_pipe_write_string(reply, value, value_length);
+}
+
+#if TAGSISTANT_EXTRACTOR == 5
+
+/**
+ * extract the keywords of a file in the helper process
+ */
+static void tagsistant_extractor_helper_extract(
+	EXTRACTOR_ExtractorList *extractors, int reply,
+	const gchar *full_archive_path, const guchar *data, gsize size)
+{
+	/* extract the keywords and remove duplicated ones */
+	EXTRACTOR_KeywordList *extracted_keywords = data
+		? EXTRACTOR_getKeywords2(extractors, data, size)
+		: EXTRACTOR_getKeywords(extractors, full_archive_path);
+	extracted_keywords = EXTRACTOR_removeDuplicateKeywords(extracted_keywords, 0);
+
+	EXTRACTOR_KeywordList *keyword_pointer = extracted_keywords;
+	while (keyword_pointer) {
+		/* send the mime type */
+		if (EXTRACTOR_MIMETYPE == keyword_pointer->keywordType) {
+			gchar kind = TAGSISTANT_EXTRACTOR_MIME;
+			tagsistant_pipe_write(reply, &kind, 1);
+			tagsistant_pipe_write_string(reply, keyword_pointer->keyword, strlen(keyword_pointer->keyword));
+		}
+
+		tagsistant_extractor_helper_send(reply,
+			EXTRACTOR_getKeywordTypeAsString(keyword_pointer->keywordType),
+			keyword_pointer->keyword, strlen(keyword_pointer->keyword));
+
+		keyword_pointer = keyword_pointer->next;
+	}
+
+	EXTRACTOR_freeKeywords(extracted_keywords);
+}
+
+#else
+
+/**
+ * libextractor callback: send a keyword to the worker
+ */
+static int tagsistant_extractor_helper_callback(
+	void *cls, const char *plugin_name, enum EXTRACTOR_MetaType type,
+	enum EXTRACTOR_MetaFormat format, const char *data_mime_type,
+	const char *data, size_t data_len)
+{
+	(void) plugin_name;
+	(void) data_mime_type;
+
+	int reply = GPOINTER_TO_INT(cls);
+
+	/* binary values can't be used as tags */
+	if (EXTRACTOR_METAFORMAT_UTF8 != format && EXTRACTOR_METAFORMAT_C_STRING != format) return (0);
+
+	/* UTF8 values include the trailing \0 */
+	gsize length = strnlen(data, data_len);
+
+	/* send the mime type */
+	if (EXTRACTOR_METATYPE_MIMETYPE == type) {
+		gchar kind = TAGSISTANT_EXTRACTOR_MIME;
+		tagsistant_pipe_write(reply, &kind, 1);
+		tagsistant_pipe_write_string(reply, data, length);
+	}
+
+	tagsistant_extractor_helper_send(reply, EXTRACTOR_metatype_to_string(type), data, length);
+
+	return (0);
+}
+
+/**
+ * extract the keywords of a file in the helper process
+ */
+static void tagsistant_extractor_helper_extract(
+	struct EXTRACTOR_PluginList *extractors, int reply,
+	const gchar *full_archive_path, const guchar *data, gsize size)
+{
+	if (data)
+		EXTRACTOR_extract(extractors, NULL, data, size, tagsistant_extractor_helper_callback, GINT_TO_POINTER(reply));
+	else
+		EXTRACTOR_extract(extractors, full_archive_path, NULL, 0, tagsistant_extractor_helper_callback, GINT_TO_POINTER(reply));
+}
+
+#endif
+
+/**
+ * the main loop of a helper process: it loads libextractor and serves
+ * the requests of its worker until the pipe is closed
+ *
+ * @param request the pipe from the worker
+ * @param reply the pipe to the worker
+ */
+static void tagsistant_extractor_helper_main(int request, int reply)
+{
 #if TAGSISTANT_EXTRACTOR == 5
-static EXTRACTOR_ExtractorList *elist;
+	EXTRACTOR_ExtractorList *extractors = EXTRACTOR_loadDefaultLibraries();
 #else
-static struct EXTRACTOR_PluginList *plist;
+	/* this process is already isolated, so plugins can run in process */
+	struct EXTRACTOR_PluginList *extractors = EXTRACTOR_plugin_add_defaults(EXTRACTOR_OPTION_IN_PROCESS);
 #endif
 
-static GRegex *tagsistant_rx_date;
-static GRegex *tagsistant_rx_cleaner;
+	while (1) {
+		guint32 path_length = 0, size = 0;
 
-#ifndef errno
-#define errno
-#endif
+		gchar *full_archive_path = tagsistant_pipe_read_string(request, &path_length, 0);
+		if (!full_archive_path) break;
 
-/*
- * This mutex is used to concurrently access libextractor facilities
+		gchar *data = tagsistant_pipe_read_string(request, &size, 0);
+		if (!data) break;
+
+		tagsistant_extractor_helper_extract(extractors, reply, full_archive_path, size ? (guchar *) data : NULL, size);
+
+		gchar kind = TAGSISTANT_EXTRACTOR_END;
+		if (!tagsistant_pipe_write(reply, &kind, 1)) break;
+
+		g_free(full_archive_path);
+		g_free(data);
+	}
+
+	_exit(0);
+}
+
+/**
+ * close all the descriptors inherited by a helper process but its own
+ * pipes and the standard ones. Other workers may be forking their helpers
+ * at the same time, so the pipes of other helpers can be inherited too:
+ * keeping them open would hide the death of those helpers from their
+ * workers.
+ *
+ * @param request the pipe from the worker
+ * @param reply the pipe to the worker
  */
-GMutex tagsistant_processor_mutex;
+static void tagsistant_extractor_helper_close_descriptors(int request, int reply)
+{
+	GArray *descriptors = g_array_new(FALSE, FALSE, sizeof(int));
+
+	DIR *fds = opendir("/proc/self/fd");
+	if (fds) {
+		struct dirent *de;
+		while ((de = readdir(fds)) != NULL) {
+			if (!g_ascii_isdigit(de->d_name[0])) continue;
+			int fd = atoi(de->d_name);
+			if (fd != dirfd(fds)) g_array_append_val(descriptors, fd);
+		}
+		closedir(fds);
+	} else {
+		int fd, max = MIN(sysconf(_SC_OPEN_MAX), 65536);
+		for (fd = 0; fd < max; fd++) g_array_append_val(descriptors, fd);
+	}
+
+	guint i;
+	for (i = 0; i < descriptors->len; i++) {
+		int fd = g_array_index(descriptors, int, i);
+		if (fd > STDERR_FILENO && fd != request && fd != reply) close(fd);
+	}
+
+	g_array_free(descriptors, TRUE);
+}
 
-int tagsistant_run_processor(
-	tagsistant_plugin_t *plugin,
-	tagsistant_querytree *qtree,
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+/**
+ * fork a new helper process
+ *
+ * @return the helper or NULL on error
+ */
+static tagsistant_extractor_helper *tagsistant_extractor_helper_spawn()
 {
-	/* call plugin processor */
-	dbg('p', LOG_INFO, "Applying plugin %s", plugin->filename);
-	int res = (plugin->processor)(qtree, keywords);
+	int request[2], reply[2];
 
-	/* report about processing */
-	switch (res) {
-		case TP_ERROR:
-			dbg('p', LOG_ERR, "Plugin %s was supposed to apply to %s, but failed!", plugin->filename, qtree->full_archive_path);
-			break;
-		case TP_OK:
-			dbg('p', LOG_INFO, "Plugin %s tagged %s", plugin->filename, qtree->full_archive_path);
-			break;
-		case TP_STOP:
-			dbg('p', LOG_INFO, "Plugin %s stopped chain on %s", plugin->filename, qtree->full_archive_path);
-			break;
-		case TP_NULL:
-			dbg('p', LOG_INFO, "Plugin %s did not tagged %s", plugin->filename, qtree->full_archive_path);
-			break;
-		default:
-			dbg('p', LOG_ERR, "Plugin %s returned unknown result %d", plugin->filename, res);
-			break;
+	if (-1 == pipe(request)) return (NULL);
+	if (-1 == pipe(reply)) {
+		close(request[0]); close(request[1]);
+		return (NULL);
 	}
 
-	return (res);
+	pid_t pid = fork();
+
+	if (-1 == pid) {
+		dbg('p', LOG_ERR, "Unable to fork an extractor helper: %s", strerror(errno));
+		close(request[0]); close(request[1]);
+		close(reply[0]); close(reply[1]);
+		return (NULL);
+	}
+
+	if (0 == pid) {
+		/* the helper process: only libextractor is used from now on */
+		tagsistant_extractor_helper_close_descriptors(request[0], reply[1]);
+		tagsistant_extractor_helper_main(request[0], reply[1]);
+	}
+
+	close(request[0]);
+	close(reply[1]);
+
+	tagsistant_extractor_helper *helper = g_new0(tagsistant_extractor_helper, 1);
+	helper->pid = pid;
+	helper->request = request[1];
+	helper->reply = reply[0];
+
+	dbg('p', LOG_INFO, "Forked extractor helper %d", pid);
+
+	return (helper);
 }
 
-#if TAGSISTANT_EXTRACTOR == 5
+/**
+ * stop a helper process
+ *
+ * @param data the tagsistant_extractor_helper
+ */
+static void tagsistant_extractor_helper_stop(gpointer data)
+{
+	tagsistant_extractor_helper *helper = (tagsistant_extractor_helper *) data;
+	if (!helper) return;
+
+	close(helper->request);
+	close(helper->reply);
+	kill(helper->pid, SIGKILL);
+	waitpid(helper->pid, NULL, 0);
+
+	g_free(helper);
+}
+
+/** the helper of each autotagging worker */
+static GPrivate tagsistant_extractor_helper_key = G_PRIVATE_INIT(tagsistant_extractor_helper_stop);
 
 /**
- * process a file using plugin chain
+ * extract the keywords of a file using the helper of the calling thread
  *
- * @param filename file to be processed (just the name, will be looked up in /archive)
- * @return zero on fault, one on success
+ * @param full_archive_path the file
+ * @param data the contents of the file, if already in memory, or NULL
+ * @param size the size of data
+ * @param keywords the keyword list to be filled
+ * @param mime_type filled with the MIME type of the file (to be freed), if found
+ * @return TRUE on success, FALSE if the extraction failed
  */
-int tagsistant_process(gchar *path, gchar *full_archive_path)
+static gboolean tagsistant_extract_keywords(
+	const gchar *full_archive_path, const guchar *data, gsize size,
+	tagsistant_keywords *keywords, gchar **mime_type)
 {
-	int res = 0;
-	gchar *mime_type = NULL;
-	gchar *mime_generic = NULL;
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS];
+#if TAGSISTANT_ENABLE_NATIVE_EXTRACTORS
+	/* the most common media types don't need libextractor */
+	if (tagsistant_native_extract(full_archive_path, data, size, keywords, mime_type)) return (TRUE);
+#endif
 
-	/* blank the keyword buffer */
-	memset(keywords, 0, TAGSISTANT_MAX_KEYWORDS * 2 * TAGSISTANT_MAX_KEYWORD_LENGTH);
+	tagsistant_extractor_helper *helper = g_private_get(&tagsistant_extractor_helper_key);
+	if (!helper) {
+		helper = tagsistant_extractor_helper_spawn();
+		if (!helper) return (FALSE);
+		g_private_set(&tagsistant_extractor_helper_key, helper);
+	}
 
-	dbg('p', LOG_INFO, "Processing file %s", full_archive_path);
+	gboolean done = FALSE;
 
-	/* lock processor mutex */
-	g_mutex_lock(&tagsistant_processor_mutex);
+	/* the helper must answer all the records of the file by this time */
+	gint64 deadline = g_get_monotonic_time() + (gint64) TAGSISTANT_EXTRACTOR_TIMEOUT * G_USEC_PER_SEC;
 
-	/*
-	 * Extract the keywords and remove duplicated ones
-	 */
-	EXTRACTOR_KeywordList *extracted_keywords = EXTRACTOR_getKeywords(elist, full_archive_path);
-	extracted_keywords = EXTRACTOR_removeDuplicateKeywords (extracted_keywords, 0);
+	if (tagsistant_pipe_write_string(helper->request, full_archive_path, strlen(full_archive_path)) &&
+		tagsistant_pipe_write_string(helper->request, data, data ? size : 0)) {
 
-	/*
-	 *  loop through the keywords and feed the keyword buffer
-	 */
-	EXTRACTOR_KeywordList *keyword_pointer = extracted_keywords;
-	int c = 0;
-	while (keyword_pointer && c < TAGSISTANT_MAX_KEYWORDS) {
-		sprintf(keywords[c].keyword, "%s", EXTRACTOR_getKeywordTypeAsString(keyword_pointer->keywordType));
-		sprintf(keywords[c].value, "%s", keyword_pointer->keyword);
+		while (1) {
+			gchar kind = 0;
+			if (!tagsistant_pipe_read(helper->reply, &kind, 1, deadline)) break;
 
-		/* save the mime type */
-		if (EXTRACTOR_MIMETYPE == keyword_pointer->keywordType) {
-			// mime_type = EXTRACTOR_getKeywordValueAsString(keyword_pointer->keywordType);
-			mime_type = g_strdup(keyword_pointer->keyword);
-		}
+			if (TAGSISTANT_EXTRACTOR_END == kind) {
+				done = TRUE;
+				break;
+			}
 
-#if 0
-		/* tag by date */
-		const gchar *date = tagsistant_plugin_get_keyword_value("date", keywords);
-		if (date) tagsistant_plugin_tag_by_date(qtree, date);
-#endif
+			guint32 length = 0;
+			gchar *first = tagsistant_pipe_read_string(helper->reply, &length, deadline);
+			if (!first) break;
 
-		keyword_pointer = keyword_pointer->next;
-		c++;
+			if (TAGSISTANT_EXTRACTOR_MIME == kind) {
+				g_free_null(*mime_type);
+				*mime_type = first;
+				continue;
+			}
+
+			gchar *value = tagsistant_pipe_read_string(helper->reply, &length, deadline);
+			if (!value) {
+				g_free(first);
+				break;
+			}
+
+			tagsistant_keywords_add(keywords, first, value);
+
+			g_free(first);
+			g_free(value);
+		}
 	}
 
-	/*
-	 * If no mime type has been found just return
-	 */
-	if (!mime_type) {
-		/* lock processor mutex */
-		g_mutex_unlock(&tagsistant_processor_mutex);
-		return(res);
+	/* the helper crashed or hung: a new one will be forked for the next file */
+	if (!done) {
+		dbg('p', LOG_ERR, "Extractor helper %d failed on %s", helper->pid, full_archive_path);
+		g_private_replace(&tagsistant_extractor_helper_key, NULL);
 	}
 
-	/*
-	 * guess the generic MIME type
-	 */
-	mime_generic = g_strdup(mime_type);
+	return (done);
+}
+
+/**
+ * the plugin dispatch table: maps every MIME type handled by a plugin
+ * (like image/jpeg, image/* or * / *) to the chain of plugins to be
+ * applied to it, in order: the exact ones, the generic ones and the
+ * ones for everything
+ */
+static GHashTable *tagsistant_plugin_dispatch = NULL;
+
+/**
+ * get the generic form of a MIME type (like image/* for image/jpeg)
+ *
+ * @param mime_type the MIME type
+ * @return the generic MIME type (to be freed)
+ */
+static gchar *tagsistant_generic_mime_type(const gchar *mime_type)
+{
+	gchar *mime_generic = g_strdup(mime_type);
 	gchar *slash = index(mime_generic, '/');
 	if (slash) {
 		slash++; *slash = '*';
 		slash++; *slash = '\0';
 	}
+	return (mime_generic);
+}
 
-	/*
-	 * recreate the querytree object just before using it to tag the object
-	 */
-	tagsistant_querytree *qtree = tagsistant_querytree_new(path, 0, 1, 1, 0);
-	if (!qtree) goto STOP_CHAIN_TAGGING;
-
-	/*
-	 *  apply plugins starting from the most matching first (like: image/jpeg)
-	 */
+/**
+ * append the plugins handling a MIME type to a chain
+ *
+ * @param chain the GPtrArray of plugins
+ * @param mime_type the MIME type
+ */
+static void tagsistant_plugin_chain_append(GPtrArray *chain, const gchar *mime_type)
+{
 	tagsistant_plugin_t *plugin = tagsistant.plugins;
 	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, mime_type) == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, keywords)) goto STOP_CHAIN_TAGGING;
-		}
+		if (strcmp(plugin->mime_type, mime_type) == 0) g_ptr_array_add(chain, plugin);
 		plugin = plugin->next;
 	}
+}
 
-	/*
-	 * mime generic then (like: image / *)
-	 */
-	plugin = tagsistant.plugins;
-	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, mime_generic) == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, keywords)) goto STOP_CHAIN_TAGGING;
-		}
-		plugin = plugin->next;
-	}
+/**
+ * build the plugin dispatch table, once all the plugins have been loaded
+ */
+static void tagsistant_plugin_build_dispatch_table()
+{
+	tagsistant_plugin_dispatch = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
 
-	/*
-	 * mime everything (* / *)
-	 */
-	plugin = tagsistant.plugins;
+	tagsistant_plugin_t *plugin = tagsistant.plugins;
 	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, "*/*") == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, keywords)) goto STOP_CHAIN_TAGGING;
+		if (!g_hash_table_lookup(tagsistant_plugin_dispatch, plugin->mime_type)) {
+			GPtrArray *chain = g_ptr_array_new();
+			gchar *mime_generic = tagsistant_generic_mime_type(plugin->mime_type);
+
+			tagsistant_plugin_chain_append(chain, plugin->mime_type);
+			if (strcmp(mime_generic, plugin->mime_type) != 0) tagsistant_plugin_chain_append(chain, mime_generic);
+			if (strcmp("*/*", mime_generic) != 0) tagsistant_plugin_chain_append(chain, "*/*");
+
+			g_hash_table_insert(tagsistant_plugin_dispatch, g_strdup(plugin->mime_type), chain);
+			g_free(mime_generic);
 		}
 		plugin = plugin->next;
-
-		dbg('p', LOG_INFO, "Using generic plugin on MIME type %s", mime_type);
 	}
+}
 
-STOP_CHAIN_TAGGING:
-
-	g_free_null(mime_type);
-	g_free_null(mime_generic);
-
-	dbg('p', LOG_INFO, "Processing of %s ended.", qtree->full_archive_path);
-
-	tagsistant_querytree_destroy(qtree, 1);
-
-	/* free the keyword structure */
-	EXTRACTOR_freeKeywords(extracted_keywords);
+/**
+ * get the chain of plugins to be applied to a MIME type
+ *
+ * @param mime_type the MIME type
+ * @return the GPtrArray of plugins or NULL if no plugin applies
+ */
+static GPtrArray *tagsistant_plugin_chain(const gchar *mime_type)
+{
+	GPtrArray *chain = g_hash_table_lookup(tagsistant_plugin_dispatch, mime_type);
+	if (chain) return (chain);
 
-	/* lock processor mutex */
-	g_mutex_unlock(&tagsistant_processor_mutex);
+	/* no plugin handles this very MIME type, try with the generic one */
+	gchar *mime_generic = tagsistant_generic_mime_type(mime_type);
+	chain = g_hash_table_lookup(tagsistant_plugin_dispatch, mime_generic);
+	g_free(mime_generic);
+	if (chain) return (chain);
 
-	return(res);
+	return (g_hash_table_lookup(tagsistant_plugin_dispatch, "*/*"));
 }
 
-#else
-
+/**
+ * the tags emitted by the plugin chain for a single file; they are
+ * written in one transaction once the whole chain has run
+ */
 typedef struct {
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS];
-	int current_keyword;
-	gchar mime_type[1024];
-	gchar generic_mime_type[1024];
-} tagsistant_process_callback_context;
+	/** the tagsistant_tag_triple items */
+	GArray *tags;
 
-static int tagsistant_process_callback(
-	void *cls, const char *plugin_name, enum EXTRACTOR_MetaType type,
-	enum EXTRACTOR_MetaFormat format, const char *data_mime_type,
-	const char *data, size_t data_len)
-{
-	(void) plugin_name;
-	(void) format;
-	(void) data_mime_type;
+	/** holds the strings of the tags */
+	GStringChunk *arena;
+} tagsistant_tag_collector;
 
-	tagsistant_process_callback_context *context = (tagsistant_process_callback_context *) cls;
-	int res = 0;
+/** the collector of the file processed by the calling thread, if any */
+static GPrivate tagsistant_tag_collector_key = G_PRIVATE_INIT(NULL);
 
-	/* copy the keyword and its value into the context keywords buffer */
-	if (context->current_keyword < TAGSISTANT_MAX_KEYWORDS) {
-		sprintf(context->keywords[context->current_keyword].keyword, "%s", EXTRACTOR_metatype_to_string(type));
-		memcpy(context->keywords[context->current_keyword].value, data, data_len);
-		context->current_keyword += 1;
-	}
+/**
+ * Collect a tag for the file processed by the calling thread
+ *
+ * @param tagname the tag name or the namespace of a triple tag
+ * @param key the key of a triple tag, or NULL
+ * @param value the value of a triple tag, or NULL
+ * @return TRUE if collected, FALSE if no plugin chain is running
+ */
+gboolean tagsistant_plugin_collect_tag(const gchar *tagname, const gchar *key, const gchar *value)
+{
+	tagsistant_tag_collector *collector = g_private_get(&tagsistant_tag_collector_key);
+	if (!collector || !tagname) return (FALSE);
 
-	/* save the mime type */
-	if (EXTRACTOR_METATYPE_MIMETYPE == type) {
-		memset(context->mime_type, 0, 1024);
-		memcpy(context->mime_type, data, data_len);
+	tagsistant_tag_triple triple;
+	triple.tagname = g_string_chunk_insert_const(collector->arena, tagname);
+	triple.key = key ? g_string_chunk_insert_const(collector->arena, key) : NULL;
+	triple.value = value ? g_string_chunk_insert_const(collector->arena, value) : NULL;
 
-		/* guess the generic MIME type */
-		memset(context->generic_mime_type, 0, 1024);
-		memcpy(context->generic_mime_type, data, data_len);
+	g_array_append_val(collector->tags, triple);
 
-		gchar *slash = index(context->generic_mime_type, '/');
-		if (slash) {
-			slash++; *slash = '*';
-			slash++; *slash = '\0';
-		}
-	}
+	return (TRUE);
+}
 
-	return (res);
+/**
+ * Tag the object of a querytree on behalf of a plugin. While a plugin
+ * chain is running the tag is only collected, otherwise it's applied
+ * right away using the querytree connection.
+ *
+ * @param qtree the querytree object to tag
+ * @param tagname the tag name or the namespace of a triple tag
+ * @param key the key of a triple tag, or NULL
+ * @param value the value of a triple tag, or NULL
+ */
+void tagsistant_plugin_tag(const tagsistant_querytree *qtree, const gchar *tagname, const gchar *key, const gchar *value)
+{
+	if (!tagname) return;
+
+	if (!tagsistant_plugin_collect_tag(tagname, key, value))
+		tagsistant_sql_tag_object(qtree->dbi, tagname, key, value, qtree->inode);
 }
 
 /**
  * process a file using plugin chain
  *
- * @param filename file to be processed (just the name, will be looked up in /archive)
- * @return(zero on fault, one on success)
+ * @param path the path of the object
+ * @param full_archive_path the file of the object under archive/
+ * @param data the contents of the file, if already in memory, or NULL
+ * @param size the size of data
+ * @return zero on fault, one on success
  */
-int tagsistant_process(gchar *path, gchar *full_archive_path)
+int tagsistant_process(gchar *path, gchar *full_archive_path, const guchar *data, gsize size)
 {
 	int res = 0;
+	gchar *mime_type = NULL;
+	tagsistant_querytree *qtree = NULL;
+	tagsistant_tag_collector collector;
+	tagsistant_tag_emitter emitter;
+	tagsistant_plugin_job job;
 
 	dbg('p', LOG_INFO, "Processing file %s", full_archive_path);
 
-	tagsistant_process_callback_context context;
-	memset(context.keywords, 0, TAGSISTANT_MAX_KEYWORDS * TAGSISTANT_MAX_KEYWORD_LENGTH * 2);
-	memset(context.mime_type, 0, 1024);
-	memset(context.generic_mime_type, 0, 1024);
-	context.current_keyword = 0;
+	tagsistant_keywords *keywords = tagsistant_keywords_new();
 
 	/*
 	 * Extract the keywords
 	 */
-	EXTRACTOR_extract(plist, full_archive_path, NULL, 0, tagsistant_process_callback, (void *) &context);
+	if (!tagsistant_extract_keywords(full_archive_path, data, size, keywords, &mime_type)) goto STOP_CHAIN_TAGGING;
 
 	/*
-	 * recreate the querytree object just before using it to tag the object
+	 * If no mime type has been found, only the generic (* / *) plugins apply
 	 */
-	tagsistant_querytree *qtree = tagsistant_querytree_new(path, 0, 1, 1);
-	if (!qtree) goto STOP_CHAIN_TAGGING;
+	if (!mime_type) mime_type = g_strdup("");
 
 	/*
-	 *  apply plugins starting from the most matching first (like: image/jpeg)
+	 * recreate the querytree object just before using it to tag the object;
+	 * the plugins only collect tags, so no connection is held while they run
 	 */
-	tagsistant_plugin_t *plugin = tagsistant.plugins;
-	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, context.mime_type) == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, context.keywords)) goto STOP_CHAIN_TAGGING;
-		}
-		plugin = plugin->next;
-	}
+	qtree = tagsistant_querytree_new(path, 0, 0, 1, 0);
+	if (!qtree) goto STOP_CHAIN_TAGGING;
+
+	tagsistant_db_connection_release(qtree->dbi, 0);
+	qtree->dbi = NULL;
+
+	collector.tags = g_array_sized_new(FALSE, FALSE, sizeof(tagsistant_tag_triple), 64);
+	collector.arena = g_string_chunk_new(4096);
+	g_private_set(&tagsistant_tag_collector_key, &collector);
 
 	/*
-	 * mime generic then (like: image / *)
+	 * apply the plugins starting from the most matching first (like: image/jpeg),
+	 * then the generic ones (like: image / *) and then the ones for everything (* / *)
 	 */
-	plugin = tagsistant.plugins;
-	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, context.generic_mime_type) == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, context.keywords)) goto STOP_CHAIN_TAGGING;
-		}
-		plugin = plugin->next;
+	memset(&emitter, 0, sizeof(tagsistant_tag_emitter));
+	emitter.qtree = qtree;
+
+	memset(&job, 0, sizeof(tagsistant_plugin_job));
+	job.qtree = qtree;
+	job.keywords = keywords;
+	job.emitter = &emitter;
+	job.full_archive_path = full_archive_path;
+	job.data = data;
+	job.size = data ? size : 0;
+
+	GPtrArray *chain = tagsistant_plugin_chain(mime_type);
+	guint i;
+	for (i = 0; chain && i < chain->len; i++) {
+		if (TP_STOP == tagsistant_run_processor(g_ptr_array_index(chain, i), &job)) break;
 	}
 
+	tagsistant_plugin_job_release(&job);
+
+	g_private_set(&tagsistant_tag_collector_key, NULL);
+
 	/*
-	 * mime everything (* / *)
+	 * write all the collected tags in a single transaction
 	 */
-	plugin = tagsistant.plugins;
-	while (plugin != NULL) {
-		if (strcmp(plugin->mime_type, "*/*") == 0) {
-			if (TP_STOP == tagsistant_run_processor(plugin, qtree, context.keywords)) goto STOP_CHAIN_TAGGING;
-		}
-		plugin = plugin->next;
+	if (collector.tags->len) {
+		dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_START_TRANSACTION);
+		tagsistant_sql_tag_object_many(dbi, collector.tags, qtree->inode);
+		tagsistant_commit_transaction(dbi);
+		tagsistant_db_connection_release(dbi, 1);
 	}
 
+	dbg('p', LOG_INFO, "%u tags collected for %s", collector.tags->len, full_archive_path);
+
+	g_array_free(collector.tags, TRUE);
+	g_string_chunk_free(collector.arena);
+
 STOP_CHAIN_TAGGING:
-	tagsistant_querytree_destroy(qtree, 1);
-	return (res);
-}
 
-#endif
+	g_free_null(mime_type);
+	tagsistant_keywords_free(keywords);
+
+	dbg('p', LOG_INFO, "Processing of %s ended.", full_archive_path);
+
+	if (qtree) tagsistant_querytree_destroy(qtree, 0);
+
+	return(res);
+}
 
 /**
- * Apply a tag if a regular expression matches a retrieved keyword
+ * Tag the qtree object with a keyword, as "keyword_name:keyword_value"
  *
- * @param regex the GRegex regular expression
+ * @param namespace the namespace of the tag
  * @param keyword a string with the keyword name
  * @param value a string with the keyword value
- * @param qtree the tagsistant_querytree object that could be tagged
+ * @param qtree the tagsistant_querytree object to be tagged
  */
-void tagsistant_keyword_matcher(
-	GRegex *regex,
+static void tagsistant_keyword_apply(
 	const gchar *namespace,
 	const gchar *keyword,
 	const gchar *value,
 	const tagsistant_querytree *qtree)
 {
-	/*
-	 * if the keyword name matches the filter regular expression
-	 */
-	if (g_regex_match(regex, keyword, 0, NULL)) {
-
-		/*
-		 * build a tag which is "keyword_name:keyword_value"
-		 */
-		gchar *clean_keyword = g_regex_replace_literal(tagsistant_rx_cleaner, keyword, -1, 0, "-", 0, NULL);
-		gchar *clean_value = g_regex_replace_literal(tagsistant_rx_cleaner, value, -1, 0, "-", 0, NULL);
-
-#if 0
-		/* ... turn each slash and space in a dash */
-		gchar *tpointer = clean_keyword;
-		while (*tpointer) {
-			if (*tpointer == '/' || *tpointer == ' ') *tpointer = '-';
-			tpointer++;
-		}
-
-		tpointer = clean_value;
-		while (*tpointer) {
-			if (*tpointer == '/' || *tpointer == ' ') *tpointer = '-';
-			tpointer++;
-		}
-#endif
+	gchar *clean_keyword = tagsistant_clean_tag_string(keyword);
+	gchar *clean_value = tagsistant_clean_tag_string(value);
 
-		/*
-		 * then tag the file
-		 */
-		tagsistant_sql_tag_object(qtree->dbi, namespace, clean_keyword, clean_value, qtree->inode);
+	tagsistant_plugin_tag(qtree, namespace, clean_keyword, clean_value);
 
-		/*
-		 * and cleanup
-		 */
-		g_free_null(clean_keyword);
-		g_free_null(clean_value);
-	} else {
-		dbg('p', LOG_INFO, "keyword %s refused by regular expression", keyword);
-	}
+	g_free_null(clean_keyword);
+	g_free_null(clean_value);
 }
 
 /**
@@ -384,25 +1627,38 @@ void tagsistant_keyword_matcher(
  * and tags the qtree object.
  *
  * @param qtree the querytree object to tag
- * @param keyworkd a EXTRACTOR_KeywordList * list of keywords
+ * @param keywords the tagsistant_keywords list, or the keyword array of a version 0 plugin
  * @param regex a precompiled GRegex object to match against each keyword
  */
 void tagsistant_plugin_iterator(
 	const tagsistant_querytree *qtree,
 	const gchar *namespace,
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS],
+	tagsistant_keywords *keywords,
 	GRegex *regex)
 {
+	keywords = tagsistant_keywords_resolve(keywords);
+
+	tagsistant_keyword_filter *filter = tagsistant_keyword_filter_get(regex);
+	if (filter->listed) tagsistant_keywords_mask(keywords);
+
 	/*
 	 * loop through the keywords to tag the file
 	 */
-	int c = 0;
-	for (; c < TAGSISTANT_MAX_KEYWORDS; c++) {
-		/* stop looping on the first null keyword */
-		if ('\0' == *(keywords[c].keyword)) break;
-
-		/* tag the qtree with the keyword if the regular expression matches */
-		tagsistant_keyword_matcher(regex, namespace, keywords[c].keyword, keywords[c].value, qtree);
+	guint c = 0;
+	for (; c < keywords->list->len; c++) {
+		tagsistant_keyword *keyword = &g_array_index(keywords->list, tagsistant_keyword, c);
+
+		gboolean matches = filter->match_all ||
+			(filter->listed
+				? (g_array_index(keywords->masks, guint64, c) & filter->bit) != 0
+				: g_regex_match(regex, keyword->keyword, 0, NULL));
+
+		/* tag the qtree with the keyword if the filter matches */
+		if (matches) {
+			tagsistant_keyword_apply(namespace, keyword->keyword, keyword->value, qtree);
+		} else {
+			dbg('p', LOG_INFO, "keyword %s refused by regular expression", keyword->keyword);
+		}
 	}
 }
 
@@ -410,19 +1666,13 @@ void tagsistant_plugin_iterator(
  * Return the value of a keyword from a keyword list, if available.
  *
  * @param keyword the keyword to fetch
- * @param keywords the linked list of EXTRACTOR_KeywordList object
+ * @param keywords the tagsistant_keywords list, or the keyword array of a version 0 plugin
  * @return the value of the keyword. This is a pointer to the original value and must not be modified or freed
  */
-const gchar *tagsistant_plugin_get_keyword_value(gchar *keyword, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+const gchar *tagsistant_plugin_get_keyword_value(gchar *keyword, tagsistant_keywords *keywords)
 {
-	int c = 0;
-	for (; c < TAGSISTANT_MAX_KEYWORDS; c++) {
-		if (g_strcmp0(keyword, keywords[c].keyword) == 0) {
-			return (keywords[c].value);
-		}
-	}
-
-	return (NULL);
+	keywords = tagsistant_keywords_resolve(keywords);
+	return (g_hash_table_lookup(keywords->index, keyword));
 }
 
 /**
@@ -437,33 +1687,44 @@ void tagsistant_plugin_tag_by_date(const tagsistant_querytree *qtree, const gcha
 	GError *error;
 
 	if (g_regex_match_full(tagsistant_rx_date, date, -1, 0, 0, &match_info, &error)) {
-		tagsistant_sql_tag_object(qtree->dbi, "time:", "year",   g_match_info_fetch(match_info, 1), qtree->inode);
-		tagsistant_sql_tag_object(qtree->dbi, "time:", "month",  g_match_info_fetch(match_info, 2), qtree->inode);
-		tagsistant_sql_tag_object(qtree->dbi, "time:", "day",    g_match_info_fetch(match_info, 3), qtree->inode);
-		tagsistant_sql_tag_object(qtree->dbi, "time:", "hour",   g_match_info_fetch(match_info, 4), qtree->inode);
-		tagsistant_sql_tag_object(qtree->dbi, "time:", "minute", g_match_info_fetch(match_info, 5), qtree->inode);
-//		tagsistant_sql_tag_object(qtree->dbi, "time:", "second", g_match_info_fetch(match_info, 6), qtree->inode);
+		static const gchar *fields[] = { "year", "month", "day", "hour", "minute", /* "second", */ NULL };
+		int f;
+		for (f = 0; fields[f]; f++) {
+			gchar *field = g_match_info_fetch(match_info, f + 1);
+			tagsistant_plugin_tag(qtree, "time:", fields[f], field);
+			g_free_null(field);
+		}
 	}
 
 	g_match_info_unref(match_info);
 }
 
+/**
+ * Discard a plugin which has been initialized but can't be registered:
+ * let it free its resources and unload it
+ *
+ * @param plugin the plugin (freed)
+ */
+static void tagsistant_plugin_discard(tagsistant_plugin_t *plugin)
+{
+	void (*free_function)() = dlsym(plugin->handle, "tagsistant_plugin_free");
+	if (free_function) free_function();
+
+	dlclose(plugin->handle);
+	g_free(plugin);
+}
+
 /**
  * Loads the plugins and do other initialization steps
  * like compiling recurring regular expressions
  */
 void tagsistant_plugin_loader()
 {
-#if TAGSISTANT_EXTRACTOR == 5 // libextractor 0.5.x
-	elist =  EXTRACTOR_loadDefaultLibraries();
-#else
-	plist = EXTRACTOR_plugin_add_defaults(EXTRACTOR_OPTION_DEFAULT_POLICY);
-#endif
-
 	/*
-	 * init processor mutex
+	 * libextractor is loaded by the extractor helpers; a helper dying
+	 * while its worker writes to it must not kill the whole process
 	 */
-	g_mutex_init(&tagsistant_processor_mutex);
+	signal(SIGPIPE, SIG_IGN);
 
 	/*
 	 * init some useful regex
@@ -472,7 +1733,20 @@ void tagsistant_plugin_loader()
 		"^([0-9][0-9][0-9][0-9]):([0-9][0-9]):([0-9][0-9]) ([0-9][0-9]):([0-9][0-9]):([0-9][0-9])$",
 		TAGSISTANT_RX_COMPILE_FLAGS, 0, NULL);
 
-	tagsistant_rx_cleaner = g_regex_new("[/ ]", 0, 0, NULL);
+	/*
+	 * the translation table used to clean keywords and values
+	 */
+	int byte;
+	for (byte = 0; byte < 256; byte++) tagsistant_tag_cleaner[byte] = (gchar) byte;
+	tagsistant_tag_cleaner['/'] = '-';
+	tagsistant_tag_cleaner[' '] = '-';
+
+	/*
+	 * setup the keyword filters
+	 */
+	tagsistant_keyword_filters = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	tagsistant_keyword_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	tagsistant_keyword_folded_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
 	/*
 	 * get the plugin dir from the environment variable
@@ -557,7 +1831,9 @@ void tagsistant_plugin_loader()
 							 * if init failed, ignore this plugin
 							 */
 							dbg('p', LOG_ERR, " *** error calling plugin_init() on %s ***\n", de->d_name);
+							dlclose(plugin->handle);
 							g_free_null(plugin);
+							g_free_null(pname);
 							continue;
 						}
 					}
@@ -569,16 +1845,34 @@ void tagsistant_plugin_loader()
 					if (plugin->mime_type == NULL) {
 						if (!tagsistant.quiet)
 							fprintf(stderr, " *** error finding %s processor function: %s ***\n", de->d_name, dlerror());
-						g_free_null(plugin);
+						tagsistant_plugin_discard(plugin);
 					} else {
 						/*
-						 * search for processor function
+						 * search for processor function, according to the
+						 * interface version declared by the plugin; the
+						 * plugins not declaring it use the original one
 						 */
-						plugin->processor = dlsym(plugin->handle, "tagsistant_processor");
-						if (plugin->processor == NULL) {
+						int *abi = dlsym(plugin->handle, "tagsistant_plugin_abi");
+						plugin->abi = abi ? *abi : 0;
+
+						if (plugin->abi < 0 || plugin->abi > TAGSISTANT_PLUGIN_ABI) {
+							if (!tagsistant.quiet)
+								fprintf(stderr, " *** plugin %s requires interface version %d ***\n", de->d_name, plugin->abi);
+						} else if (plugin->abi == 2) {
+							int *capabilities = dlsym(plugin->handle, "tagsistant_plugin_capabilities");
+							plugin->capabilities = capabilities ? *capabilities : 0;
+							plugin->processor_v2 = dlsym(plugin->handle, "tagsistant_processor_v2");
+							plugin->chunk = dlsym(plugin->handle, "tagsistant_processor_chunk");
+						} else if (plugin->abi == 1) {
+							plugin->processor = dlsym(plugin->handle, "tagsistant_processor");
+						} else {
+							plugin->legacy_processor = dlsym(plugin->handle, "tagsistant_processor");
+						}
+
+						if (plugin->processor == NULL && plugin->processor_v2 == NULL && plugin->legacy_processor == NULL) {
 							if (!tagsistant.quiet)
 								fprintf(stderr, " *** error finding %s processor function: %s ***\n", de->d_name, dlerror());
-							g_free_null(plugin);
+							tagsistant_plugin_discard(plugin);
 						} else {
 							plugin->free = dlsym(plugin->handle, "tagsistant_plugin_free");
 							if (plugin->free == NULL) {
@@ -604,6 +1898,8 @@ void tagsistant_plugin_loader()
 	}
 
 	g_free_null(tagsistant_plugins);
+
+	tagsistant_plugin_build_dispatch_table();
 }
 
 /**
@@ -627,6 +1923,11 @@ void tagsistant_plugin_unloader()
 	}
 
 	g_regex_unref(tagsistant_rx_date);
+
+	g_hash_table_destroy(tagsistant_plugin_dispatch);
+	g_hash_table_destroy(tagsistant_keyword_filters);
+	g_hash_table_destroy(tagsistant_keyword_names);
+	g_hash_table_destroy(tagsistant_keyword_folded_names);
 }
 
 /**
@@ -657,7 +1958,7 @@ void tagsistant_plugin_apply_regex(const tagsistant_querytree *qtree, const char
 
 		int x = 0;
 		while (tokens[x]) {
-			if (strlen(tokens[x]) >= 3) tagsistant_sql_tag_object(qtree->dbi, tokens[x], NULL, NULL, qtree->inode);
+			if (strlen(tokens[x]) >= 3) tagsistant_plugin_tag(qtree, tokens[x], NULL, NULL);
 			x++;
 		}
 
@@ -30,14 +30,126 @@
 /* flags suggested to compile regular expressions passed to tagsistant_plugin_iterator */
 #define TAGSISTANT_RX_COMPILE_FLAGS G_REGEX_CASELESS|G_REGEX_EXTENDED|G_REGEX_OPTIMIZE
 
+/* maximum number of keywords kept for a single file */
 #define TAGSISTANT_MAX_KEYWORDS 1024
+
+/* maximum length of a keyword passed to version 0 plugins, and of its value */
 #define TAGSISTANT_MAX_KEYWORD_LENGTH 256
 
+/**
+ * a keyword as passed to version 0 plugins, in an array of
+ * TAGSISTANT_MAX_KEYWORDS items ended by an empty keyword
+ */
 typedef struct {
 	gchar keyword[TAGSISTANT_MAX_KEYWORD_LENGTH];
 	gchar value[TAGSISTANT_MAX_KEYWORD_LENGTH];
+} tagsistant_legacy_keyword;
+
+/** a keyword extracted from a file */
+typedef struct {
+	const gchar *keyword;
+	const gchar *value;
 } tagsistant_keyword;
 
+/**
+ * the keywords extracted from a file; the strings are stored in a
+ * per-file arena and the keywords are indexed by name
+ */
+typedef struct {
+	/** the tagsistant_keyword items, in order of extraction */
+	GArray *list;
+
+	/** maps each keyword name to the value of its first occurrence */
+	GHashTable *index;
+
+	/** holds the strings of the keywords */
+	GStringChunk *arena;
+
+	/** the keyword filters matched by each keyword, as a bit mask */
+	GArray *masks;
+
+	/** the number of keyword filters known when the masks were computed */
+	guint masked_filters;
+} tagsistant_keywords;
+
+/*
+ * Plugin interface versions
+ *
+ * A plugin declares its interface version by exporting
+ * "int tagsistant_plugin_abi":
+ *
+ * 0: tagsistant_processor(qtree, tagsistant_legacy_keyword keywords[]),
+ *    the original interface, assumed when tagsistant_plugin_abi is
+ *    missing. The keywords are copied into a fixed array.
+ * 1: tagsistant_processor(qtree, tagsistant_keywords *keywords), taking
+ *    the keyword list as extracted.
+ * 2: tagsistant_processor_v2(job), declaring what it needs in
+ *    "int tagsistant_plugin_capabilities".
+ */
+#define TAGSISTANT_PLUGIN_ABI 2
+
+/* capabilities declared by version 2 plugins */
+#define TP_CAP_CONTENT	0x01	/**< the plugin reads the contents of the file through job->content (up to 16 MiB) */
+#define TP_CAP_STREAM	0x02	/**< the plugin exports tagsistant_processor_chunk() to be fed the contents */
+
+/* size of the chunks passed to tagsistant_processor_chunk() */
+#define TAGSISTANT_PLUGIN_CHUNK_SIZE (64 * 1024)
+
+/** a read-only view of the contents of a file, shared by all the plugins of a chain */
+typedef struct {
+	/** the contents, NULL if the file is empty or can't be read */
+	const guchar *data;
+
+	/** the length of data */
+	gsize size;
+} tagsistant_content;
+
+/** the handle used by version 2 plugins to tag the object */
+typedef struct {
+	/** the querytree of the object */
+	const tagsistant_querytree *qtree;
+
+	/** the number of tags emitted so far */
+	guint count;
+} tagsistant_tag_emitter;
+
+/** the file being processed, as seen by a version 2 plugin */
+typedef struct {
+	/** the querytree object of the file */
+	tagsistant_querytree *qtree;
+
+	/** the keywords extracted from the file */
+	tagsistant_keywords *keywords;
+
+	/** the contents of the file, filled only for TP_CAP_CONTENT plugins; empty if larger than 16 MiB */
+	tagsistant_content content;
+
+	/** where to send the tags */
+	tagsistant_tag_emitter *emitter;
+
+	/**
+	 * free for the plugin to keep its state between the chunks and
+	 * processor_v2(), which must free it; NULL when the plugin is called
+	 */
+	gpointer plugin_data;
+
+	/** the file under archive/ (private) */
+	const gchar *full_archive_path;
+
+	/** the contents already in memory or read for the plugins (private) */
+	const guchar *data;
+	gsize size;
+
+	/** the contents read for the plugins, if any (private) */
+	GByteArray *buffer;
+
+	/** TRUE once the contents have been looked for (private) */
+	gboolean content_loaded;
+
+	/** the keywords copied for version 0 plugins, if any (private) */
+	tagsistant_legacy_keyword *legacy_keywords;
+} tagsistant_plugin_job;
+
 /**
  * holds a pointer to a processing function
  * exported by a plugin
@@ -56,13 +168,47 @@ typedef struct tagsistant_plugin {
 	 * hook to processing function
 	 *
 	 * @param qtree the querytree object
-	 * @param keywords an array of tagsistant_keyword to be applied to the qtree object
+	 * @param keywords the tagsistant_keywords to be applied to the qtree object
 	 * @return 0 on failure (the plugin wasn't unable to process the file), 1 on
 	 *   partial success (the plugin did processed the file, but later processing
 	 *   by other plugins is allowed) or 2 on successful processing (no further
 	 *   processing required).
 	 */
-	int (*processor)(tagsistant_querytree *qtree, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS]);
+	int (*processor)(tagsistant_querytree *qtree, tagsistant_keywords *keywords);
+
+	/**
+	 * hook to the processing function of a version 0 plugin
+	 *
+	 * @param qtree the querytree object
+	 * @param keywords the keywords, ended by an empty one
+	 * @return TP_ERROR, TP_OK, TP_STOP or TP_NULL, as processor()
+	 */
+	int (*legacy_processor)(tagsistant_querytree *qtree, tagsistant_legacy_keyword keywords[TAGSISTANT_MAX_KEYWORDS]);
+
+	/** the plugin interface version, 0 if not declared */
+	int abi;
+
+	/** the TP_CAP_* flags declared by a version 2 plugin */
+	int capabilities;
+
+	/**
+	 * hook to the processing function of a version 2 plugin
+	 *
+	 * @param job the file being processed
+	 * @return TP_ERROR, TP_OK, TP_STOP or TP_NULL, as processor()
+	 */
+	int (*processor_v2)(tagsistant_plugin_job *job);
+
+	/**
+	 * hook to the streaming function of a TP_CAP_STREAM plugin, called
+	 * with consecutive chunks of the contents before processor_v2()
+	 *
+	 * @param job the file being processed
+	 * @param chunk the next chunk of the contents
+	 * @param length the length of chunk
+	 * @return TRUE to get the next chunk, FALSE to stop streaming
+	 */
+	gboolean (*chunk)(tagsistant_plugin_job *job, const guchar *chunk, gsize length);
 
 	/**
 	 * hook to g_free allocated resources
@@ -73,14 +219,35 @@ typedef struct tagsistant_plugin {
 	struct tagsistant_plugin *next;
 } tagsistant_plugin_t;
 
+extern tagsistant_keywords *tagsistant_keywords_new();
+extern void tagsistant_keywords_add(tagsistant_keywords *keywords, const gchar *keyword, const gchar *value);
+extern void tagsistant_keywords_free(tagsistant_keywords *keywords);
+
 extern void tagsistant_plugin_iterator(
 	const tagsistant_querytree *qtree,
 	const gchar *namespace,
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS],
+	tagsistant_keywords *keywords,
 	GRegex *regex);
 
 extern const gchar *tagsistant_plugin_get_keyword_value(
 	gchar *keyword,
-	tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS]);
+	tagsistant_keywords *keywords);
+
+extern void tagsistant_plugin_tag(
+	const tagsistant_querytree *qtree,
+	const gchar *tagname,
+	const gchar *key,
+	const gchar *value);
+
+extern gboolean tagsistant_plugin_collect_tag(
+	const gchar *tagname,
+	const gchar *key,
+	const gchar *value);
+
+extern void tagsistant_emit_tag(
+	tagsistant_tag_emitter *emitter,
+	const gchar *tagname,
+	const gchar *key,
+	const gchar *value);
 
 extern void tagsistant_plugin_tag_by_date(const tagsistant_querytree *qtree, const gchar *date);
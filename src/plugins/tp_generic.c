@@ -35,8 +35,11 @@ int tagsistant_plugin_init()
 	return(1);
 }
 
+/* exported interface version */
+int tagsistant_plugin_abi = 1;
+
 /* exported processor function */
-int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keywords *keywords)
 {
 	tagsistant_plugin_iterator(qtree, "autotagging:", keywords, rx);
 	return(TP_OK);
@@ -37,11 +37,14 @@ int tagsistant_plugin_init()
 	return(1);
 }
 
+/* exported interface version */
+int tagsistant_plugin_abi = 1;
+
 /* exported processor function */
-int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keywords *keywords)
 {
 	/* default tagging */
-	tagsistant_sql_tag_object(qtree->dbi, "image", NULL, NULL, qtree->inode);
+	tagsistant_plugin_tag(qtree, "image", NULL, NULL);
 
 	/* applying regular expression */
 	tagsistant_plugin_iterator(qtree, "image:", keywords, rx);
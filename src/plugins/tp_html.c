@@ -27,6 +27,12 @@ char mime_type[] = "text/html";
 /* regex */
 static GRegex *rx = NULL;
 
+/* matches the <meta name="keywords" content="..."> element */
+static GRegex *meta_rx = NULL;
+
+/* how much of the page is searched for the meta keywords */
+#define TP_HTML_HEAD_SIZE (64 * 1024)
+
 /* exported init function */
 int tagsistant_plugin_init()
 {
@@ -36,19 +42,34 @@ int tagsistant_plugin_init()
 
 	rx = g_regex_new(pattern, TAGSISTANT_RX_COMPILE_FLAGS, 0, NULL);
 
+	meta_rx = g_regex_new(
+		"<meta\\s+name\\s*=\\s*[\"']keywords[\"']\\s+content\\s*=\\s*[\"']([^\"'<>]*)[\"']",
+		TAGSISTANT_RX_COMPILE_FLAGS, 0, NULL);
+
 	return(1);
 }
 
+/* exported interface version and capabilities */
+int tagsistant_plugin_abi = 2;
+int tagsistant_plugin_capabilities = TP_CAP_CONTENT;
+
 /* exported processor function */
-int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+int tagsistant_processor_v2(tagsistant_plugin_job *job)
 {
 	/* default tagging */
-	tagsistant_sql_tag_object(qtree->dbi, "document", NULL, NULL, qtree->inode);
-	tagsistant_sql_tag_object(qtree->dbi, "webpage", NULL, NULL, qtree->inode);
-	tagsistant_sql_tag_object(qtree->dbi, "html", NULL, NULL, qtree->inode);
+	tagsistant_emit_tag(job->emitter, "document", NULL, NULL);
+	tagsistant_emit_tag(job->emitter, "webpage", NULL, NULL);
+	tagsistant_emit_tag(job->emitter, "html", NULL, NULL);
 
 	/* apply regular expressions to document content */
-	tagsistant_plugin_iterator(qtree, "document:", keywords, rx);
+	tagsistant_plugin_iterator(job->qtree, "document:", job->keywords, rx);
+
+	/* tag the keywords declared in the head of the page */
+	if (job->content.data) {
+		gchar *head = g_strndup((const gchar *) job->content.data, MIN(job->content.size, TP_HTML_HEAD_SIZE));
+		if (g_utf8_validate(head, -1, NULL)) tagsistant_plugin_apply_regex(job->qtree, head, NULL, meta_rx);
+		g_free(head);
+	}
 
 	return(TP_STOP);
 }
@@ -58,6 +79,7 @@ void tagsistant_plugin_free()
 {
 	/* unreference regular expressions */
 	g_regex_unref(rx);
+	g_regex_unref(meta_rx);
 }
 
 /* vim:ts=4:autoindent:nocindent:syntax=c */
@@ -26,6 +26,28 @@ char mime_type[] = "application/xml";
 
 static GRegex *rx;
 
+/* the states of the search for the root element */
+enum {
+	TP_XML_TEXT,	/* outside any tag */
+	TP_XML_OPEN,	/* after a '<' */
+	TP_XML_SKIP,	/* inside a declaration, a processing instruction or a comment */
+	TP_XML_NAME,	/* inside the name of the root element */
+	TP_XML_DONE		/* the root element has been found */
+};
+
+/* the longest root element name used as a tag */
+#define TP_XML_MAX_NAME 64
+
+/* how much of the file is searched for the root element */
+#define TP_XML_SCAN_LIMIT (1024 * 1024)
+
+/* the search for the root element, carried across the chunks */
+typedef struct {
+	int state;
+	gsize scanned;
+	GString *name;
+} tp_xml_scan;
+
 /* exported init function */
 int tagsistant_plugin_init()
 {
@@ -37,14 +59,76 @@ int tagsistant_plugin_init()
 	return(1);
 }
 
+/* exported interface version and capabilities */
+int tagsistant_plugin_abi = 2;
+int tagsistant_plugin_capabilities = TP_CAP_STREAM;
+
+/* exported streaming function: look for the name of the root element */
+gboolean tagsistant_processor_chunk(tagsistant_plugin_job *job, const guchar *chunk, gsize length)
+{
+	tp_xml_scan *scan = (tp_xml_scan *) job->plugin_data;
+	if (!scan) {
+		scan = g_new0(tp_xml_scan, 1);
+		scan->name = g_string_sized_new(TP_XML_MAX_NAME);
+		job->plugin_data = scan;
+	}
+
+	gsize i;
+	for (i = 0; i < length && TP_XML_DONE != scan->state; i++) {
+		guchar c = chunk[i];
+
+		switch (scan->state) {
+			case TP_XML_TEXT:
+				if ('<' == c) scan->state = TP_XML_OPEN;
+				break;
+			case TP_XML_OPEN:
+				if ('?' == c || '!' == c) {
+					scan->state = TP_XML_SKIP;
+				} else if (g_ascii_isalpha(c) || '_' == c || c >= 0x80) {
+					g_string_append_c(scan->name, c);
+					scan->state = TP_XML_NAME;
+				} else {
+					scan->state = TP_XML_TEXT;
+				}
+				break;
+			case TP_XML_SKIP:
+				if ('>' == c) scan->state = TP_XML_TEXT;
+				break;
+			case TP_XML_NAME:
+				if ((g_ascii_isalnum(c) || '_' == c || '-' == c || '.' == c || ':' == c || c >= 0x80) && scan->name->len < TP_XML_MAX_NAME) {
+					g_string_append_c(scan->name, c);
+				} else {
+					scan->state = TP_XML_DONE;
+				}
+				break;
+		}
+	}
+
+	scan->scanned += length;
+
+	/* stop reading once found, or when it's not going to be found */
+	return (TP_XML_DONE != scan->state && scan->scanned < TP_XML_SCAN_LIMIT);
+}
+
 /* exported processor function */
-int tagsistant_processor(tagsistant_querytree *qtree, tagsistant_keyword keywords[TAGSISTANT_MAX_KEYWORDS])
+int tagsistant_processor_v2(tagsistant_plugin_job *job)
 {
 	/* default tagging */
-	tagsistant_sql_tag_object(qtree->dbi, "document", NULL, NULL, qtree->inode);
+	tagsistant_emit_tag(job->emitter, "document", NULL, NULL);
 
 	/* applying regular expression */
-	tagsistant_plugin_iterator(qtree, "document:", keywords, rx);
+	tagsistant_plugin_iterator(job->qtree, "document:", job->keywords, rx);
+
+	/* tag the name of the root element found while streaming */
+	tp_xml_scan *scan = (tp_xml_scan *) job->plugin_data;
+	if (scan) {
+		if (TP_XML_DONE == scan->state && g_utf8_validate(scan->name->str, -1, NULL))
+			tagsistant_emit_tag(job->emitter, "document:", "root", scan->name->str);
+
+		g_string_free(scan->name, TRUE);
+		g_free(scan);
+		job->plugin_data = NULL;
+	}
 
 	return(TP_STOP);
 }
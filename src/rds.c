@@ -0,0 +1,422 @@
+/*
+   Tagsistant (tagfs) -- rds.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Compute the result data set (RDS) of a complete store/ query:
+   the objects matching every tag of at least one and-set.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "tagsistant.h"
+
+/**
+ * context passed to tagsistant_RDS_add_object() SQL callback
+ */
+typedef struct {
+	GHashTable *rds;			/**< the result data set: objectname -> GList of tagsistant_file_handle */
+	qtree_and_node *and_set;	/**< the and-set the objects are selected by */
+	dbi_conn conn;				/**< the DBI connection */
+} tagsistant_RDS_context;
+
+/**
+ * SQL callback. Append a tag_id to a comma separated list
+ *
+ * @param ids_pointer a GString holding the list
+ * @param result dbi_result pointer
+ * @return 0 always, due to SQLite policy, may change in the future
+ */
+static int tagsistant_RDS_append_tag_id(void *ids_pointer, dbi_result result)
+{
+	GString *ids = (GString *) ids_pointer;
+	tagsistant_tag_id tag_id = 0;
+
+	tagsistant_return_integer(&tag_id, result);
+	if (tag_id) g_string_append_printf(ids, ",%u", tag_id);
+
+	return (0);
+}
+
+/**
+ * Append to a comma separated list the tag_ids matched by a
+ * single qtree_and_node, resolving triple tag operators
+ *
+ * @param ids the GString holding the list
+ * @param node the qtree_and_node
+ * @param conn a DBI connection
+ */
+static void tagsistant_RDS_compile_single_node(GString *ids, qtree_and_node *node, dbi_conn conn)
+{
+	/* flat tags, eq/ triple tags and reasoned tags are resolved at parse time */
+	if (node->tag || !node->namespace) {
+		if (node->tag_id) g_string_append_printf(ids, ",%u", node->tag_id);
+		return;
+	}
+
+	/* partial triple tags match the whole namespace or the whole key */
+	if (!node->key) {
+		tagsistant_query(
+			"select tag_id from tags where tagname = '%s'",
+			conn, tagsistant_RDS_append_tag_id, ids, node->namespace);
+		return;
+	}
+
+	if (!node->value) {
+		tagsistant_query(
+			"select tag_id from tags where tagname = '%s' and `key` = '%s'",
+			conn, tagsistant_RDS_append_tag_id, ids, node->namespace, node->key);
+		return;
+	}
+
+	switch (node->operator) {
+		case TAGSISTANT_CONTAINS:
+			{
+				/* narrow the scan using the trigram index, when available */
+				gchar *candidates = tagsistant_sql_trigram_filter(node->value);
+				if (candidates) {
+					tagsistant_query(
+						"select tag_id from tags where tag_id in (%s) and tagname = '%s' and `key` = '%s' and value like '%%%s%%'",
+						conn, tagsistant_RDS_append_tag_id, ids, candidates, node->namespace, node->key, node->value);
+					g_free_null(candidates);
+				} else {
+					tagsistant_query(
+						"select tag_id from tags where tagname = '%s' and `key` = '%s' and value like '%%%s%%'",
+						conn, tagsistant_RDS_append_tag_id, ids, node->namespace, node->key, node->value);
+				}
+			}
+			break;
+
+		case TAGSISTANT_GREATER_THAN:
+			tagsistant_query(
+				"select tag_id from tags where tagname = '%s' and `key` = '%s' and value > '%s'",
+				conn, tagsistant_RDS_append_tag_id, ids, node->namespace, node->key, node->value);
+			break;
+
+		case TAGSISTANT_SMALLER_THAN:
+			tagsistant_query(
+				"select tag_id from tags where tagname = '%s' and `key` = '%s' and value < '%s'",
+				conn, tagsistant_RDS_append_tag_id, ids, node->namespace, node->key, node->value);
+			break;
+
+		default:
+			if (node->tag_id) g_string_append_printf(ids, ",%u", node->tag_id);
+			break;
+	}
+}
+
+/**
+ * Build a comma separated list of all the tag_ids matched by
+ * an and-node and by its related (tag group or reasoned) nodes.
+ * The list always starts with 0, which matches no tag, so it's
+ * never empty.
+ *
+ * @param node the qtree_and_node
+ * @param conn a DBI connection
+ * @return a string to be freed with g_free()
+ */
+static gchar *tagsistant_RDS_compile_node(qtree_and_node *node, dbi_conn conn)
+{
+	GString *ids = g_string_new("0");
+
+	while (node) {
+		tagsistant_RDS_compile_single_node(ids, node, conn);
+		node = node->related;
+	}
+
+	return (g_string_free(ids, FALSE));
+}
+
+/**
+ * Build a comma separated list of all the tag_ids negated inside
+ * an and-set, by the -/ operator or by the reasoner through the
+ * excludes relation, including their related tags.
+ *
+ * @param and_set the and-set
+ * @param conn a DBI connection
+ * @return a string to be freed with g_free() or NULL if nothing is negated
+ */
+gchar *tagsistant_RDS_compile_negations(qtree_and_node *and_set, dbi_conn conn)
+{
+	GString *ids = NULL;
+
+	while (and_set) {
+		qtree_and_node *negated = and_set->negated;
+		while (negated) {
+			if (!ids) ids = g_string_new("0");
+
+			qtree_and_node *related = negated;
+			while (related) {
+				tagsistant_RDS_compile_single_node(ids, related, conn);
+				related = related->related;
+			}
+
+			negated = negated->negated;
+		}
+		and_set = and_set->next;
+	}
+
+	return (ids ? g_string_free(ids, FALSE) : NULL);
+}
+
+/**
+ * Add an object to a result data set, unless the same inode is already listed
+ *
+ * @param rds the result data set
+ * @param fh the tagsistant_file_handle describing the object
+ * @return 1 if the object has been added, 0 if it was a duplicate
+ */
+static int tagsistant_RDS_add_file_handle(GHashTable *rds, tagsistant_file_handle *fh)
+{
+	/* skip objects already listed by another and-set */
+	GList *list = g_hash_table_lookup(rds, fh->name);
+	GList *ptr = list;
+	while (ptr) {
+		if (((tagsistant_file_handle *) ptr->data)->inode == fh->inode) return (0);
+		ptr = ptr->next;
+	}
+
+	/* the key is freed by the hash table if already present */
+	list = g_list_prepend(list, fh);
+	g_hash_table_insert(rds, g_strdup(fh->name), list);
+
+	return (1);
+}
+
+/**
+ * SQL callback. Add an object to the result data set
+ *
+ * @param context_pointer a tagsistant_RDS_context pointer cast to void*
+ * @param result dbi_result pointer
+ * @return 0 always, due to SQLite policy, may change in the future
+ */
+static int tagsistant_RDS_add_object(void *context_pointer, dbi_result result)
+{
+	tagsistant_RDS_context *context = (tagsistant_RDS_context *) context_pointer;
+
+	tagsistant_inode inode = 0;
+	tagsistant_return_integer(&inode, result);
+
+	const gchar *objectname = dbi_result_get_string_idx(result, 2);
+	if (!inode || !objectname) return (0);
+
+	tagsistant_file_handle *fh = g_new0(tagsistant_file_handle, 1);
+	if (!fh) {
+		dbg('f', LOG_ERR, "Error allocating memory");
+		return (0);
+	}
+
+	g_strlcpy(fh->name, objectname, 1024);
+	fh->inode = inode;
+
+	if (!tagsistant_RDS_add_file_handle(context->rds, fh)) g_free(fh);
+
+	return (0);
+}
+
+/**
+ * Add to the result data set the objects matching an and-set
+ *
+ * @param context the RDS context
+ */
+static void tagsistant_RDS_add_and_set(tagsistant_RDS_context *context)
+{
+	GString *conditions = g_string_sized_new(1024);
+
+	qtree_and_node *and_set = context->and_set;
+	while (and_set) {
+		gchar *ids = tagsistant_RDS_compile_node(and_set, context->conn);
+		g_string_append_printf(conditions, " and objects.inode in (select inode from tagging where tag_id in (%s))", ids);
+		g_free_null(ids);
+
+		and_set = and_set->next;
+	}
+
+	/*
+	 * negated tags are subtracted from the whole and-set at once
+	 * by an anti-join, rather than checking each object
+	 */
+	gchar *negated_ids = tagsistant_RDS_compile_negations(context->and_set, context->conn);
+	if (negated_ids) {
+		g_string_append_printf(conditions,
+			" and not exists (select 1 from tagging where tagging.inode = objects.inode and tagging.tag_id in (%s))",
+			negated_ids);
+		g_free_null(negated_ids);
+	}
+
+	tagsistant_query(
+		"select objects.inode, objects.objectname from objects where 1 %s",
+		context->conn,
+		tagsistant_RDS_add_object,
+		context,
+		conditions->str);
+
+	g_string_free(conditions, TRUE);
+}
+
+/**
+ * an or-branch of a query, evaluated by a worker thread
+ */
+typedef struct {
+	qtree_and_node *and_set;	/**< the and-set of the branch */
+	GHashTable *rds;			/**< the partial result data set of the branch */
+	GAsyncQueue *done;			/**< where the branch is pushed back once evaluated */
+} tagsistant_RDS_branch;
+
+/** the worker threads evaluating or-branches */
+static GThreadPool *tagsistant_RDS_pool = NULL;
+
+/**
+ * Evaluate an or-branch on a connection of its own
+ *
+ * @param data the tagsistant_RDS_branch to evaluate
+ * @param user_data unused
+ */
+static void tagsistant_RDS_branch_worker(gpointer data, gpointer user_data)
+{
+	(void) user_data;
+
+	tagsistant_RDS_branch *branch = (tagsistant_RDS_branch *) data;
+	tagsistant_RDS_context context;
+
+	context.rds = branch->rds;
+	context.and_set = branch->and_set;
+	context.conn = tagsistant_db_worker_connection();
+
+	tagsistant_RDS_add_and_set(&context);
+
+	tagsistant_db_worker_connection_release(context.conn);
+	g_async_queue_push(branch->done, branch);
+}
+
+/**
+ * Merge the objects of a partial result data set into the final one,
+ * dropping the inodes already listed by other branches.
+ * Called by g_hash_table_foreach() on the partial result data set.
+ *
+ * @param name unused
+ * @param list the GList of tagsistant_file_handle of the partial data set
+ * @param rds the final result data set
+ */
+static void tagsistant_RDS_merge(gchar *name, GList *list, GHashTable *rds)
+{
+	(void) name;
+
+	GList *ptr = list;
+	while (ptr) {
+		if (!tagsistant_RDS_add_file_handle(rds, ptr->data)) g_free(ptr->data);
+		ptr = ptr->next;
+	}
+
+	g_list_free(list);
+}
+
+/**
+ * Initialize the pool of threads evaluating the or-branches of a query
+ */
+void tagsistant_RDS_init()
+{
+#if TAGSISTANT_REENTRANT_DBI
+	tagsistant_RDS_pool = g_thread_pool_new(tagsistant_RDS_branch_worker, NULL, g_get_num_processors(), FALSE, NULL);
+#endif
+}
+
+/**
+ * Build the result data set of a query
+ *
+ * @param query the query tree
+ * @param conn a DBI connection
+ * @param is_all_path true if the query contains the ALL/ meta-tag
+ * @return a GHashTable of GLists of tagsistant_file_handle, keyed by object name
+ */
+GHashTable *tagsistant_RDS_new(qtree_or_node *query, dbi_conn conn, int is_all_path)
+{
+	tagsistant_RDS_context context;
+
+	context.rds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	context.and_set = NULL;
+	context.conn = conn;
+
+	if (is_all_path) {
+		dbg('f', LOG_INFO, "Listing all the objects");
+		tagsistant_query(
+			"select inode, objectname from objects",
+			conn, tagsistant_RDS_add_object, &context);
+		return (context.rds);
+	}
+
+	/* count the or-branches */
+	guint branches = 0;
+	qtree_or_node *or_node = query;
+	while (or_node) {
+		if (or_node->and_set) branches++;
+		or_node = or_node->next;
+	}
+
+	if (branches > 1 && tagsistant_RDS_pool) {
+		/*
+		 * evaluate each or-branch concurrently on a pooled connection
+		 * and merge the partial results as they come back
+		 */
+		GAsyncQueue *done = g_async_queue_new();
+
+		for (or_node = query; or_node; or_node = or_node->next) {
+			if (!or_node->and_set) continue;
+
+			tagsistant_RDS_branch *branch = g_new0(tagsistant_RDS_branch, 1);
+			branch->and_set = or_node->and_set;
+			branch->rds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+			branch->done = done;
+
+			g_thread_pool_push(tagsistant_RDS_pool, branch, NULL);
+		}
+
+		while (branches--) {
+			tagsistant_RDS_branch *branch = (tagsistant_RDS_branch *) g_async_queue_pop(done);
+			g_hash_table_foreach(branch->rds, (GHFunc) tagsistant_RDS_merge, context.rds);
+			g_hash_table_destroy(branch->rds);
+			g_free(branch);
+		}
+
+		g_async_queue_unref(done);
+	} else {
+		while (query) {
+			if (query->and_set) {
+				context.and_set = query->and_set;
+				tagsistant_RDS_add_and_set(&context);
+			}
+			query = query->next;
+		}
+	}
+
+	dbg('f', LOG_INFO, "Result data set holds %u names", g_hash_table_size(context.rds));
+
+	return (context.rds);
+}
+
+/**
+ * Free the GList values of a result data set. Should be
+ * called by g_hash_table_foreach() before destroying the table.
+ *
+ * @param key unused
+ * @param list the GList of tagsistant_file_handle
+ * @param data unused
+ */
+void tagsistant_RDS_destroy_value_list(gchar *key, GList *list, gpointer data)
+{
+	(void) key;
+	(void) data;
+
+	g_list_free_full(list, (GDestroyNotify) g_free);
+}
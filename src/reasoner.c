@@ -28,27 +28,488 @@
 /***                                                                              ***/
 /************************************************************************************/
 
-static GHashTable *tagsistant_reasoner_cache;
-
+/**
+ * A reasoned tag. The strings come from the reasoner string pool and
+ * each copy of the tag holds a reference to them. A flat tag has empty
+ * namespace, key and value; a triple tag has an empty tag.
+ */
 typedef struct {
 	tagsistant_tag_id tag_id;
 
-	gchar tag[1024];
-	gchar namespace[1024];
-	gchar key[1024];
-	gchar value[1024];
+	const gchar *tag;
+	const gchar *namespace;
+	const gchar *key;
+	const gchar *value;
 
 } tagsistant_tag;
 
+/**
+ * The strings of the reasoned tags, shared by the dictionary, the
+ * reasoner cache and the reasoned nodes of the query trees, which hold
+ * a reference each: string -> reference count. A string is freed with
+ * its last reference, so the pool follows the dictionary, which is
+ * dropped on every change of the relations graph, instead of keeping
+ * every name ever reasoned like g_intern_string() would.
+ */
+static GHashTable *tagsistant_reasoner_strings = NULL;
+static GMutex tagsistant_reasoner_strings_mutex;
+
+/**
+ * Take a reference to a string of the pool, adding it if missing
+ *
+ * @param string the string, NULL is taken as an empty string
+ * @return the pooled copy of the string
+ */
+static const gchar *tagsistant_reasoner_string_ref(const gchar *string)
+{
+	gpointer pooled = NULL, count = NULL;
+
+	if (!string) string = "";
+
+	g_mutex_lock(&tagsistant_reasoner_strings_mutex);
+
+	if (!tagsistant_reasoner_strings)
+		tagsistant_reasoner_strings = g_hash_table_new(g_str_hash, g_str_equal);
+
+	if (g_hash_table_lookup_extended(tagsistant_reasoner_strings, string, &pooled, &count)) {
+		g_hash_table_insert(tagsistant_reasoner_strings, pooled, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+	} else {
+		pooled = g_strdup(string);
+		g_hash_table_insert(tagsistant_reasoner_strings, pooled, GUINT_TO_POINTER(1));
+	}
+
+	g_mutex_unlock(&tagsistant_reasoner_strings_mutex);
+
+	return ((const gchar *) pooled);
+}
+
+/**
+ * Drop a reference to a string of the pool, freeing it with the last one
+ *
+ * @param string the pooled string
+ */
+static void tagsistant_reasoner_string_unref(const gchar *string)
+{
+	gpointer pooled = NULL, count = NULL;
+
+	if (!string) return;
+
+	g_mutex_lock(&tagsistant_reasoner_strings_mutex);
+
+	if (g_hash_table_lookup_extended(tagsistant_reasoner_strings, string, &pooled, &count)) {
+		if (GPOINTER_TO_UINT(count) > 1) {
+			g_hash_table_insert(tagsistant_reasoner_strings, pooled, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+		} else {
+			g_hash_table_remove(tagsistant_reasoner_strings, pooled);
+			g_free(pooled);
+		}
+	}
+
+	g_mutex_unlock(&tagsistant_reasoner_strings_mutex);
+}
+
+/**
+ * Take a reference to the strings of a reasoned tag
+ *
+ * @param T the reasoned tag
+ */
+static void tagsistant_tag_ref(tagsistant_tag *T)
+{
+	T->tag = tagsistant_reasoner_string_ref(T->tag);
+	T->namespace = tagsistant_reasoner_string_ref(T->namespace);
+	T->key = tagsistant_reasoner_string_ref(T->key);
+	T->value = tagsistant_reasoner_string_ref(T->value);
+}
+
+/**
+ * Drop the references to the strings of a reasoned tag
+ *
+ * @param T the reasoned tag
+ */
+static void tagsistant_tag_unref(tagsistant_tag *T)
+{
+	tagsistant_reasoner_string_unref(T->tag);
+	tagsistant_reasoner_string_unref(T->namespace);
+	tagsistant_reasoner_string_unref(T->key);
+	tagsistant_reasoner_string_unref(T->value);
+}
+
+/**
+ * Destroy a reasoned tag of the dictionary
+ *
+ * @param data pointer to tagsistant_tag
+ */
+static void tagsistant_tag_destroy(gpointer data)
+{
+	tagsistant_tag_unref((tagsistant_tag *) data);
+	g_free(data);
+}
+
+/**
+ * Free a GArray of tagsistant_tag, dropping the references of its tags
+ *
+ * @param tags the GArray of tagsistant_tag
+ */
+static void tagsistant_tag_list_free(GArray *tags)
+{
+	guint i;
+	for (i = 0; i < tags->len; i++)
+		tagsistant_tag_unref(&g_array_index(tags, tagsistant_tag, i));
+
+	g_array_free(tags, TRUE);
+}
+
+/**
+ * Drop the references to the strings of a reasoned node of a query
+ * tree, called when the node is destroyed
+ *
+ * @param node the qtree_and_node added by the reasoner
+ */
+void tagsistant_reasoner_node_release(qtree_and_node *node)
+{
+	tagsistant_reasoner_string_unref(node->tag);
+	tagsistant_reasoner_string_unref(node->namespace);
+	tagsistant_reasoner_string_unref(node->key);
+	tagsistant_reasoner_string_unref(node->value);
+}
+
+/** the dictionary of the reasoned tags: tag_id -> tagsistant_tag */
+static GHashTable *tagsistant_reasoner_dictionary = NULL;
+static GRWLock tagsistant_reasoner_dictionary_lock;
+
+/**
+ * An entry of the reasoner cache: the tags reasoned from a tag_id
+ * when the relations graph was at a given generation
+ */
+typedef struct {
+	gint generation;
+	GArray *related;
+	GArray *excluded;
+} tagsistant_reasoner_cache_entry;
+
+/** the reasoner cache: tag_id -> tagsistant_reasoner_cache_entry */
+static GHashTable *tagsistant_reasoner_cache = NULL;
+static GRWLock tagsistant_reasoner_cache_lock;
+
+/** is the reasoner cache enabled in repository.ini? */
+static int tagsistant_reasoner_cache_enabled = 0;
+
+/** reasoner cache statistics */
+static gint tagsistant_reasoner_cache_hits = 0;
+static gint tagsistant_reasoner_cache_misses = 0;
+
+/**
+ * The generation of the relations graph, increased on every change.
+ * Cache entries computed on an older generation are never used.
+ */
+static gint tagsistant_relations_graph_generation = 0;
+
 /**
  * Destroy the values of the resoner cache.
  *
- * @param data pointer to GList
+ * @param data pointer to tagsistant_reasoner_cache_entry
  */
 void tagsistant_destroy_reasoner_value(gpointer data)
 {
-	GList *list = (GList *) data;
-	g_list_free_full(list, g_free);
+	tagsistant_reasoner_cache_entry *entry = (tagsistant_reasoner_cache_entry *) data;
+	tagsistant_tag_list_free(entry->related);
+	tagsistant_tag_list_free(entry->excluded);
+	g_free(entry);
+}
+
+/************************************************************************************/
+/***                                                                              ***/
+/*** Relations graph                                                              ***/
+/***                                                                              ***/
+/************************************************************************************/
+
+/**
+ * The kind of an edge of the relations graph. An is_equivalent relation
+ * is stored twice, as a direct edge on the first tag and as a reverse
+ * edge on the second one, so each relation row can be removed exactly.
+ */
+enum {
+	TAGSISTANT_EDGE_INCLUDES,
+	TAGSISTANT_EDGE_IS_EQUIVALENT,
+	TAGSISTANT_EDGE_IS_EQUIVALENT_REVERSE,
+	TAGSISTANT_EDGE_EXCLUDES
+};
+
+/**
+ * An edge of the relations graph
+ */
+typedef struct {
+	tagsistant_tag_id tag_id;
+	int kind;
+} tagsistant_relations_edge;
+
+/**
+ * A vertex of the relations graph. The related array holds the edges
+ * towards the tags included by or equivalent to this tag. The excluded
+ * array holds the edges towards the tags it excludes.
+ */
+typedef struct {
+	GArray *related;
+	GArray *excluded;
+} tagsistant_relations_vertex;
+
+/** the relations graph: tag_id -> tagsistant_relations_vertex */
+static GHashTable *tagsistant_relations_graph = NULL;
+static GRWLock tagsistant_relations_graph_lock;
+
+/** how many levels of relations are followed by the reasoner */
+static int tagsistant_reasoner_max_depth = TAGSISTANT_REASONER_MAX_DEPTH;
+
+/**
+ * Destroy a vertex of the relations graph
+ *
+ * @param data the tagsistant_relations_vertex pointer
+ */
+static void tagsistant_relations_vertex_destroy(gpointer data)
+{
+	tagsistant_relations_vertex *vertex = (tagsistant_relations_vertex *) data;
+	g_array_free(vertex->related, TRUE);
+	g_array_free(vertex->excluded, TRUE);
+	g_free(vertex);
+}
+
+/**
+ * Add an edge to the vertex of a tag, creating the vertex if required.
+ * Must be called with the graph write lock held.
+ *
+ * @param from the tag_id the edge starts from
+ * @param to the tag_id the edge points to
+ * @param kind the kind of the edge
+ */
+static void tagsistant_relations_graph_link(tagsistant_tag_id from, tagsistant_tag_id to, int kind)
+{
+	tagsistant_relations_vertex *vertex = g_hash_table_lookup(tagsistant_relations_graph, GUINT_TO_POINTER(from));
+
+	if (!vertex) {
+		vertex = g_new0(tagsistant_relations_vertex, 1);
+		vertex->related = g_array_new(FALSE, FALSE, sizeof(tagsistant_relations_edge));
+		vertex->excluded = g_array_new(FALSE, FALSE, sizeof(tagsistant_relations_edge));
+		g_hash_table_insert(tagsistant_relations_graph, GUINT_TO_POINTER(from), vertex);
+	}
+
+	tagsistant_relations_edge edge = { to, kind };
+
+	if (TAGSISTANT_EDGE_EXCLUDES == kind) {
+		g_array_append_val(vertex->excluded, edge);
+	} else {
+		g_array_append_val(vertex->related, edge);
+	}
+}
+
+/**
+ * Remove the edges pointing to a tag from an array of edges.
+ *
+ * @param edges the GArray of tagsistant_relations_edge
+ * @param tag_id the tag_id the edges point to
+ * @param kind the kind of edges to remove, -1 to remove all of them
+ */
+static void tagsistant_relations_graph_unlink(GArray *edges, tagsistant_tag_id tag_id, int kind)
+{
+	guint i = 0;
+	while (i < edges->len) {
+		tagsistant_relations_edge *edge = &g_array_index(edges, tagsistant_relations_edge, i);
+		if (edge->tag_id == tag_id && (-1 == kind || edge->kind == kind)) {
+			g_array_remove_index_fast(edges, i);
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * Add an edge to the relations graph. Must be called with the graph write lock held.
+ *
+ * @param tag1_id the first tag
+ * @param relation the relation (includes, excludes, is_equivalent)
+ * @param tag2_id the second tag
+ */
+static void tagsistant_relations_graph_add_edge_unlocked(tagsistant_tag_id tag1_id, const gchar *relation, tagsistant_tag_id tag2_id)
+{
+	if (!tag1_id || !tag2_id || !relation) return;
+
+	if (g_strcmp0(relation, "includes") == 0) {
+		tagsistant_relations_graph_link(tag1_id, tag2_id, TAGSISTANT_EDGE_INCLUDES);
+	} else if (g_strcmp0(relation, "is_equivalent") == 0) {
+		tagsistant_relations_graph_link(tag1_id, tag2_id, TAGSISTANT_EDGE_IS_EQUIVALENT);
+		tagsistant_relations_graph_link(tag2_id, tag1_id, TAGSISTANT_EDGE_IS_EQUIVALENT_REVERSE);
+	} else if (g_strcmp0(relation, "excludes") == 0) {
+		tagsistant_relations_graph_link(tag1_id, tag2_id, TAGSISTANT_EDGE_EXCLUDES);
+	}
+}
+
+/**
+ * Add an edge to the relations graph. Called after a relation has
+ * been inserted in the relations table.
+ *
+ * @param tag1_id the first tag
+ * @param relation the relation (includes, excludes, is_equivalent)
+ * @param tag2_id the second tag
+ */
+void tagsistant_relations_graph_add_edge(tagsistant_tag_id tag1_id, const gchar *relation, tagsistant_tag_id tag2_id)
+{
+	g_rw_lock_writer_lock(&tagsistant_relations_graph_lock);
+	tagsistant_relations_graph_add_edge_unlocked(tag1_id, relation, tag2_id);
+	g_rw_lock_writer_unlock(&tagsistant_relations_graph_lock);
+
+	tagsistant_invalidate_reasoning_cache();
+
+	dbg('r', LOG_INFO, "Relations graph: added %u %s %u", tag1_id, relation, tag2_id);
+}
+
+/**
+ * Remove an edge from the relations graph. Called after a relation
+ * has been deleted from the relations table.
+ *
+ * @param tag1_id the first tag
+ * @param relation the relation (includes, excludes, is_equivalent)
+ * @param tag2_id the second tag
+ */
+void tagsistant_relations_graph_remove_edge(tagsistant_tag_id tag1_id, const gchar *relation, tagsistant_tag_id tag2_id)
+{
+	g_rw_lock_writer_lock(&tagsistant_relations_graph_lock);
+
+	tagsistant_relations_vertex *vertex1 = g_hash_table_lookup(tagsistant_relations_graph, GUINT_TO_POINTER(tag1_id));
+	tagsistant_relations_vertex *vertex2 = g_hash_table_lookup(tagsistant_relations_graph, GUINT_TO_POINTER(tag2_id));
+
+	if (g_strcmp0(relation, "includes") == 0) {
+		if (vertex1) tagsistant_relations_graph_unlink(vertex1->related, tag2_id, TAGSISTANT_EDGE_INCLUDES);
+	} else if (g_strcmp0(relation, "is_equivalent") == 0) {
+		if (vertex1) tagsistant_relations_graph_unlink(vertex1->related, tag2_id, TAGSISTANT_EDGE_IS_EQUIVALENT);
+		if (vertex2) tagsistant_relations_graph_unlink(vertex2->related, tag1_id, TAGSISTANT_EDGE_IS_EQUIVALENT_REVERSE);
+	} else if (g_strcmp0(relation, "excludes") == 0) {
+		if (vertex1) tagsistant_relations_graph_unlink(vertex1->excluded, tag2_id, TAGSISTANT_EDGE_EXCLUDES);
+	}
+
+	g_rw_lock_writer_unlock(&tagsistant_relations_graph_lock);
+
+	tagsistant_invalidate_reasoning_cache();
+
+	dbg('r', LOG_INFO, "Relations graph: removed %u %s %u", tag1_id, relation, tag2_id);
+}
+
+/**
+ * Remove a tag and all its edges from the relations graph.
+ * Called when a tag is deleted.
+ *
+ * @param tag_id the deleted tag
+ */
+void tagsistant_relations_graph_remove_tag(tagsistant_tag_id tag_id)
+{
+	if (!tag_id) return;
+
+	g_rw_lock_writer_lock(&tagsistant_relations_graph_lock);
+
+	g_hash_table_remove(tagsistant_relations_graph, GUINT_TO_POINTER(tag_id));
+
+	GHashTableIter iter;
+	tagsistant_relations_vertex *vertex = NULL;
+	g_hash_table_iter_init(&iter, tagsistant_relations_graph);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &vertex)) {
+		tagsistant_relations_graph_unlink(vertex->related, tag_id, -1);
+		tagsistant_relations_graph_unlink(vertex->excluded, tag_id, -1);
+	}
+
+	g_rw_lock_writer_unlock(&tagsistant_relations_graph_lock);
+
+	tagsistant_invalidate_reasoning_cache();
+}
+
+/**
+ * SQL callback. Load a relation into the relations graph
+ *
+ * @param unused unused
+ * @param result dbi_result pointer
+ * @return 0 always, due to SQLite policy, may change in the future
+ */
+static int tagsistant_relations_graph_load_callback(void *unused, dbi_result result)
+{
+	(void) unused;
+
+	tagsistant_relations_graph_add_edge_unlocked(
+		dbi_result_get_as_longlong_idx(result, 1),
+		dbi_result_get_string_idx(result, 2),
+		dbi_result_get_as_longlong_idx(result, 3));
+
+	return (0);
+}
+
+/**
+ * Compute the transitive closure of the related tags of a set of tags
+ * by a breadth first visit of the relations graph. Each tag is visited
+ * only once, so relation cycles are harmless. The visit stops after
+ * tagsistant_reasoner_max_depth levels.
+ *
+ * @param sources the tag_ids the visit starts from
+ * @param related a GArray filled with the related tag_ids not included in sources
+ * @param excluded a GArray filled with the tag_ids excluded by the first source
+ */
+static void tagsistant_reasoner_closure(GArray *sources, GArray *related, GArray *excluded)
+{
+	if (!sources->len) return;
+
+	GHashTable *visited = g_hash_table_new(NULL, NULL);
+	GArray *frontier = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+
+	guint i;
+	for (i = 0; i < sources->len; i++) {
+		tagsistant_tag_id source = g_array_index(sources, tagsistant_tag_id, i);
+		g_hash_table_insert(visited, GUINT_TO_POINTER(source), GUINT_TO_POINTER(1));
+		g_array_append_val(frontier, source);
+	}
+
+	g_rw_lock_reader_lock(&tagsistant_relations_graph_lock);
+
+	/* the tags excluded by the reasoned tag */
+	tagsistant_relations_vertex *vertex = g_hash_table_lookup(
+		tagsistant_relations_graph,
+		GUINT_TO_POINTER(g_array_index(sources, tagsistant_tag_id, 0)));
+
+	if (vertex) {
+		for (i = 0; i < vertex->excluded->len; i++) {
+			tagsistant_tag_id tag_id = g_array_index(vertex->excluded, tagsistant_relations_edge, i).tag_id;
+			g_array_append_val(excluded, tag_id);
+		}
+	}
+
+	/* the tags included by or equivalent to the reasoned tag */
+	int depth = 0;
+	while (frontier->len && depth < tagsistant_reasoner_max_depth) {
+		GArray *next = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+
+		for (i = 0; i < frontier->len; i++) {
+			vertex = g_hash_table_lookup(tagsistant_relations_graph, GUINT_TO_POINTER(g_array_index(frontier, tagsistant_tag_id, i)));
+			if (!vertex) continue;
+
+			guint j;
+			for (j = 0; j < vertex->related->len; j++) {
+				tagsistant_tag_id tag_id = g_array_index(vertex->related, tagsistant_relations_edge, j).tag_id;
+
+				if (g_hash_table_lookup(visited, GUINT_TO_POINTER(tag_id))) continue;
+				g_hash_table_insert(visited, GUINT_TO_POINTER(tag_id), GUINT_TO_POINTER(1));
+
+				g_array_append_val(related, tag_id);
+				g_array_append_val(next, tag_id);
+			}
+		}
+
+		g_array_free(frontier, TRUE);
+		frontier = next;
+		depth++;
+	}
+
+	g_rw_lock_reader_unlock(&tagsistant_relations_graph_lock);
+
+	if (frontier->len) {
+		dbg('r', LOG_INFO, "Reasoner stopped at depth %d", tagsistant_reasoner_max_depth);
+	}
+
+	g_array_free(frontier, TRUE);
+	g_hash_table_destroy(visited);
 }
 
 /**
@@ -57,12 +518,48 @@ void tagsistant_destroy_reasoner_value(gpointer data)
 void tagsistant_reasoner_init()
 {
 	tagsistant_reasoner_cache = g_hash_table_new_full(
-		g_str_hash,		/* key hashing */
-		g_str_equal,	/* key comparison */
-		g_free,			/* key destroy */
-		tagsistant_destroy_reasoner_value);	/* value destroy (it's a GList, we must free is gchar * values) */
+		NULL,			/* key hashing (tag_id) */
+		NULL,			/* key comparison */
+		NULL,			/* key destroy */
+		tagsistant_destroy_reasoner_value);	/* value destroy (two GArrays of tagsistant_tag) */
+
+	tagsistant_reasoner_dictionary = g_hash_table_new_full(NULL, NULL, NULL, tagsistant_tag_destroy);
+
+	/* enable the reasoner cache from repository.ini */
+	gchar *cache = tagsistant_get_ini_entry("Reasoner", "cache");
+	if (cache) {
+		tagsistant_reasoner_cache_enabled = (g_strcmp0(cache, "1") == 0 || g_ascii_strcasecmp(cache, "true") == 0);
+		g_free(cache);
+	}
+
+	/* read the reasoning depth limit from repository.ini */
+	gchar *max_depth = tagsistant_get_ini_entry("Reasoner", "max_depth");
+	if (max_depth) {
+		tagsistant_reasoner_max_depth = atoi(max_depth);
+		g_free(max_depth);
+	}
+	if (tagsistant_reasoner_max_depth <= 0) tagsistant_reasoner_max_depth = TAGSISTANT_REASONER_MAX_DEPTH;
+
+	/* load the relations graph */
+	tagsistant_relations_graph = g_hash_table_new_full(NULL, NULL, NULL, tagsistant_relations_vertex_destroy);
+
+	dbi_conn dbi = tagsistant_db_connection(TAGSISTANT_DONT_START_TRANSACTION);
+	g_rw_lock_writer_lock(&tagsistant_relations_graph_lock);
+	tagsistant_query(
+		"select tag1_id, relation, tag2_id from relations",
+		dbi, tagsistant_relations_graph_load_callback, NULL);
+	g_rw_lock_writer_unlock(&tagsistant_relations_graph_lock);
+	tagsistant_db_connection_release(dbi, 0);
+
+	dbg('r', LOG_INFO, "Relations graph loaded: %u tags", g_hash_table_size(tagsistant_relations_graph));
 }
 
+/************************************************************************************/
+/***                                                                              ***/
+/*** Reasoner                                                                     ***/
+/***                                                                              ***/
+/************************************************************************************/
+
 /**
  * Check if an and_node matches a flat tag or a triple tag
  *
@@ -99,19 +596,22 @@ int tagsistant_and_node_match(qtree_and_node *and, tagsistant_tag *T)
 }
 
 /**
- * Add a reasoned tag to a node. Used by both tagsistant_add_reasoned_tag_callback()
- * and tagsistant_reasoner()
+ * Add a reasoned tag to a node. Used by tagsistant_reasoner()
  *
- * @param _reasoning
- * @param result
- * @return
+ * @param T the reasoned tag
+ * @param reasoning the reasoning structure
+ * @return the number of tags added so far, 0 if T is a duplicate, -1 on error
  */
 static int tagsistant_add_reasoned_tag(tagsistant_tag *T, tagsistant_reasoning *reasoning)
 {
 #if 1
-	/* check for duplicates */
+	/*
+	 * check for duplicates inside the reasoned node only: a tag
+	 * found in another and-node of the query must still be added,
+	 * because it widens the set of files matched by this node
+	 */
 	qtree_and_node *and = reasoning->start_node;
-	while (and) {
+	if (and) {
 		/*
 		 * avoid duplicates
 		 */
@@ -128,8 +628,6 @@ static int tagsistant_add_reasoned_tag(tagsistant_tag *T, tagsistant_reasoning *
 			if (tagsistant_and_node_match(negated, T)) return (0);
 			negated = negated->negated;
 		}
-
-		and = and->next;
 	}
 #endif
 
@@ -143,10 +641,11 @@ static int tagsistant_add_reasoned_tag(tagsistant_tag *T, tagsistant_reasoning *
 
 	reasoned->next = NULL;
 	reasoned->related = NULL;
-	reasoned->tag = g_strdup(T->tag);
-	reasoned->namespace = g_strdup(T->namespace);
-	reasoned->key = g_strdup(T->key);
-	reasoned->value = g_strdup(T->value);
+	reasoned->tag = (gchar *) tagsistant_reasoner_string_ref(T->tag);
+	reasoned->namespace = (gchar *) tagsistant_reasoner_string_ref(T->namespace);
+	reasoned->key = (gchar *) tagsistant_reasoner_string_ref(T->key);
+	reasoned->value = (gchar *) tagsistant_reasoner_string_ref(T->value);
+	reasoned->interned = 1;
 	reasoned->tag_id = T->tag_id;
 	reasoned->negate = reasoning->negate;
 
@@ -170,180 +669,355 @@ static int tagsistant_add_reasoned_tag(tagsistant_tag *T, tagsistant_reasoning *
 }
 
 /**
- * SQL callback. Add new tag derived from reasoning to a ptree_and_node_t structure.
+ * SQL callback. Load a reasoned tag into a dictionary of tagsistant_tag.
+ * A tag is a triple tag if its name ends with a colon.
  *
- * @param _reasoning pointer to be casted to reasoning_t* structure
+ * @param _dictionary a GHashTable mapping tag_ids to tagsistant_tag
  * @param result dbi_result pointer
- * @return 0 always, due to SQLite policy, may change in the future
+ * @return 0 always
  */
-static int tagsistant_add_reasoned_tag_callback(void *_reasoning, dbi_result result)
+static int tagsistant_load_reasoned_tag_callback(void *_dictionary, dbi_result result)
 {
-	/* point to a reasoning_t structure */
-	tagsistant_reasoning *reasoning = (tagsistant_reasoning *) _reasoning;
+	GHashTable *dictionary = (GHashTable *) _dictionary;
 
-	/*
-	 * create a buffer object to pass the query results
-	 * to tagsistant_add_reasoned_tag()
-	 */
 	tagsistant_tag *T = g_new0(tagsistant_tag, 1);
 
 	tagsistant_return_integer(&T->tag_id, result);
 	const gchar *tag_or_namespace = dbi_result_get_string_idx(result, 2);
 
-	if (g_regex_match_simple(TAGSISTANT_DEFAULT_TRIPLE_TAG_REGEX, tag_or_namespace, 0, 0)) {
-		strcpy(T->namespace, tag_or_namespace);
-		strcpy(T->key, dbi_result_get_string_idx(result, 3));
-		strcpy(T->value, dbi_result_get_string_idx(result, 4));
+	if (g_str_has_suffix(tag_or_namespace, ":")) {
+		T->namespace = tag_or_namespace;
+		T->key = dbi_result_get_string_idx(result, 3);
+		T->value = dbi_result_get_string_idx(result, 4);
 	} else {
-		strcpy(T->tag, tag_or_namespace);
+		T->tag = tag_or_namespace;
 	}
 
-	/* add the tag */
-	if (-1 == tagsistant_add_reasoned_tag(T, reasoning)) {
-		dbg('r', LOG_ERR, "Error adding reasoned tag (%s, %s, %s)", T->namespace, T->key, T->value);
-		g_free(T);
-		return (1);
-	}
+	/* move the strings into the pool, the dictionary holds a reference */
+	tagsistant_tag_ref(T);
 
-	dbg('r', LOG_INFO, "Adding related tag (%s, %s, %s)", T->tag, "n/a", "n/a");
-	g_free(T);
+	g_hash_table_insert(dictionary, GUINT_TO_POINTER(T->tag_id), T);
 	return (0);
 }
 
 /**
- * Search and add related tags to a ptree_and_node_t,
- * enabling tagsistant_build_filetree to later add more criteria to SQL
- * statements to retrieve files
+ * Load into the reasoner dictionary the tags not already there,
+ * with a single query
  *
- * @param reasoning the reasoning structure the tagsistant_reasoner should work on
+ * @param conn DBI connection handle
+ * @param tag_ids a GHashTable whose keys are the tag_ids to be loaded
+ * @return the number of tags loaded from the DB
  */
-int tagsistant_reasoner_inner(tagsistant_reasoning *reasoning, int do_caching)
+static guint tagsistant_reasoner_load_tags(dbi_conn conn, GHashTable *tag_ids)
 {
-	(void) do_caching;
+	GString *ids = g_string_sized_new(256);
 
-#if TAGSISTANT_ENABLE_REASONER_CACHE
-	GList *cached = NULL;
-	gchar *key = NULL;
-	int found = 0;
-	gchar *reference_key = NULL;
+	GHashTableIter iter;
+	gpointer tag_id;
 
-	/*
-	 * compute the key used to store the result in the reasoner cache
-	 */
-	if (reasoning->current_node->tag && strlen(reasoning->current_node->tag)) {
-		reference_key = g_strdup(reasoning->current_node->tag);
-	} else if (reasoning->current_node->namespace && reasoning->current_node->key && reasoning->current_node->value) {
-		reference_key = g_strdup_printf("%s<>%s<>%s",
-			reasoning->current_node->namespace,
-			reasoning->current_node->key,
-			reasoning->current_node->value);
+	g_rw_lock_reader_lock(&tagsistant_reasoner_dictionary_lock);
+	g_hash_table_iter_init(&iter, tag_ids);
+	while (g_hash_table_iter_next(&iter, &tag_id, NULL)) {
+		if (g_hash_table_lookup(tagsistant_reasoner_dictionary, tag_id)) continue;
+		g_string_append_printf(ids, "%s%u", ids->len ? "," : "", GPOINTER_TO_UINT(tag_id));
 	}
+	g_rw_lock_reader_unlock(&tagsistant_reasoner_dictionary_lock);
 
-	if (reference_key) {
-		found = g_hash_table_lookup_extended(
-			tagsistant_reasoner_cache,
-			reference_key,
-			(gpointer *) &key,
-			(gpointer *) &cached);
+	if (!ids->len) {
+		g_string_free(ids, TRUE);
+		return (0);
 	}
 
-	if (found)
-		// the result was cached, just add it
-		g_list_foreach(cached, (GFunc) tagsistant_add_reasoned_tag, reasoning);
-	else {
+	GHashTable *loaded = g_hash_table_new(NULL, NULL);
 
-#endif /* TAGSISTANT_ENABLE_REASONER_CACHE*/
+	tagsistant_query(
+		"select tag_id, tagname, `key`, value from tags where tag_id in (%s)",
+		conn,
+		tagsistant_load_reasoned_tag_callback,
+		loaded,
+		ids->str);
 
-		tagsistant_inode other_tag_id = 0;
+	g_string_free(ids, TRUE);
 
-		if (reasoning->current_node->tag && strlen(reasoning->current_node->tag)) {
-			other_tag_id = tagsistant_sql_get_tag_id(reasoning->conn, reasoning->current_node->tag, NULL, NULL);
-		} else if (reasoning->current_node->namespace && reasoning->current_node->key && reasoning->current_node->value) {
-			other_tag_id = tagsistant_sql_get_tag_id(reasoning->conn, reasoning->current_node->namespace,
-				reasoning->current_node->key, reasoning->current_node->value);
+	/* move the loaded tags into the dictionary */
+	guint count = g_hash_table_size(loaded);
+	tagsistant_tag *T;
+
+	g_rw_lock_writer_lock(&tagsistant_reasoner_dictionary_lock);
+	g_hash_table_iter_init(&iter, loaded);
+	while (g_hash_table_iter_next(&iter, &tag_id, (gpointer *) &T)) {
+		g_hash_table_replace(tagsistant_reasoner_dictionary, tag_id, T);
+	}
+	g_rw_lock_writer_unlock(&tagsistant_reasoner_dictionary_lock);
+
+	g_hash_table_destroy(loaded);
+
+	return (count);
+}
+
+/**
+ * Build a GArray of tagsistant_tag from a GArray of tag_ids
+ * looking them up in the reasoner dictionary
+ *
+ * @param tag_ids the GArray of tag_ids
+ * @return a GArray of tagsistant_tag, to be freed with tagsistant_tag_list_free()
+ */
+static GArray *tagsistant_reasoner_tag_list(GArray *tag_ids)
+{
+	GArray *tags = g_array_sized_new(FALSE, FALSE, sizeof(tagsistant_tag), tag_ids->len);
+
+	g_rw_lock_reader_lock(&tagsistant_reasoner_dictionary_lock);
+
+	guint i;
+	for (i = 0; i < tag_ids->len; i++) {
+		tagsistant_tag *T = g_hash_table_lookup(tagsistant_reasoner_dictionary, GUINT_TO_POINTER(g_array_index(tag_ids, tagsistant_tag_id, i)));
+		if (T) {
+			/* the list holds its own references, the dictionary can be dropped meanwhile */
+			g_array_append_val(tags, *T);
+			tagsistant_tag_ref(&g_array_index(tags, tagsistant_tag, tags->len - 1));
 		}
+	}
 
-		/*
-		 * the result wasn't cached, so we lookup it in the DB, starting
-		 * from the positive relations 'includes' and 'is_equivalent'
-		 */
-		reasoning->negate = 0;
-		tagsistant_query(
-			"select tag_id, tagname, `key`, value from tags "
-				"join relations on tags.tag_id = relations.tag2_id "
-				"where tag1_id = %d and relation in ('includes', 'is_equivalent') "
-			"union "
-			"select tag_id, tagname, `key`, value from tags "
-				"join relations on tags.tag_id = relations.tag1_id "
-				"where tag2_id = %d and relation = 'is_equivalent' ",
-			reasoning->conn,
-			tagsistant_add_reasoned_tag_callback,
-			reasoning,
-			other_tag_id,
-			other_tag_id);
+	g_rw_lock_reader_unlock(&tagsistant_reasoner_dictionary_lock);
 
-		/*
-		 * than we look for negative relations (aka 'excludes')
-		 */
-		reasoning->negate = 1;
-		tagsistant_query(
-			"select tag_id, tagname, `key`, value from tags "
-				"join relations on tags.tag_id = relations.tag2_id "
-				"where tag1_id = %d and relation = 'excludes'",
-			reasoning->conn,
-			tagsistant_add_reasoned_tag_callback,
-			reasoning,
-			other_tag_id,
-			other_tag_id);
+	return (tags);
+}
 
-		/*
-		 * if another node is available, reason about it,
-		 * otherwise exit the reasoning process
-		 */
-		if (reasoning->current_node->related) {
-			reasoning->current_node = reasoning->current_node->related;
-			tagsistant_reasoner_inner(reasoning, FALSE);
+/**
+ * Add a list of reasoned tags to the reasoning
+ *
+ * @param reasoning the reasoning structure
+ * @param tags a GArray of tagsistant_tag
+ * @param negate add the tags as negated tags
+ */
+static void tagsistant_reasoner_add_tag_list(tagsistant_reasoning *reasoning, GArray *tags, int negate)
+{
+	reasoning->negate = negate;
+
+	guint i;
+	for (i = 0; i < tags->len; i++) {
+		tagsistant_tag *T = &g_array_index(tags, tagsistant_tag, i);
+
+		if (-1 == tagsistant_add_reasoned_tag(T, reasoning)) {
+			dbg('r', LOG_ERR, "Error adding reasoned tag (%s, %s, %s)", T->namespace, T->key, T->value);
+			return;
 		}
 
-#if TAGSISTANT_ENABLE_REASONER_CACHE
+		dbg('r', LOG_INFO, "Adding %s tag (%s, %s, %s, %s)", negate ? "excluded" : "related", T->tag, T->namespace, T->key, T->value);
 	}
+}
+
+/**
+ * A node of the query waiting for its reasoned tags to be loaded
+ */
+typedef struct {
+	qtree_and_node *node;
+	GArray *related;
+	GArray *excluded;
+} tagsistant_reasoner_pending;
+
+/**
+ * Collect the nodes of a query tree written by the user: the and-nodes,
+ * the members of their tag groups and their negated tags. Must be called
+ * before any reasoned tag is added to the tree.
+ *
+ * @param tree the query tree
+ * @return a GPtrArray of qtree_and_node
+ */
+static GPtrArray *tagsistant_reasoner_collect_nodes(qtree_or_node *tree)
+{
+	GPtrArray *nodes = g_ptr_array_new();
+
+	for (; tree; tree = tree->next) {
+		qtree_and_node *and = tree->and_set;
+		for (; and; and = and->next) {
+			qtree_and_node *node;
+			for (node = and; node; node = node->related) g_ptr_array_add(nodes, node);
+			for (node = and->negated; node; node = node->negated) g_ptr_array_add(nodes, node);
+		}
+	}
+
+	return (nodes);
+}
+
+/**
+ * Search and add related tags to every node of a query tree,
+ * enabling tagsistant_build_filetree to later add more criteria to SQL
+ * statements to retrieve files.
+ *
+ * The whole tree is reasoned in one pass: the closures of all the nodes
+ * are computed on the relations graph (or taken from the reasoner cache)
+ * and the tags they reach are loaded from the DB with a single query.
+ *
+ * @param tree the query tree
+ * @param conn DBI connection handle
+ * @return the number of reasoned tags added to the tree
+ */
+int tagsistant_reasoner(qtree_or_node *tree, dbi_conn conn)
+{
+	gint64 start = g_get_monotonic_time();
+	int added_tags = 0, cached = 0;
+
+	GPtrArray *nodes = tagsistant_reasoner_collect_nodes(tree);
+	GArray *pending = g_array_new(FALSE, FALSE, sizeof(tagsistant_reasoner_pending));
+	GHashTable *wanted = g_hash_table_new(NULL, NULL);
+	gint generation = g_atomic_int_get(&tagsistant_relations_graph_generation);
+
+	tagsistant_reasoning reasoning;
+	reasoning.conn = conn;
 
 	/*
-	 * Cache the result only if the cache doesn't contain it.
+	 * first pass: take the reasoning of each node from the cache or
+	 * compute its closure on the relations graph
 	 */
-	if (do_caching && !found && reference_key) {
-		// first we must build a GList holding all the reasoned tags...
-		GList *reasoned_list = NULL;
-		qtree_and_node *reasoned = reasoning->start_node->related;
-		while (reasoned) {
-			tagsistant_tag *T = g_new0(tagsistant_tag, 1);
-
-			g_strlcpy(T->tag, reasoned->tag, 1024);
-			g_strlcpy(T->namespace, reasoned->namespace, 1024);
-			g_strlcpy(T->key, reasoned->key, 1024);
-			g_strlcpy(T->value, reasoned->value, 1024);
-			T->tag_id = reasoned->tag_id;
-
-			reasoned_list = g_list_append(reasoned_list, T);
-
-			reasoned = reasoned->related;
+	guint i;
+	for (i = 0; i < nodes->len; i++) {
+		qtree_and_node *node = g_ptr_array_index(nodes, i);
+
+		if (!node->tag_id) continue;
+		if (!node->tag && !(node->namespace && node->key && node->value)) continue;
+
+		reasoning.start_node = reasoning.current_node = node;
+		reasoning.added_tags = 0;
+
+#if TAGSISTANT_ENABLE_REASONER_CACHE
+		if (tagsistant_reasoner_cache_enabled) {
+			g_rw_lock_reader_lock(&tagsistant_reasoner_cache_lock);
+			tagsistant_reasoner_cache_entry *entry = g_hash_table_lookup(tagsistant_reasoner_cache, GUINT_TO_POINTER(node->tag_id));
+
+			if (entry && entry->generation == generation) {
+				// the result was cached, just add it
+				tagsistant_reasoner_add_tag_list(&reasoning, entry->related, 0);
+				tagsistant_reasoner_add_tag_list(&reasoning, entry->excluded, 1);
+				g_rw_lock_reader_unlock(&tagsistant_reasoner_cache_lock);
+
+				g_atomic_int_inc(&tagsistant_reasoner_cache_hits);
+				added_tags += reasoning.added_tags;
+				cached++;
+				continue;
+			}
+
+			g_rw_lock_reader_unlock(&tagsistant_reasoner_cache_lock);
+			g_atomic_int_inc(&tagsistant_reasoner_cache_misses);
 		}
+#endif /* TAGSISTANT_ENABLE_REASONER_CACHE */
 
-		// ...and then we add the tag list to the cache (do not free() the reference_key)
-		g_hash_table_insert(tagsistant_reasoner_cache, reference_key, reasoned_list);
-	} else {
-		g_free_null(reference_key);
+		tagsistant_reasoner_pending job;
+		job.node = node;
+		job.related = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+		job.excluded = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+
+		GArray *sources = g_array_new(FALSE, FALSE, sizeof(tagsistant_tag_id));
+		g_array_append_val(sources, node->tag_id);
+		tagsistant_reasoner_closure(sources, job.related, job.excluded);
+		g_array_free(sources, TRUE);
+
+		guint j;
+		for (j = 0; j < job.related->len; j++)
+			g_hash_table_insert(wanted, GUINT_TO_POINTER(g_array_index(job.related, tagsistant_tag_id, j)), GUINT_TO_POINTER(1));
+		for (j = 0; j < job.excluded->len; j++)
+			g_hash_table_insert(wanted, GUINT_TO_POINTER(g_array_index(job.excluded, tagsistant_tag_id, j)), GUINT_TO_POINTER(1));
+
+		g_array_append_val(pending, job);
 	}
+
+	/*
+	 * second pass: load all the reasoned tags at once and add them to their nodes
+	 */
+	guint loaded = tagsistant_reasoner_load_tags(conn, wanted);
+
+	for (i = 0; i < pending->len; i++) {
+		tagsistant_reasoner_pending *job = &g_array_index(pending, tagsistant_reasoner_pending, i);
+
+		GArray *related_tags = tagsistant_reasoner_tag_list(job->related);
+		GArray *excluded_tags = tagsistant_reasoner_tag_list(job->excluded);
+
+		reasoning.start_node = reasoning.current_node = job->node;
+		reasoning.added_tags = 0;
+
+		/* the positive relations 'includes' and 'is_equivalent'... */
+		tagsistant_reasoner_add_tag_list(&reasoning, related_tags, 0);
+
+		/* ...and the negative relations (aka 'excludes') */
+		tagsistant_reasoner_add_tag_list(&reasoning, excluded_tags, 1);
+
+		added_tags += reasoning.added_tags;
+
+		g_array_free(job->related, TRUE);
+		g_array_free(job->excluded, TRUE);
+
+#if TAGSISTANT_ENABLE_REASONER_CACHE
+		/*
+		 * Cache the result, unless the relations graph changed meanwhile
+		 */
+		if (tagsistant_reasoner_cache_enabled) {
+			tagsistant_reasoner_cache_entry *entry = g_new0(tagsistant_reasoner_cache_entry, 1);
+			entry->generation = generation;
+			entry->related = related_tags;
+			entry->excluded = excluded_tags;
+
+			g_rw_lock_writer_lock(&tagsistant_reasoner_cache_lock);
+			if (g_atomic_int_get(&tagsistant_relations_graph_generation) == generation) {
+				g_hash_table_replace(tagsistant_reasoner_cache, GUINT_TO_POINTER(job->node->tag_id), entry);
+				entry = NULL;
+			}
+			g_rw_lock_writer_unlock(&tagsistant_reasoner_cache_lock);
+
+			if (entry) tagsistant_destroy_reasoner_value(entry);
+			continue;
+		}
 #endif /* TAGSISTANT_ENABLE_REASONER_CACHE */
 
-	return (reasoning->added_tags);
+		tagsistant_tag_list_free(related_tags);
+		tagsistant_tag_list_free(excluded_tags);
+	}
+
+	dbg('r', LOG_INFO, "Reasoned %u nodes (%d cached, %u tags loaded) adding %d tags (%" G_GSIZE_FORMAT " bytes) in %" G_GINT64_FORMAT " usec",
+		nodes->len, cached, loaded, added_tags, added_tags * sizeof(qtree_and_node), g_get_monotonic_time() - start);
+
+	g_hash_table_destroy(wanted);
+	g_array_free(pending, TRUE);
+	g_ptr_array_free(nodes, TRUE);
+
+	return (added_tags);
 }
 
-void tagsistant_invalidate_reasoning_cache(gchar *tag)
+/**
+ * Invalidate the whole reasoner cache. Called on every change of
+ * the relations graph, since a change to a relation can alter the
+ * reasoning of every tag that reaches it, directly or not.
+ */
+void tagsistant_invalidate_reasoning_cache()
 {
+	g_atomic_int_inc(&tagsistant_relations_graph_generation);
+
 #if TAGSISTANT_ENABLE_REASONER_CACHE
-	g_hash_table_remove(tagsistant_reasoner_cache, tag);
-#else
-	(void) tag;
+	g_rw_lock_writer_lock(&tagsistant_reasoner_cache_lock);
+	g_hash_table_remove_all(tagsistant_reasoner_cache);
+	g_rw_lock_writer_unlock(&tagsistant_reasoner_cache_lock);
 #endif
+
+	/* tag names can change too, so the dictionary is reloaded on demand */
+	if (tagsistant_reasoner_dictionary) {
+		g_rw_lock_writer_lock(&tagsistant_reasoner_dictionary_lock);
+		g_hash_table_remove_all(tagsistant_reasoner_dictionary);
+		g_rw_lock_writer_unlock(&tagsistant_reasoner_dictionary_lock);
+	}
+}
+
+/**
+ * Report reasoner cache statistics
+ *
+ * @param hits filled with the number of cache hits
+ * @param misses filled with the number of cache misses
+ * @param entries filled with the number of cached tags
+ */
+void tagsistant_reasoner_cache_stats(int *hits, int *misses, int *entries)
+{
+	*hits = g_atomic_int_get(&tagsistant_reasoner_cache_hits);
+	*misses = g_atomic_int_get(&tagsistant_reasoner_cache_misses);
+
+	g_rw_lock_reader_lock(&tagsistant_reasoner_cache_lock);
+	*entries = tagsistant_reasoner_cache ? g_hash_table_size(tagsistant_reasoner_cache) : 0;
+	g_rw_lock_reader_unlock(&tagsistant_reasoner_cache_lock);
 }
@@ -214,32 +214,27 @@ GMutex tagsistant_connection_pool_lock;
 int connections = 0;
 
 /**
- * Parse command line options, create connection object,
- * start the connection and finally create database schema
+ * Pick a connection from the pool or create a new one
  *
  * @return DBI connection handle
  */
-dbi_conn *tagsistant_db_connection(int start_transaction)
+static dbi_conn tagsistant_db_pooled_connection()
 {
 	/* DBI connection handler used by subsequent calls to dbi_* functions */
 	dbi_conn dbi = NULL;
 
-	if (start_transaction) {
-		g_rw_lock_writer_lock(&(tagsistant_query_rwlock));
-	} else {
-		g_rw_lock_reader_lock(&(tagsistant_query_rwlock));
-	}
-
 	/* lock the pool */
 	g_mutex_lock(&tagsistant_connection_pool_lock);
 
 	GList *pool = tagsistant_connection_pool;
 	while (pool) {
+		GList *next = pool->next;
 		dbi = (dbi_conn) pool->data;
 
 		/* check if the connection is still alive */
 		if (!dbi_conn_ping(dbi) && dbi_conn_connect(dbi) < 0) {
 			dbi_conn_close(dbi);
+			dbi = NULL;
 			tagsistant_connection_pool = g_list_delete_link(tagsistant_connection_pool, pool);
 			connections--;
 		} else {
@@ -249,7 +244,7 @@ dbi_conn *tagsistant_db_connection(int start_transaction)
 			break;
 		}
 
-		pool = pool->next;
+		pool = next;
 	}
 
 	/*
@@ -328,6 +323,25 @@ dbi_conn *tagsistant_db_connection(int start_transaction)
 		dbg('s', LOG_INFO, "SQL connection established");
 	}
 
+	return (dbi);
+}
+
+/**
+ * Parse command line options, create connection object,
+ * start the connection and finally create database schema
+ *
+ * @return DBI connection handle
+ */
+dbi_conn *tagsistant_db_connection(int start_transaction)
+{
+	if (start_transaction) {
+		g_rw_lock_writer_lock(&(tagsistant_query_rwlock));
+	} else {
+		g_rw_lock_reader_lock(&(tagsistant_query_rwlock));
+	}
+
+	dbi_conn dbi = tagsistant_db_pooled_connection();
+
 	/* start a transaction */
 	if (start_transaction) {
 #if TAGSISTANT_USE_INTERNAL_TRANSACTIONS
@@ -348,6 +362,32 @@ dbi_conn *tagsistant_db_connection(int start_transaction)
 	return(dbi);
 }
 
+/**
+ * Borrow a connection from the pool on behalf of an operation which
+ * already holds a connection obtained by tagsistant_db_connection().
+ * The query lock is not acquired again, since the calling operation
+ * owns it for the whole lifetime of the worker connection. No
+ * transaction is started.
+ *
+ * @return DBI connection handle
+ */
+dbi_conn tagsistant_db_worker_connection()
+{
+	return (tagsistant_db_pooled_connection());
+}
+
+/**
+ * Return a connection obtained by tagsistant_db_worker_connection() to the pool
+ *
+ * @param dbi the connection to be released
+ */
+void tagsistant_db_worker_connection_release(dbi_conn dbi)
+{
+	g_mutex_lock(&tagsistant_connection_pool_lock);
+	tagsistant_connection_pool = g_list_prepend(tagsistant_connection_pool, dbi);
+	g_mutex_unlock(&tagsistant_connection_pool_lock);
+}
+
 /**
  * Release a DBI connection
  *
@@ -355,15 +395,8 @@ dbi_conn *tagsistant_db_connection(int start_transaction)
  */
 void tagsistant_db_connection_release(dbi_conn dbi, gboolean is_writer_locked)
 {
-	/* lock the pool if the backend is not SQLite */
-	//// if (tagsistant.sql_database_driver != TAGSISTANT_DBI_SQLITE_BACKEND)
-		g_mutex_lock(&tagsistant_connection_pool_lock);
-
 	/* release the connection back to the pool */
-	tagsistant_connection_pool = g_list_prepend(tagsistant_connection_pool, dbi);
-
-	/* unlock the pool */
-	g_mutex_unlock(&tagsistant_connection_pool_lock);
+	tagsistant_db_worker_connection_release(dbi);
 
 	if (is_writer_locked) {
 		g_rw_lock_writer_unlock(&tagsistant_query_rwlock);
@@ -372,6 +405,159 @@ void tagsistant_db_connection_release(dbi_conn dbi, gboolean is_writer_locked)
 	}
 }
 
+/**
+ * Trigrams containing one of these chars are not indexed. Quotes and
+ * backslashes would need escaping, while % and _ are LIKE wildcards.
+ * Skipping a trigram only widens the candidate set, since the final
+ * LIKE comparison is always performed.
+ */
+#define TAGSISTANT_TRIGRAM_UNSAFE_CHARS "'\"\\%_"
+
+/**
+ * Split a string into its set of distinct trigrams. Trigrams are made
+ * of three UTF-8 characters, ASCII folded to lower case to follow the
+ * case insensitive LIKE operator of SQLite.
+ *
+ * @param value the string to be split
+ * @return a GHashTable used as a set, to be freed with g_hash_table_destroy()
+ */
+static GHashTable *tagsistant_sql_trigrams(const gchar *value)
+{
+	GHashTable *trigrams = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (!value || !g_utf8_validate(value, -1, NULL)) return (trigrams);
+
+	gchar *folded = g_ascii_strdown(value, -1);
+	const gchar *start = folded;
+
+	while (*start) {
+		const gchar *end = start;
+		int chars = 0;
+
+		while (*end && chars < 3) {
+			end = g_utf8_next_char(end);
+			chars++;
+		}
+
+		if (chars < 3) break;
+
+		gchar *trigram = g_strndup(start, end - start);
+		if (strpbrk(trigram, TAGSISTANT_TRIGRAM_UNSAFE_CHARS)) {
+			g_free(trigram);
+		} else {
+			g_hash_table_insert(trigrams, trigram, NULL);
+		}
+
+		start = g_utf8_next_char(start);
+	}
+
+	g_free(folded);
+	return (trigrams);
+}
+
+/**
+ * Index the value of a triple tag by its trigrams. Any previous
+ * index entry of the same tag is replaced. A value without indexable
+ * trigrams gets an empty sentinel trigram, which no pattern looks up,
+ * so the mount time backfill doesn't select it again.
+ *
+ * @param conn dbi_conn reference
+ * @param tag_id the tag_id of the triple tag
+ * @param value the value of the triple tag
+ */
+void tagsistant_sql_index_tag_value(dbi_conn conn, tagsistant_tag_id tag_id, const gchar *value)
+{
+#if TAGSISTANT_ENABLE_TRIGRAM_INDEX
+	if (TAGSISTANT_DBI_SQLITE_BACKEND != tagsistant.sql_database_driver) return;
+	if (!tag_id) return;
+
+	tagsistant_query("delete from tag_trigrams where tag_id = %u", conn, NULL, NULL, tag_id);
+
+	GHashTable *trigrams = tagsistant_sql_trigrams(value);
+	if (g_hash_table_size(trigrams)) {
+		GString *rows = g_string_sized_new(1024);
+
+		GHashTableIter iter;
+		gchar *trigram = NULL;
+		g_hash_table_iter_init(&iter, trigrams);
+		while (g_hash_table_iter_next(&iter, (gpointer *) &trigram, NULL)) {
+			g_string_append_printf(rows, "%s('%s', %u)", rows->len ? ", " : "", trigram, tag_id);
+		}
+
+		tagsistant_query("insert into tag_trigrams (trigram, tag_id) values %s", conn, NULL, NULL, rows->str);
+		g_string_free(rows, TRUE);
+	} else {
+		tagsistant_query("insert into tag_trigrams (trigram, tag_id) values ('', %u)", conn, NULL, NULL, tag_id);
+	}
+
+	g_hash_table_destroy(trigrams);
+#else
+	(void) conn;
+	(void) tag_id;
+	(void) value;
+#endif
+}
+
+/**
+ * SQL callback. Index the value of a triple tag selected as (tag_id, value)
+ *
+ * @param conn the dbi_conn cast to void*
+ * @param result dbi_result pointer
+ * @return 0 always, due to SQLite policy, may change in the future
+ */
+int tagsistant_sql_index_tag_value_callback(void *conn, dbi_result result)
+{
+	tagsistant_tag_id tag_id = 0;
+	tagsistant_return_integer(&tag_id, result);
+
+	tagsistant_sql_index_tag_value((dbi_conn) conn, tag_id, dbi_result_get_string_idx(result, 2));
+
+	return (0);
+}
+
+/**
+ * Build a subquery selecting the tag_ids whose values contain all
+ * the trigrams of a pattern. Used to narrow the LIKE scans of the
+ * inc/ operator.
+ *
+ * @param pattern the pattern searched by the inc/ operator
+ * @return the subquery (to be freed with g_free()) or NULL if the index can't be used
+ */
+gchar *tagsistant_sql_trigram_filter(const gchar *pattern)
+{
+#if TAGSISTANT_ENABLE_TRIGRAM_INDEX
+	if (TAGSISTANT_DBI_SQLITE_BACKEND != tagsistant.sql_database_driver) return (NULL);
+
+	GHashTable *trigrams = tagsistant_sql_trigrams(pattern);
+	guint count = g_hash_table_size(trigrams);
+	if (!count) {
+		g_hash_table_destroy(trigrams);
+		return (NULL);
+	}
+
+	GString *list = g_string_sized_new(256);
+
+	GHashTableIter iter;
+	gchar *trigram = NULL;
+	g_hash_table_iter_init(&iter, trigrams);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &trigram, NULL)) {
+		g_string_append_printf(list, "%s'%s'", list->len ? ", " : "", trigram);
+	}
+
+	gchar *filter = g_strdup_printf(
+		"select tag_id from tag_trigrams where trigram in (%s) group by tag_id having count(*) = %u",
+		list->str, count);
+
+	g_string_free(list, TRUE);
+	g_hash_table_destroy(trigrams);
+
+	return (filter);
+#else
+	(void) pattern;
+	return (NULL);
+#endif
+}
+
 /**
  * Create DB schema
  */
@@ -397,7 +583,8 @@ void tagsistant_create_schema()
 					"objectname text(255) not null, "
 					"last_autotag timestamp not null default current_timestamp, "
 					"checksum text(40) not null default '', "
-					"symlink text(1024) not null default '')",
+					"symlink text(1024) not null default '', "
+					"strong_checksum text(40) not null default '')",
 				dbi, NULL, NULL);
 
 			tagsistant_query(
@@ -435,12 +622,62 @@ void tagsistant_create_schema()
 					"objectname varchar(255) not null)",
 				dbi, NULL, NULL);
 
+			tagsistant_query(
+				"create table if not exists checksum_backfill ("
+					"last_inode integer not null default 0)",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists checksum_settings ("
+					"mode varchar(16) not null, "
+					"hash varchar(16) not null)",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists work_queue ("
+					"inode integer not null, "
+					"task integer not null, "
+					"claimed integer not null default 0, "
+					"constraint Work_queue_key unique (inode, task))",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists object_chunks ("
+					"inode integer not null, "
+					"chunk_offset integer not null, "
+					"chunk_length integer not null, "
+					"checksum varchar(64) not null)",
+				dbi, NULL, NULL);
+
 			tagsistant_query("create index if not exists relations_index on relations (tag1_id, tag2_id)", dbi, NULL, NULL);
 			tagsistant_query("create index if not exists objectname_index on objects (objectname)", dbi, NULL, NULL);
 			tagsistant_query("create index if not exists symlink_index on objects (symlink, inode)", dbi, NULL, NULL);
 			tagsistant_query("create index if not exists checksum_index on objects (checksum, inode)", dbi, NULL, NULL);
 			tagsistant_query("create index if not exists relations_type_index on relations (relation)", dbi, NULL, NULL);
 			tagsistant_query("create index if not exists aliases_index on aliases (alias)", dbi, NULL, NULL);
+			tagsistant_query("create index if not exists tagging_tag_index on tagging (tag_id, inode)", dbi, NULL, NULL);
+			tagsistant_query("create index if not exists object_chunks_index on object_chunks (inode, chunk_offset)", dbi, NULL, NULL);
+
+#if TAGSISTANT_ENABLE_TRIGRAM_INDEX
+			tagsistant_query(
+				"create table if not exists tag_trigrams ("
+					"trigram varchar(12) not null, "
+					"tag_id integer not null)",
+				dbi, NULL, NULL);
+
+			tagsistant_query("create index if not exists tag_trigrams_index on tag_trigrams (trigram, tag_id)", dbi, NULL, NULL);
+			tagsistant_query("create index if not exists tag_trigrams_tag_index on tag_trigrams (tag_id)", dbi, NULL, NULL);
+
+			/*
+			 * index the values of the tags created before the trigram index
+			 * was introduced. Every indexed value has at least a row, even
+			 * the sentinel one, so this scan finds them only once.
+			 */
+			tagsistant_query(
+				"select tag_id, value from tags "
+					"where value <> '' and tag_id not in (select tag_id from tag_trigrams)",
+				dbi, tagsistant_sql_index_tag_value_callback, dbi);
+#endif
 			break;
 
 		case TAGSISTANT_DBI_MYSQL_BACKEND:
@@ -459,7 +696,8 @@ void tagsistant_create_schema()
 					"objectname varchar(255) not null, "
 					"last_autotag timestamp not null default 0, "
 					"checksum varchar(40) not null default '', "
-					"symlink varchar(1024) not null default '')",
+					"symlink varchar(1024) not null default '', "
+					"strong_checksum varchar(40) not null default '')",
 				dbi, NULL, NULL);
 
 			tagsistant_query(
@@ -497,18 +735,57 @@ void tagsistant_create_schema()
 					"objectname varchar(255) not null)",
 				dbi, NULL, NULL);
 
+			tagsistant_query(
+				"create table if not exists checksum_backfill ("
+					"last_inode integer not null default 0)",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists checksum_settings ("
+					"mode varchar(16) not null, "
+					"hash varchar(16) not null)",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists work_queue ("
+					"inode integer not null, "
+					"task integer not null, "
+					"claimed integer not null default 0, "
+					"constraint Work_queue_key unique key (inode, task))",
+				dbi, NULL, NULL);
+
+			tagsistant_query(
+				"create table if not exists object_chunks ("
+					"inode integer not null, "
+					"chunk_offset bigint not null, "
+					"chunk_length integer not null, "
+					"checksum varchar(64) not null)",
+				dbi, NULL, NULL);
+
 			tagsistant_query("create index relations_index on relations (tag1_id, tag2_id)", dbi, NULL, NULL);
 			tagsistant_query("create index objectname_index on objects (objectname)", dbi, NULL, NULL);
 			tagsistant_query("create index symlink_index on objects (symlink, inode)", dbi, NULL, NULL);
 			tagsistant_query("create index checksum_index on objects (checksum, inode)", dbi, NULL, NULL);
 			tagsistant_query("create index relations_type_index on relations (relation)", dbi, NULL, NULL);
 			tagsistant_query("create index aliases_index on aliases (alias)", dbi, NULL, NULL);
+			tagsistant_query("create index tagging_tag_index on tagging (tag_id, inode)", dbi, NULL, NULL);
+			tagsistant_query("create index object_chunks_index on object_chunks (inode, chunk_offset)", dbi, NULL, NULL);
 			break;
 
 		default:
 			break;
 	}
 
+	/* add the strong_checksum column to the repositories created before it */
+	int unused = 0;
+	if (!tagsistant_query("select count(1) from objects where strong_checksum = ''", dbi, tagsistant_return_integer, &unused)) {
+		dbg('s', LOG_INFO, "Adding the strong_checksum column to the objects table");
+		tagsistant_query(
+			"alter table objects add column strong_checksum %s not null default ''",
+			dbi, NULL, NULL,
+			(TAGSISTANT_DBI_MYSQL_BACKEND == tagsistant.sql_database_driver) ? "varchar(40)" : "text(40)");
+	}
+
 	tagsistant_commit_transaction(dbi);
 	tagsistant_db_connection_release(dbi, 1);
 }
@@ -738,6 +1015,12 @@ void tagsistant_sql_create_tag(dbi_conn conn, const gchar *namespace, const gcha
 		namespace,
 		_safe_string(key),
 		_safe_string(value));
+
+	/* index the value of triple tags for the inc/ operator */
+	if (value && strlen(value)) {
+		tagsistant_tag_id tag_id = tagsistant_sql_get_tag_id(conn, namespace, _safe_string(key), value);
+		tagsistant_sql_index_tag_value(conn, tag_id, value);
+	}
 }
 
 /**
@@ -856,8 +1139,10 @@ void tagsistant_remove_tag_from_cache(const gchar *tagname, const gchar *key, co
  * @param tagname the name of the tag or the namespace of a triple tag
  * @param key the key of a triple tag
  * @param value the value of a triple tag
+ * @return the id of the deleted tag, to be removed from the relations
+ *   graph by the caller once the transaction is committed
  */
-void tagsistant_sql_delete_tag(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value)
+tagsistant_inode tagsistant_sql_delete_tag(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value)
 {
 	tagsistant_inode tag_id = tagsistant_sql_get_tag_id(conn, tagname, _safe_string(key), _safe_string(value));
 	tagsistant_remove_tag_from_cache(tagname, _safe_string(key), _safe_string(value));
@@ -873,6 +1158,13 @@ void tagsistant_sql_delete_tag(dbi_conn conn, const gchar *tagname, const gchar
 	tagsistant_query(
 		"delete from relations where tag1_id = '%d' or tag2_id = '%d'",
 		conn, NULL, NULL, tag_id, tag_id);
+
+#if TAGSISTANT_ENABLE_TRIGRAM_INDEX
+	if (TAGSISTANT_DBI_SQLITE_BACKEND == tagsistant.sql_database_driver)
+		tagsistant_query("delete from tag_trigrams where tag_id = %u", conn, NULL, NULL, tag_id);
+#endif
+
+	return (tag_id);
 }
 
 /**
@@ -892,6 +1184,16 @@ void tagsistant_sql_tag_object(
 	const gchar *_key = key ? key : "";
 	const gchar *_value = value ? value : "";
 
+	/*
+	 * version 0 plugins tag with the connection of their querytree, which
+	 * is not held while the plugin chain runs: collect their tags instead
+	 */
+	if (!conn) {
+		if (!tagsistant_plugin_collect_tag(tagname, key, value))
+			dbg('s', LOG_ERR, "Tagging object %d as %s without a connection", inode, tagname);
+		return;
+	}
+
 	tagsistant_inode tag_id = tagsistant_sql_get_tag_id(conn, tagname, _key, _value);
 	if (!tag_id) {
 		tagsistant_sql_create_tag(conn, tagname, _key, _value);
@@ -907,6 +1209,75 @@ void tagsistant_sql_tag_object(
 	tagsistant_query("insert into tagging(tag_id, inode) values('%d', '%d')", conn, NULL, NULL, tag_id, inode);
 }
 
+/**
+ * Insert a set of rows into tagging. Duplicated rows are skipped
+ * by the database instead of failing the whole statement.
+ *
+ * @param conn dbi_conn reference
+ * @param rows the "(tag_id, inode), ..." list of rows
+ */
+static void tagsistant_sql_insert_tagging_rows(dbi_conn conn, GString *rows)
+{
+	if (!rows->len) return;
+
+	tagsistant_query(
+		"%s into tagging(tag_id, inode) values %s",
+		conn, NULL, NULL,
+		(TAGSISTANT_DBI_MYSQL_BACKEND == tagsistant.sql_database_driver) ? "insert ignore" : "insert or ignore",
+		rows->str);
+
+	g_string_truncate(rows, 0);
+}
+
+/**
+ * Tag an object with a set of tags. Each tag is resolved once
+ * (through the tag_id cache, when enabled) and created if missing,
+ * then the object is tagged with multi-row inserts.
+ *
+ * @param conn dbi_conn reference
+ * @param tags a GArray of tagsistant_tag_triple
+ * @param inode the object inode
+ */
+void tagsistant_sql_tag_object_many(dbi_conn conn, GArray *tags, tagsistant_inode inode)
+{
+	if (!tags || !tags->len || !inode) return;
+
+	GHashTable *tagged = g_hash_table_new(NULL, NULL);
+	GString *rows = g_string_sized_new(TAGSISTANT_TAGGING_ROWS_PER_INSERT * 16);
+	guint row_count = 0;
+	guint i;
+
+	for (i = 0; i < tags->len; i++) {
+		tagsistant_tag_triple *triple = &g_array_index(tags, tagsistant_tag_triple, i);
+		const gchar *_key = triple->key ? triple->key : "";
+		const gchar *_value = triple->value ? triple->value : "";
+
+		tagsistant_tag_id tag_id = tagsistant_sql_get_tag_id(conn, triple->tagname, _key, _value);
+		if (!tag_id) {
+			tagsistant_sql_create_tag(conn, triple->tagname, _key, _value);
+			tag_id = tagsistant_sql_get_tag_id(conn, triple->tagname, _key, _value);
+		}
+
+		/* a plugin chain can emit the same tag more than once */
+		if (!tag_id || g_hash_table_contains(tagged, GUINT_TO_POINTER(tag_id))) continue;
+		g_hash_table_add(tagged, GUINT_TO_POINTER(tag_id));
+
+		dbg('s', LOG_INFO, "Tagging object %u as %s:%s=%s (%u)", inode, triple->tagname, _key, _value, tag_id);
+
+		g_string_append_printf(rows, "%s(%u, %u)", rows->len ? ", " : "", tag_id, inode);
+
+		if (++row_count == TAGSISTANT_TAGGING_ROWS_PER_INSERT) {
+			tagsistant_sql_insert_tagging_rows(conn, rows);
+			row_count = 0;
+		}
+	}
+
+	tagsistant_sql_insert_tagging_rows(conn, rows);
+
+	g_string_free(rows, TRUE);
+	g_hash_table_destroy(tagged);
+}
+
 /**
  * Untag an object
  *
@@ -937,6 +1308,9 @@ void tagsistant_sql_untag_object(dbi_conn conn, const gchar *tagname, const gcha
  * @param conn dbi_conn reference
  * @param tagname the new name of the tag
  * @param oldtagname the old name of the tag
+ *
+ * The caller invalidates the reasoning cache once the transaction is
+ * committed, like tagsistant_rename() does.
  */
 void tagsistant_sql_rename_tag(dbi_conn conn, const gchar *tagname, const gchar *oldtagname)
 {
@@ -70,6 +70,8 @@ extern int tagsistant_return_string(void *return_string, dbi_result result);
 extern int tagsistant_return_integer(void *return_integer, dbi_result result);
 
 extern void tagsistant_db_connection_release(dbi_conn dbi, gboolean is_writer_locked);
+extern dbi_conn tagsistant_db_worker_connection();
+extern void tagsistant_db_worker_connection_release(dbi_conn dbi);
 
 /**
  * transactions are started by default in tagsistant_db_connection()
@@ -90,10 +92,21 @@ extern void tagsistant_db_connection_release(dbi_conn dbi, gboolean is_writer_lo
  * SQL QUERIES *
 \***************/
 
+/** a (partial) triple tag, as collected by tagsistant_sql_tag_object_many() */
+typedef struct {
+	const gchar *tagname;
+	const gchar *key;
+	const gchar *value;
+} tagsistant_tag_triple;
+
+/** rows sent in a single multi-row insert into tagging */
+#define TAGSISTANT_TAGGING_ROWS_PER_INSERT 256
+
 extern void				tagsistant_sql_create_tag(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value);
 extern tagsistant_inode	tagsistant_sql_get_tag_id(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value);
-extern void				tagsistant_sql_delete_tag(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value);
+extern tagsistant_inode	tagsistant_sql_delete_tag(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value);
 extern void				tagsistant_sql_tag_object(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value, tagsistant_inode inode);
+extern void				tagsistant_sql_tag_object_many(dbi_conn conn, GArray *tags, tagsistant_inode inode);
 extern void				tagsistant_sql_untag_object(dbi_conn conn, const gchar *tagname, const gchar *key, const gchar *value, tagsistant_inode inode);
 extern void				tagsistant_sql_rename_tag(dbi_conn conn, const gchar *tagname, const gchar *oldtagname);
 extern tagsistant_inode	tagsistant_last_insert_id(dbi_conn conn);
@@ -107,6 +120,9 @@ extern void				tagsistant_sql_alias_delete(dbi_conn conn, const gchar *alias);
 extern void				tagsistant_sql_alias_set(dbi_conn conn, const gchar *alias, const gchar *query);
 extern gchar *			tagsistant_sql_alias_get(dbi_conn conn, const gchar *alias);
 extern size_t			tagsistant_sql_alias_get_length(dbi_conn conn, const gchar *alias);
+extern void				tagsistant_sql_index_tag_value(dbi_conn conn, tagsistant_tag_id tag_id, const gchar *value);
+extern int				tagsistant_sql_index_tag_value_callback(void *conn, dbi_result result);
+extern gchar *			tagsistant_sql_trigram_filter(const gchar *pattern);
 
 /**
  * Prepare a key for saving a tag_id inside the cache
@@ -91,10 +91,46 @@ static void *tagsistant_init(void)
 
 #endif
 
+/*
+ * The interactive operations are timed, so the background
+ * workers can back off when the foreground gets slow
+ */
+static int tagsistant_timed_getattr(const char *path, struct stat *stbuf)
+{
+	gint64 start = g_get_monotonic_time();
+	int res = tagsistant_getattr(path, stbuf);
+	tagsistant_background_sample(g_get_monotonic_time() - start);
+	return(res);
+}
+
+static int tagsistant_timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	gint64 start = g_get_monotonic_time();
+	int res = tagsistant_readdir(path, buf, filler, offset, fi);
+	tagsistant_background_sample(g_get_monotonic_time() - start);
+	return(res);
+}
+
+static int tagsistant_timed_open(const char *path, struct fuse_file_info *fi)
+{
+	gint64 start = g_get_monotonic_time();
+	int res = tagsistant_open(path, fi);
+	tagsistant_background_sample(g_get_monotonic_time() - start);
+	return(res);
+}
+
+static int tagsistant_timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	gint64 start = g_get_monotonic_time();
+	int res = tagsistant_read(path, buf, size, offset, fi);
+	tagsistant_background_sample(g_get_monotonic_time() - start);
+	return(res);
+}
+
 static struct fuse_operations tagsistant_oper = {
-    .getattr	= tagsistant_getattr,
+    .getattr	= tagsistant_timed_getattr,
     .readlink	= tagsistant_readlink,
-    .readdir	= tagsistant_readdir,
+    .readdir	= tagsistant_timed_readdir,
     .mknod		= tagsistant_mknod,
     .mkdir		= tagsistant_mkdir,
     .symlink	= tagsistant_symlink,
@@ -106,8 +142,8 @@ static struct fuse_operations tagsistant_oper = {
     .chown		= tagsistant_chown,
     .truncate	= tagsistant_truncate,
     .utime		= tagsistant_utime,
-    .open		= tagsistant_open,
-    .read		= tagsistant_read,
+    .open		= tagsistant_timed_open,
+    .read		= tagsistant_timed_read,
     .write		= tagsistant_write,
     .flush		= tagsistant_flush,
 //    .release	= tagsistant_release,
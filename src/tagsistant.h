@@ -68,14 +68,35 @@
 /** cache inode resolution queries? */
 #define TAGSISTANT_ENABLE_AND_SET_CACHE 0
 
-/** cache reasoner queries? */
-#define TAGSISTANT_ENABLE_REASONER_CACHE 0
+/** cache reasoner results? (enabled at runtime by [Reasoner] cache in repository.ini) */
+#define TAGSISTANT_ENABLE_REASONER_CACHE 1
+
+/** default maximum number of relation levels followed by the reasoner */
+#define TAGSISTANT_REASONER_MAX_DEPTH 16
+
+/** index triple tag values by trigrams to speed up inc/ queries (SQLite only) */
+#define TAGSISTANT_ENABLE_TRIGRAM_INDEX 1
 
 /** enable the autotagging plugin stack? */
 #define TAGSISTANT_ENABLE_AUTOTAGGING 1
 
+/** parse the headers of JPEG, PNG, GIF, MP3 and Ogg files without libextractor */
+#define TAGSISTANT_ENABLE_NATIVE_EXTRACTORS 1
+
 /** inline deduplication in main thread or schedule files for deduplication in a separate thread? */
-#define TAGSISTANT_INLINE_DEDUPLICATION 1
+#define TAGSISTANT_INLINE_DEDUPLICATION 0
+
+/** default maximum number of files waiting for the deduplication workers */
+#define TAGSISTANT_DEDUPLICATION_QUEUE_SIZE 1024
+
+/** default time (in milliseconds) an object must stay unchanged before being deduplicated */
+#define TAGSISTANT_DEDUPLICATION_SETTLE_DELAY 2000
+
+/** checksum files while they are written sequentially, instead of reading them again for deduplication */
+#define TAGSISTANT_ENABLE_STREAMING_CHECKSUM 1
+
+/** keep an in-memory index of the checksums to find duplicates without querying the database */
+#define TAGSISTANT_ENABLE_CHECKSUM_INDEX 1
 
 /** enable filehandle caching between open(), read(), write() and release() calls */
 #define TAGSISTANT_ENABLE_FILE_HANDLE_CACHING 1
@@ -84,7 +105,7 @@
 #define TAGSISTANT_VERBOSE_LOGGING 0
 
 /** the maximum length of the buffer used to store dynamic /stats files */
-#define TAGSISTANT_STATS_BUFFER 2048
+#define TAGSISTANT_STATS_BUFFER 4096
 
 /** the maximum length of a query bookmarked as an alias */
 #define TAGSISTANT_ALIAS_MAX_LENGTH 1024
@@ -249,6 +270,33 @@ extern GAsyncQueue *tagsistant_autotag_queue;
 /** starts deduplication on a path */
 extern void tagsistant_deduplicate(gchar *path);
 
+/** checksum files while they are written */
+extern void tagsistant_checksum_stream_open(int fd, tagsistant_inode inode);
+extern void tagsistant_checksum_stream_update(int fd, tagsistant_inode inode, const char *buf, size_t size, off_t offset);
+extern void tagsistant_checksum_stream_invalidate(tagsistant_inode inode);
+extern void tagsistant_checksum_stream_close(int fd, int keep);
+
+/** progress of the checksum backfill run at mount */
+extern void tagsistant_checksum_backfill_stats(int *running, int *total, int *queued, guint64 *bytes, tagsistant_inode *cursor);
+extern void tagsistant_work_queues_stats(
+	int *deduplication_queued, int *deduplication_coalesced, int *deduplication_dropped,
+	int *autotagging_queued, int *autotagging_coalesced, int *autotagging_dropped);
+
+/** CPU and I/O budgets of the background workers */
+extern void tagsistant_background_sample(gint64 latency);
+extern void tagsistant_background_stats(int *active, gint64 *p95, int *congested);
+extern void tagsistant_background_throttle(guint64 bytes);
+
+/** read an object for the plugins */
+extern GByteArray *tagsistant_read_object(const gchar *full_archive_path);
+
+/** objects kept as lists of content-defined chunks */
+extern gboolean tagsistant_chunk_store_is_chunked(tagsistant_inode inode);
+extern gboolean tagsistant_chunk_store_pin(tagsistant_inode inode, const gchar *full_archive_path, gboolean writing);
+extern void tagsistant_chunk_store_unpin(tagsistant_inode inode, int fd);
+extern void tagsistant_chunk_store_close(int fd);
+extern ssize_t tagsistant_chunk_store_pread(int fd, void *buf, size_t size, off_t offset);
+
 /**
  * g_free() a symbol only if it's not NULL
  *
@@ -295,7 +343,7 @@ extern void tagsistant_plugin_unloader();
 extern void tagsistant_deduplication_init();
 
 // call the plugin stack
-extern int tagsistant_process(gchar *path, gchar *full_archive_path);
+extern int tagsistant_process(gchar *path, gchar *full_archive_path, const guchar *data, gsize size);
 
 // used by plugins to apply regex to file content
 extern void tagsistant_plugin_apply_regex(const tagsistant_querytree *qtree, const char *buf, GMutex *m, GRegex *rx);
@@ -310,13 +358,13 @@ extern gboolean tagsistant_is_tags_list_file(tagsistant_querytree *qtree);
 extern gchar *tagsistant_string_tags_list_suffix(tagsistant_querytree *qtree);
 
 /**
- * invalidate object checksum
+ * invalidate object checksum, the fingerprint and the strong hash
  *
  * @param inode the object inode
  * @param dbi_conn a valid DBI connection
  */
 #define tagsistant_invalidate_object_checksum(inode, dbi_conn)\
-	tagsistant_query("update objects set checksum = '' where inode = %d", dbi_conn, NULL, NULL, inode)
+	tagsistant_query("update objects set checksum = '', strong_checksum = '' where inode = %d", dbi_conn, NULL, NULL, inode)
 
 // read and write repository.ini file
 extern GKeyFile *tagsistant_ini;
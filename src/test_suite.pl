@@ -91,8 +91,11 @@ test("readlink $MP/store/tag3/@/file1");
 test("ls -la $MP/archive/");
 test("ls -la $MP/store/tag1/@");
 test("stat $MP/store/tag1/+/tag2/@/file1");
+test("ls $MP/store/tag1/+/tag2/+/tag3/@");
+out_test('file1');
 test("stat $MP/store/tag1/tag2/@/file1");
 test("stat $MP/store/tag1/-/tag2/@/file1", 1);
+test("ls $MP/store/tag1/-/tag2/@ | grep -q '^file1\$'", 1);
 test("diff $MP/store/tag1/@/file1 $MP/store/tag2/@/file1");
 
 #
@@ -182,6 +185,15 @@ test("stat $MP/store/time:/year/gt/2005/@@/*___file8");
 test("ls $MP/store/time:/year/gt/1999/@@/*___file7");
 test("stat $MP/store/time:/year/lt/3000/@/*___file8");
 
+#
+# triple tags: the inc/ operator, with and without the trigram index
+#
+test("ls $MP/store/time:/year/inc/201/@@");
+out_test('file8');
+test("ls $MP/store/time:/year/inc/10/@@");
+out_test('file8');
+test("ls $MP/store/time:/year/inc/2000/@@/*___file7");
+
 #
 # relations: the includes/ and is_equivalent/ relations
 #
@@ -219,6 +231,13 @@ test("stat $MP/store/tag4/@@/dirobj/file10");
 test("stat $MP/stats/configuration");
 test("cat $MP/stats/configuration");
 out_test("mountpoint: $MP");
+test("cat $MP/stats/reasoner_cache");
+out_test('# of hits: ');
+test("cat $MP/stats/checksum_backfill");
+out_test('# of scheduled objects: ');
+test("cat $MP/stats/queues");
+out_test('# of coalesced jobs: ');
+out_test('# of active workers: ');
 
 #
 # the alias/ dir
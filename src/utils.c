@@ -342,6 +342,29 @@ void tagsistant_manage_repository_ini() {
 	tagsistant_set_init_default(tagsistant_ini, "mime:application/ogg",	"filter", "^(year|album|artist)$");
 	tagsistant_set_init_default(tagsistant_ini, "mime:audio/mpeg",		"filter", "^(year|album|artist)$");
 
+	// set default reasoner options
+	tagsistant_set_init_default(tagsistant_ini, "Reasoner", "max_depth", "16");
+	tagsistant_set_init_default(tagsistant_ini, "Reasoner", "cache", "true");
+
+	// set default deduplication options (workers defaults to the number of CPUs)
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "queue_size", "1024");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "settle_delay", "2000");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "mode", "staged");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "hash", "sha1");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "merge", "retag");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "chunk_store", "false");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "chunk_min_file_size", "8388608");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "backfill_files_per_second", "200");
+	tagsistant_set_init_default(tagsistant_ini, "Deduplication", "backfill_bytes_per_second", "33554432");
+
+	// set default budgets of the background workers (max_active 0 means all the workers)
+	tagsistant_set_init_default(tagsistant_ini, "Background", "io_class", "idle");
+	tagsistant_set_init_default(tagsistant_ini, "Background", "io_priority", "7");
+	tagsistant_set_init_default(tagsistant_ini, "Background", "nice", "10");
+	tagsistant_set_init_default(tagsistant_ini, "Background", "bytes_per_second", "0");
+	tagsistant_set_init_default(tagsistant_ini, "Background", "max_active", "0");
+	tagsistant_set_init_default(tagsistant_ini, "Background", "latency_threshold", "50");
+
 	// save and free the GKeyFile object
 	tagsistant_save_repository_ini(tagsistant_ini);
 }